@@ -0,0 +1,202 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <utility>
+#include <vector>
+
+/**
+ * Decides which requests may run, see "Admission control" in docs/protocol.md.
+ *
+ * At most `max_running` requests run at once and at most `max_queued` wait for a slot; a request that finds a free slot
+ * never counts against the latter. Waiting requests run in the order of their deadlines, the arrival plus the timeout
+ * the client sent, and requests without a timeout after all others in the order they arrived. The queue learns how
+ * long a request usually runs and gives up on waiting requests that could not finish before their deadline anymore,
+ * counting the requests ahead of them, so that the slots go to requests that still can.
+ *
+ * @tparam T a waiting request
+ */
+template<typename T>
+class AdmissionQueue {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        /**
+         * @param max_running requests that may run at once
+         * @param max_queued requests that may wait for a slot
+         */
+        AdmissionQueue(size_t max_running, size_t max_queued)
+                : max_running(std::max<size_t>(1, max_running)), max_queued(max_queued), running(0),
+                  estimate(0), rejected(0), expired(0) {
+        }
+
+        /**
+         * @param timeout the timeout of the request in seconds, 0 for none
+         * @return the latest time at which a request may finish
+         */
+        static auto getDeadline(Clock::time_point arrival, int timeout) -> Clock::time_point {
+            if (timeout <= 0)
+                return Clock::time_point::max();
+            return arrival + std::chrono::seconds(timeout);
+        }
+
+        /**
+         * Queues a request, which `start` hands out right away if a slot is free
+         * @return false if the request would have to wait and the queue is full, it is not moved then
+         */
+        auto push(T &&request, Clock::time_point deadline) -> bool {
+            const size_t free_slots = max_running - std::min(running, max_running);
+            if (waiting.size() + 1 > max_queued + free_slots) {
+                // the request is left to the caller, who has to answer it
+                rejected++;
+                return false;
+            }
+            // requests with the same deadline stay in the order they arrived
+            waiting.emplace(deadline, std::move(request));
+            return true;
+        }
+
+        /**
+         * Removes the waiting requests that cannot finish before their deadline anymore.
+         * Call it after starting all requests that fit, so that it only sees requests that really have to wait.
+         */
+        auto takeExpired(Clock::time_point now) -> std::vector<T> {
+            std::vector<T> hopeless;
+            size_t position = 0;
+            for (auto entry = waiting.begin(); entry != waiting.end();) {
+                if (entry->first != Clock::time_point::max() && entry->first < now + getExpectedFinish(position)) {
+                    hopeless.push_back(std::move(entry->second));
+                    entry = waiting.erase(entry);
+                } else {
+                    ++entry;
+                    position++;
+                }
+            }
+            expired += hopeless.size();
+            return hopeless;
+        }
+
+        /**
+         * Takes the waiting request with the earliest deadline if a slot is free and marks it as running
+         * @return false if no request may start
+         */
+        auto start(T &request) -> bool {
+            if (waiting.empty() || running >= max_running)
+                return false;
+            request = std::move(waiting.begin()->second);
+            waiting.erase(waiting.begin());
+            running++;
+            return true;
+        }
+
+        /**
+         * Frees the slot of a request and learns from its duration
+         */
+        void finish(double seconds) {
+            if (running > 0)
+                running--;
+            // an exponential moving average follows changes of the load within a few requests
+            estimate = estimate == 0 ? seconds : 0.8 * estimate + 0.2 * seconds;
+        }
+
+        /**
+         * Frees the slot of a request that could not be started
+         */
+        void release() {
+            if (running > 0)
+                running--;
+        }
+
+        /**
+         * @return when the next waiting request expires, or `Clock::time_point::max()` if none will
+         */
+        auto getNextExpiry() const -> Clock::time_point {
+            auto next = Clock::time_point::max();
+            size_t position = 0;
+            for (const auto &entry : waiting) {
+                if (entry.first == Clock::time_point::max())
+                    break;
+                next = std::min(next, entry.first - getExpectedFinish(position++));
+            }
+            return next;
+        }
+
+        /**
+         * @return how long a rejected client should wait before it tries again, in milliseconds
+         */
+        auto getRetryAfter() const -> long {
+            // until the queue and the running requests have drained
+            const double rounds = std::ceil(static_cast<double>(waiting.size() + running) / max_running);
+            return std::max(100L, static_cast<long>(std::max(1.0, rounds) * estimate * 1000));
+        }
+
+        template<typename Function>
+        void forEachQueued(Function function) const {
+            for (const auto &entry : waiting)
+                function(entry.second);
+        }
+
+        auto getMaxRunning() const -> size_t {
+            return max_running;
+        }
+
+        auto getRunning() const -> size_t {
+            return running;
+        }
+
+        auto getQueued() const -> size_t {
+            return waiting.size();
+        }
+
+        /**
+         * @return the number of requests that were rejected because the queue was full
+         */
+        auto getRejected() const -> size_t {
+            return rejected;
+        }
+
+        /**
+         * @return the number of requests that were given up because of their deadline
+         */
+        auto getExpired() const -> size_t {
+            return expired;
+        }
+
+    private:
+        /**
+         * @param position the number of requests that wait ahead of a request
+         * @return how long it takes until that request would finish: the requests running now are half done on
+         *         average, every `max_running` requests ahead add another round, and then it runs itself
+         */
+        auto getExpectedFinish(size_t position) const -> Clock::duration {
+            const double rounds = static_cast<double>(position / max_running) + 0.5 + 1.0;
+            return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(rounds * estimate));
+        }
+
+        size_t max_running;
+        size_t max_queued;
+        size_t running;
+        std::multimap<Clock::time_point, T> waiting;
+        double estimate; // seconds a request runs on average, 0 until one finished
+        size_t rejected;
+        size_t expired;
+};
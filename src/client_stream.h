@@ -0,0 +1,403 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+#include "util/binarystream.h"
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+
+/**
+ * @return whether a socket is a Unix domain socket, so that file descriptors can be passed over it
+ */
+bool is_unix_socket(int fd) {
+    struct sockaddr_storage address{};
+    socklen_t length = sizeof(address);
+    if (getsockname(fd, reinterpret_cast<struct sockaddr *>(&address), &length) != 0)
+        return false;
+    return address.ss_family == AF_UNIX;
+}
+
+/**
+ * The connection to the client as seen by a request.
+ *
+ * Usually this is just the `BinaryStream`. On a Unix domain socket whose client announced `FD_PAYLOADS`, a message may
+ * instead be stored in a sealed memory file that is passed with `SCM_RIGHTS` along with an empty message, see
+ * "File descriptor payloads" in docs/protocol.md. The bytes then never pass through the socket.
+ */
+class ClientStream {
+    public:
+        /**
+         * @param stream the connection to the client
+         * @param fd the socket behind `stream`
+         * @param fd_payloads whether messages may carry memory files
+         * @param min_size large messages of at least this many bytes are sent as memory files
+         */
+        ClientStream(BinaryStream &stream, int fd, bool fd_payloads, size_t min_size)
+                : stream(stream), fd(fd), fd_payloads(fd_payloads), min_size(min_size), bytes_received(0),
+                  bytes_sent(0) {
+        }
+
+        ClientStream(const ClientStream &) = delete;
+        ClientStream &operator=(const ClientStream &) = delete;
+
+        auto usesFileDescriptors() const -> bool {
+            return fd_payloads;
+        }
+
+        /**
+         * @return the bytes of all messages read so far, whether they came through the socket or a memory file
+         */
+        auto getBytesReceived() const -> uint64_t {
+            return bytes_received;
+        }
+
+        /**
+         * @return the bytes of all messages written so far
+         */
+        auto getBytesSent() const -> uint64_t {
+            return bytes_sent;
+        }
+
+        void read(BinaryReadBuffer &buffer) {
+            // most messages come inline, only look for a file before letting the stream read them
+            char header[sizeof(size_t)];
+            if (!fd_payloads || !peekHeader(header, sizeof(header))) {
+                stream.read(buffer);
+                bytes_received += buffer.getPayloadSize();
+                return;
+            }
+
+            // the memory file holds the whole message including its size
+            int memory_fd = receiveMemoryFile();
+            lseek(memory_fd, 0, SEEK_SET);
+            BinaryStream memory(memory_fd, memory_fd);
+            memory.read(buffer);
+            bytes_received += buffer.getPayloadSize();
+        }
+
+        /**
+         * Reads a message into memory that the caller provides instead of a buffer, e.g. a slot of the source cache
+         * @param tag_size bytes at the start of the payload that `allocate` gets to see, e.g. the index of a batch
+         *  reply, at most 8
+         * @param allocate gets the size of the payload and its tag and returns where to store the payload, or
+         *  `nullptr` to read the message into `buffer` instead
+         * @param buffer receives the message if `allocate` declines it
+         * @return whether the payload went to the memory returned by `allocate`
+         */
+        auto readInto(size_t tag_size, const std::function<char *(size_t, const char *)> &allocate,
+                      BinaryReadBuffer &buffer) -> bool {
+            char header[sizeof(size_t) + sizeof(uint64_t)];
+            size_t size;
+            if (fd_payloads && peekHeader(header, sizeof(size_t) + tag_size)) {
+                int memory_fd = receiveMemoryFile();
+                const bool complete = pread(memory_fd, &size, sizeof(size), 0) == sizeof(size) &&
+                                      pread(memory_fd, header + sizeof(size_t), tag_size, sizeof(size_t)) ==
+                                      static_cast<ssize_t>(tag_size);
+                char *payload = complete && size >= tag_size ? allocate(size, header + sizeof(size_t)) : nullptr;
+                if (payload == nullptr) {
+                    lseek(memory_fd, 0, SEEK_SET);
+                    BinaryStream memory(memory_fd, memory_fd);
+                    memory.read(buffer);
+                    bytes_received += buffer.getPayloadSize();
+                    return false;
+                }
+
+                size_t offset = 0;
+                while (offset < size) {
+                    ssize_t r = pread(memory_fd, payload + offset, size - offset,
+                                      static_cast<off_t>(sizeof(size_t) + offset));
+                    if (r <= 0)
+                        break;
+                    offset += static_cast<size_t>(r);
+                }
+                ::close(memory_fd);
+                if (offset != size)
+                    throw NetworkException("ClientStream: memory file is shorter than its message");
+                bytes_received += size;
+                return true;
+            }
+
+            if (!fd_payloads)
+                peekHeader(header, sizeof(size_t) + tag_size);
+            memcpy(&size, header, sizeof(size));
+            char *payload = size >= tag_size ? allocate(size, header + sizeof(size_t)) : nullptr;
+            if (payload == nullptr) {
+                stream.read(buffer);
+                bytes_received += buffer.getPayloadSize();
+                return false;
+            }
+            readFully(header, sizeof(size_t));
+            readFully(payload, size);
+            bytes_received += size;
+            return true;
+        }
+
+        void write(BinaryWriteBuffer &buffer) {
+            stream.write(buffer);
+            bytes_sent += buffer.getSize();
+        }
+
+        /**
+         * Sends a message that may be large, as a memory file if the client supports it
+         */
+        void writeLarge(BinaryWriteBuffer &buffer) {
+            if (!fd_payloads) {
+                write(buffer);
+                return;
+            }
+
+            int memory_fd = memfd_create("rserver-payload", MFD_ALLOW_SEALING);
+            if (memory_fd < 0)
+                throw PlatformException(std::string("memfd_create() failed: ") + strerror(errno));
+            try {
+                {
+                    int stream_fd = dup(memory_fd);
+                    BinaryStream memory(stream_fd, stream_fd);
+                    memory.write(buffer);
+                }
+                const auto size = static_cast<size_t>(lseek(memory_fd, 0, SEEK_END));
+                bytes_sent += size - sizeof(size_t);
+                // the client maps the file, so it is only passed if it can no longer change
+                if (size < min_size || !seal(memory_fd))
+                    sendInline(memory_fd, size);
+                else
+                    sendMemoryFile(memory_fd);
+            } catch (...) {
+                ::close(memory_fd);
+                throw;
+            }
+            ::close(memory_fd);
+        }
+
+    private:
+        /**
+         * Looks at the start of the next message without consuming it
+         * @return whether a file descriptor comes with it
+         */
+        auto peekHeader(char *header, size_t size) -> bool {
+            int epoll_fd = -1;
+            try {
+                bool closed = false;
+                while (true) {
+                    struct iovec vector{header, size};
+                    char control[CMSG_SPACE(sizeof(int))];
+                    struct msghdr message{};
+                    message.msg_iov = &vector;
+                    message.msg_iovlen = 1;
+                    message.msg_control = control;
+                    message.msg_controllen = sizeof(control);
+
+                    ssize_t r = recvmsg(fd, &message, MSG_PEEK | MSG_WAITALL | MSG_CMSG_CLOEXEC);
+                    if (r < 0 && errno == EINTR)
+                        continue;
+                    if (r <= 0)
+                        throw NetworkException("ClientStream: connection closed while reading");
+
+                    // peeking installs a copy of the file descriptor, the real one is received with the header
+                    struct cmsghdr *control_header = CMSG_FIRSTHDR(&message);
+                    if (control_header != nullptr && control_header->cmsg_level == SOL_SOCKET &&
+                        control_header->cmsg_type == SCM_RIGHTS) {
+                        int peeked_fd;
+                        memcpy(&peeked_fd, CMSG_DATA(control_header), sizeof(int));
+                        ::close(peeked_fd);
+                        closeEpoll(epoll_fd);
+                        return true;
+                    }
+                    if (static_cast<size_t>(r) == size) {
+                        closeEpoll(epoll_fd);
+                        return false;
+                    }
+                    if (closed)
+                        throw NetworkException("ClientStream: connection closed while reading");
+
+                    // Unix domain sockets do not wait for more data when peeking, and poll() reports the socket as
+                    // readable as long as the first bytes are there. An edge triggered epoll waits for the rest.
+                    if (epoll_fd < 0)
+                        epoll_fd = createEpoll();
+                    struct epoll_event event{};
+                    int n = epoll_wait(epoll_fd, &event, 1, PEEK_TIMEOUT_MS);
+                    if (n < 0 && errno != EINTR)
+                        throw NetworkException(std::string("ClientStream: epoll_wait() failed: ") + strerror(errno));
+                    // peek once more, the rest may have arrived together with the hangup
+                    if (n > 0 && (event.events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)))
+                        closed = true;
+                }
+            } catch (...) {
+                closeEpoll(epoll_fd);
+                throw;
+            }
+        }
+
+        /**
+         * @return an epoll instance that reports each arrival of data on the socket once
+         */
+        auto createEpoll() -> int {
+            int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            if (epoll_fd < 0)
+                throw PlatformException(std::string("epoll_create1() failed: ") + strerror(errno));
+            struct epoll_event event{};
+            event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+                ::close(epoll_fd);
+                throw PlatformException(std::string("epoll_ctl() failed: ") + strerror(errno));
+            }
+            return epoll_fd;
+        }
+
+        static void closeEpoll(int epoll_fd) {
+            if (epoll_fd >= 0)
+                ::close(epoll_fd);
+        }
+
+        /**
+         * Receives the empty message that carries a memory file
+         * @return the memory file, which the client can no longer change
+         */
+        auto receiveMemoryFile() -> int {
+            size_t size;
+            int memory_fd = receiveHeader(size);
+            if (memory_fd < 0 || size != 0) {
+                if (memory_fd >= 0)
+                    ::close(memory_fd);
+                throw NetworkException("ClientStream: file descriptor passed with a non-empty message");
+            }
+            const int seals = fcntl(memory_fd, F_GET_SEALS);
+            if (seals < 0 || (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) != (F_SEAL_WRITE | F_SEAL_SHRINK)) {
+                ::close(memory_fd);
+                throw NetworkException("ClientStream: memory file is not sealed against writing");
+            }
+            return memory_fd;
+        }
+
+        /**
+         * Reads the size of the next message and a file descriptor that came with it
+         * @return the file descriptor or -1
+         */
+        auto receiveHeader(size_t &size) -> int {
+            int received_fd = -1;
+            auto bytes = reinterpret_cast<char *>(&size);
+            size_t offset = 0;
+            while (offset < sizeof(size)) {
+                struct iovec vector{bytes + offset, sizeof(size) - offset};
+                char control[CMSG_SPACE(sizeof(int))];
+                struct msghdr message{};
+                message.msg_iov = &vector;
+                message.msg_iovlen = 1;
+                message.msg_control = control;
+                message.msg_controllen = sizeof(control);
+
+                ssize_t r = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0) {
+                    if (received_fd >= 0)
+                        ::close(received_fd);
+                    throw NetworkException("ClientStream: connection closed while reading");
+                }
+                offset += static_cast<size_t>(r);
+
+                struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+                if (header != nullptr && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+                    if (received_fd >= 0)
+                        ::close(received_fd);
+                    memcpy(&received_fd, CMSG_DATA(header), sizeof(int));
+                }
+            }
+            return received_fd;
+        }
+
+        void readFully(char *data, size_t size) {
+            size_t offset = 0;
+            while (offset < size) {
+                ssize_t r = ::read(fd, data + offset, size - offset);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                    throw NetworkException("ClientStream: connection closed while reading");
+                offset += static_cast<size_t>(r);
+            }
+        }
+
+        void sendInline(int memory_fd, size_t size) {
+            off_t offset = 0;
+            while (static_cast<size_t>(offset) < size) {
+                ssize_t w = sendfile(fd, memory_fd, &offset, size - static_cast<size_t>(offset));
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0)
+                    throw NetworkException("ClientStream: could not send message");
+            }
+        }
+
+        /**
+         * @return whether the memory file is sealed against any change
+         */
+        static auto seal(int memory_fd) -> bool {
+            return fcntl(memory_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0;
+        }
+
+        /**
+         * Passes a sealed memory file along with an empty message
+         */
+        void sendMemoryFile(int memory_fd) {
+            size_t empty = 0;
+            struct iovec vector{&empty, sizeof(empty)};
+            char control[CMSG_SPACE(sizeof(int))];
+            memset(control, 0, sizeof(control));
+            struct msghdr message{};
+            message.msg_iov = &vector;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+
+            struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(header), &memory_fd, sizeof(int));
+
+            ssize_t w;
+            do {
+                w = sendmsg(fd, &message, MSG_NOSIGNAL);
+            } while (w < 0 && errno == EINTR);
+            if (w != static_cast<ssize_t>(sizeof(empty)))
+                throw NetworkException("ClientStream: could not send memory file");
+        }
+
+        /// milliseconds after which a peek is repeated even if no data arrived
+        static const int PEEK_TIMEOUT_MS = 100;
+
+        BinaryStream &stream;
+        int fd;
+        bool fd_payloads;
+        size_t min_size;
+        uint64_t bytes_received;
+        uint64_t bytes_sent;
+};
@@ -0,0 +1,165 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+#include "util/log.h"
+
+#include "message_codec.h"
+#include "message_socket.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Compresses a connection without touching the code that uses it.
+ *
+ * The request is served on one end of a socket pair, and a thread relays every message between the other end and the
+ * client, decoding incoming and encoding outgoing payloads with a `MessageCodec`. Payloads are decoded and encoded
+ * in the string they were received in where possible, so an uncompressed message is not copied. The relay stops
+ * reading from either side while more than `HIGH_WATER_MARK` bytes wait to be written to the other. Once the request
+ * closes its end, the relay sends what is left and stops.
+ */
+class CompressingRelay {
+    public:
+        /**
+         * @param fd the connection to the client, which stays open and is not used otherwise while the relay runs
+         * @param codec
+         */
+        CompressingRelay(int fd, MessageCodec codec) : client_fd(fd), client_flags(fcntl(fd, F_GETFL)),
+                                                       codec(std::move(codec)) {
+            int sockets[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0)
+                throw PlatformException(std::string("socketpair() failed: ") + strerror(errno));
+            local_fd = sockets[0];
+            relay_fd = sockets[1];
+
+            int client_copy = dup(fd);
+            if (client_copy < 0) {
+                ::close(local_fd);
+                ::close(relay_fd);
+                throw PlatformException(std::string("dup() failed: ") + strerror(errno));
+            }
+            client = std::unique_ptr<MessageSocket>(new MessageSocket(client_copy));
+            thread = std::thread(&CompressingRelay::run, this);
+        }
+
+        ~CompressingRelay() {
+            if (local_fd >= 0)
+                ::close(local_fd);
+            if (thread.joinable())
+                thread.join();
+            fcntl(client_fd, F_SETFL, client_flags);
+        }
+
+        CompressingRelay(const CompressingRelay &) = delete;
+        CompressingRelay &operator=(const CompressingRelay &) = delete;
+
+        /**
+         * @return the end of the socket pair the request is served on, the caller has to close it
+         */
+        auto releaseLocalFd() -> int {
+            int fd = local_fd;
+            local_fd = -1;
+            return fd;
+        }
+
+        /**
+         * Waits until everything the request sent has reached the client
+         * @return the counters of the codec
+         */
+        auto finish() -> MessageCodec::Stats {
+            if (thread.joinable())
+                thread.join();
+            return codec.getStats();
+        }
+
+        void logStats() const {
+            codec.logStats();
+        }
+
+    private:
+        void run() {
+            MessageSocket relay(relay_fd);
+            try {
+                bool request_open = true;
+                while (request_open || client->wantsWrite()) {
+                    const bool client_readable = relay.getQueuedBytes() < HIGH_WATER_MARK;
+                    const bool request_readable = request_open && client->getQueuedBytes() < HIGH_WATER_MARK;
+                    struct pollfd fds[2];
+                    fds[0] = {client->getFd(), static_cast<short>((client_readable ? POLLIN : 0) |
+                                                                  (client->wantsWrite() ? POLLOUT : 0)), 0};
+                    fds[1] = {relay.getFd(), static_cast<short>((request_readable ? POLLIN : 0) |
+                                                                (relay.wantsWrite() ? POLLOUT : 0)), 0};
+                    if (poll(fds, 2, -1) < 0) {
+                        if (errno == EINTR)
+                            continue;
+                        throw PlatformException(std::string("poll() failed: ") + strerror(errno));
+                    }
+
+                    std::vector<std::string> messages;
+                    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+                        bool open = client->receive(messages);
+                        for (auto &message : messages) {
+                            const size_t offset = codec.decode(message);
+                            relay.send(std::move(message), offset);
+                        }
+                        if (!open) {
+                            relay.flush();
+                            return; // the client is gone, the request fails on its next read or write
+                        }
+                    }
+                    if (request_open && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                        messages.clear();
+                        request_open = relay.receive(messages);
+                        for (auto &message : messages) {
+                            std::string head = codec.encode(message);
+                            client->send(std::move(message), 0, head);
+                        }
+                    }
+
+                    if (!client->flush())
+                        return;
+                    if (!relay.flush())
+                        request_open = false;
+                }
+            } catch (const std::exception &e) {
+                Log::warn("Compressing relay failed: %s", e.what());
+            }
+        }
+
+        /// bytes queued for one side, above which the other side is not read anymore
+        static const size_t HIGH_WATER_MARK = 4 * 1024 * 1024;
+
+        int client_fd;
+        int client_flags;
+        int local_fd;
+        int relay_fd;
+        std::unique_ptr<MessageSocket> client;
+        MessageCodec codec;
+        std::thread thread;
+};
@@ -0,0 +1,56 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "datatypes/simplefeaturecollection.h"
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Splits interleaved coordinates into separate x and y arrays, e.g. the two columns of a column major matrix.
+ *
+ * The loop has a constant stride and the pointers do not alias, so the compiler emits vector instructions for it.
+ *
+ * @param in `count` coordinates
+ * @param x destination for `count` x values
+ * @param y destination for `count` y values
+ * @param count number of coordinates
+ */
+void deinterleave_coordinates(const Coordinate *__restrict in, double *__restrict x, double *__restrict y,
+                              size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        x[i] = in[i].x;
+        y[i] = in[i].y;
+    }
+}
+
+/**
+ * Appends coordinates from separate x and y arrays, the inverse of `deinterleave_coordinates`
+ *
+ * @param x `count` x values
+ * @param y `count` y values
+ * @param count number of coordinates
+ * @param out the coordinates are appended to it
+ */
+void interleave_coordinates(const double *__restrict x, const double *__restrict y, size_t count,
+                            std::vector<Coordinate> &out) {
+    out.reserve(out.size() + count);
+    for (size_t i = 0; i < count; i++)
+        out.emplace_back(x[i], y[i]);
+}
@@ -0,0 +1,151 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/binarystream.h"
+#include "datatypes/simplefeaturecollection.h"
+#include "datatypes/pointcollection.h"
+#include "datatypes/linecollection.h"
+#include "datatypes/polygoncollection.h"
+
+#include "client_stream.h"
+#include "rserver_protocol.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Helper function that appends the offsets `source[begin + 1 .. end]` to a fresh offset vector, shifted so that they
+ * start at 0 like `source[begin]`
+ */
+template<typename Offsets>
+auto append_offsets(Offsets &target, const Offsets &source, size_t begin, size_t end) -> void {
+    const auto base = source[begin];
+    target.reserve(target.size() + end - begin);
+    for (size_t i = begin + 1; i <= end; i++)
+        target.push_back(source[i] - base);
+}
+
+/**
+ * Helper functions that copy the geometry of the features `[begin, end)` into an empty collection
+ */
+inline auto copy_geometry(const PointCollection &from, PointCollection &to, size_t begin, size_t end) -> void {
+    to.coordinates.assign(from.coordinates.begin() + from.start_feature[begin],
+                          from.coordinates.begin() + from.start_feature[end]);
+    append_offsets(to.start_feature, from.start_feature, begin, end);
+}
+
+inline auto copy_geometry(const LineCollection &from, LineCollection &to, size_t begin, size_t end) -> void {
+    const size_t first_line = from.start_feature[begin];
+    const size_t last_line = from.start_feature[end];
+    to.coordinates.assign(from.coordinates.begin() + from.start_line[first_line],
+                          from.coordinates.begin() + from.start_line[last_line]);
+    append_offsets(to.start_line, from.start_line, first_line, last_line);
+    append_offsets(to.start_feature, from.start_feature, begin, end);
+}
+
+inline auto copy_geometry(const PolygonCollection &from, PolygonCollection &to, size_t begin, size_t end) -> void {
+    const size_t first_polygon = from.start_feature[begin];
+    const size_t last_polygon = from.start_feature[end];
+    const size_t first_ring = from.start_polygon[first_polygon];
+    const size_t last_ring = from.start_polygon[last_polygon];
+    to.coordinates.assign(from.coordinates.begin() + from.start_ring[first_ring],
+                          from.coordinates.begin() + from.start_ring[last_ring]);
+    append_offsets(to.start_ring, from.start_ring, first_ring, last_ring);
+    append_offsets(to.start_polygon, from.start_polygon, first_polygon, last_polygon);
+    append_offsets(to.start_feature, from.start_feature, begin, end);
+}
+
+/**
+ * Copies the consecutive features `[begin, end)` of a collection into a new collection with the same reference and
+ * global attributes. Unlike `filter()` this only touches the copied features.
+ */
+template<typename Collection>
+auto copy_feature_range(const Collection &collection, size_t begin, size_t end) -> std::unique_ptr<Collection> {
+    auto chunk = std::make_unique<Collection>(collection.stref);
+    copy_geometry(collection, *chunk, begin, end);
+    if (collection.hasTime())
+        chunk->time.assign(collection.time.begin() + begin, collection.time.begin() + end);
+    chunk->global_attributes = collection.global_attributes;
+
+    for (const auto &key : collection.feature_attributes.getNumericKeys()) {
+        const auto &attribute = collection.feature_attributes.numeric(key);
+        std::vector<double> values;
+        values.reserve(end - begin);
+        for (size_t i = begin; i < end; i++)
+            values.push_back(attribute.get(i));
+        chunk->feature_attributes.addNumericAttribute(key, attribute.unit, std::move(values));
+    }
+    for (const auto &key : collection.feature_attributes.getTextualKeys()) {
+        const auto &attribute = collection.feature_attributes.textual(key);
+        std::vector<std::string> values;
+        values.reserve(end - begin);
+        for (size_t i = begin; i < end; i++)
+            values.push_back(attribute.get(i));
+        chunk->feature_attributes.addTextualAttribute(key, attribute.unit, std::move(values));
+    }
+    return chunk;
+}
+
+/**
+ * Sends a feature collection as a header message followed by chunks of consecutive features, see "Chunked results"
+ * in docs/protocol.md.
+ *
+ * Every chunk is a collection of its own with the reference and global attributes of the whole, so only one chunk is
+ * serialized at a time and the client can start reading the first features while the rest is still being written.
+ * Chunks hold about `chunk_size` bytes of coordinates; a collection without features is sent as a single chunk.
+ *
+ * @param stream the connection to the client
+ * @param type the type of the collection, e.g. `RSERVER_TYPE_POINTS`
+ * @param collection a point, line or polygon collection
+ * @param chunk_size the number of bytes of coordinates per chunk
+ */
+template<typename Collection>
+void write_feature_stream(ClientStream &stream, char type, Collection &collection, size_t chunk_size) {
+    const size_t feature_count = collection.getFeatureCount();
+
+    BinaryWriteBuffer header;
+    header.write<char>(-RSERVER_TYPE_FEATURE_STREAM);
+    header.write<char>(type);
+    header.write<uint64_t>(feature_count);
+    stream.write(header);
+
+    if (feature_count == 0) {
+        BinaryWriteBuffer chunk;
+        chunk.write<uint64_t>(0);
+        chunk.write<Collection &>(collection, true);
+        stream.write(chunk);
+        return;
+    }
+
+    const size_t coordinate_bytes = std::max<size_t>(1, collection.coordinates.size() * sizeof(Coordinate));
+    const size_t features_per_chunk = std::max<size_t>(1, chunk_size * feature_count / coordinate_bytes);
+
+    for (size_t offset = 0; offset < feature_count; offset += features_per_chunk) {
+        const size_t count = std::min(features_per_chunk, feature_count - offset);
+        auto features = copy_feature_range(collection, offset, offset + count);
+
+        BinaryWriteBuffer chunk;
+        chunk.write<uint64_t>(count);
+        chunk.write<Collection &>(*features, true);
+        stream.write(chunk);
+    }
+}
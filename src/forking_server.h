@@ -0,0 +1,338 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+#include "util/binarystream.h"
+#include "util/log.h"
+
+#include "admission_queue.h"
+#include "header_reader.h"
+#include "listen_socket.h"
+#include "message_socket.h"
+#include "request_trace.h"
+#include "rserver_protocol.h"
+#include "rserver_request.h"
+#include "server_metrics.h"
+
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Forks a child for every request like the forked mode, but only runs a bounded number of them at once.
+ *
+ * The parent accepts connections, receives and parses the request headers without blocking and passes them through
+ * an `AdmissionQueue`: a request starts in a fresh child when a slot is free, waits in the queue otherwise and is
+ * rejected right away with an error and a retry hint when the queue is full. Waiting requests that could not finish
+ * before their timeout anymore are answered with an error instead of being started. The parent learns about finished
+ * children from a `signalfd`, so the slots are reused as soon as a child exits, whether it finished, failed or was
+ * killed.
+ */
+class RForkingServer {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        /// `fd` is the socket behind `stream`
+        using RequestHandler = std::function<void(BinaryStream &stream, int fd, const RServerRequest &request,
+                                                  const RequestArrival &arrival)>;
+        /// prepares a request in the parent before it forks, e.g. parses the script once for all children
+        using PrepareHandler = std::function<void(const RServerRequest &request)>;
+
+        /**
+         * @param handler runs a single request inside a child
+         * @param prepare runs in the parent right before a child is forked for a request
+         * @param max_running requests that may run at once
+         * @param max_queued requests that may wait for a slot
+         * @param metrics receives the state of the queue
+         */
+        RForkingServer(RequestHandler handler, PrepareHandler prepare, size_t max_running, size_t max_queued,
+                       ServerMetrics *metrics)
+                : handler(std::move(handler)), prepare(std::move(prepare)), admission(max_running, max_queued),
+                  headers(std::chrono::seconds(5)), signal_fd(-1), metrics(metrics) {
+        }
+
+        ~RForkingServer() {
+            for (int listen_fd : listen_fds)
+                ::close(listen_fd);
+            if (signal_fd >= 0)
+                ::close(signal_fd);
+        }
+
+        RForkingServer(const RForkingServer &) = delete;
+        RForkingServer &operator=(const RForkingServer &) = delete;
+
+        void listen(int portnr) {
+            listen_fds.push_back(listen_on_port(portnr));
+        }
+
+        /**
+         * Listen on a Unix domain socket as well, replacing a stale socket file
+         * @param path
+         * @param permissions of the socket file
+         */
+        void listen(const std::string &path, int permissions) {
+            listen_fds.push_back(listen_on_unix_socket(path, permissions));
+        }
+
+        /**
+         * Runs the accept loop. Does not return.
+         */
+        void start() {
+            if (listen_fds.empty())
+                throw PlatformException("RForkingServer::start(): call listen() first");
+
+            // SIGCHLD is only delivered through the signalfd, children unblock it again
+            sigset_t signals;
+            sigemptyset(&signals);
+            sigaddset(&signals, SIGCHLD);
+            if (sigprocmask(SIG_BLOCK, &signals, nullptr) != 0)
+                throw PlatformException(std::string("sigprocmask() failed: ") + strerror(errno));
+            signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+            if (signal_fd < 0)
+                throw PlatformException(std::string("signalfd() failed: ") + strerror(errno));
+
+            Log::info("Forking at most %zu requests at once", admission.getMaxRunning());
+
+            std::vector<struct pollfd> fds;
+            while (true) {
+                fds.clear();
+                for (int listen_fd : listen_fds)
+                    fds.push_back(pollfd{listen_fd, POLLIN, 0});
+                fds.push_back(pollfd{signal_fd, POLLIN, 0});
+                headers.addPollFds(fds);
+
+                if (poll(fds.data(), fds.size(), getPollTimeout()) < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    throw PlatformException(std::string("poll() failed: ") + strerror(errno));
+                }
+
+                const size_t signal_position = listen_fds.size();
+                if (fds[signal_position].revents != 0)
+                    reapChildren();
+                for (auto &header : headers.receive(&fds[signal_position + 1]))
+                    handleHeader(header);
+                for (size_t i = 0; i < listen_fds.size(); i++) {
+                    if (fds[i].revents & POLLIN)
+                        acceptConnection(listen_fds[i]);
+                }
+
+                dispatch();
+
+                metrics->setAdmissionStats(admission.getRunning(), admission.getQueued(), admission.getRejected(),
+                                           admission.getExpired());
+            }
+        }
+
+    private:
+        struct PendingConnection {
+            int fd;
+            RServerRequest request;
+            RequestArrival arrival;
+        };
+
+        struct Child {
+            Clock::time_point started;
+        };
+
+        void acceptConnection(int listen_fd) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0) {
+                Log::warn("accept() failed: %s", strerror(errno));
+                return;
+            }
+            headers.add(fd);
+        }
+
+        void handleHeader(HeaderReader::Header &header) {
+            try {
+                BinaryReadBuffer buffer;
+                MessageSocket::parse(header.payload, buffer);
+                RServerRequest request(buffer);
+                const RequestArrival arrival{header.received, Clock::now()};
+
+                if (request.isSession())
+                    throw ArgumentException("Multiplexed sessions require rserver.mode = pooled");
+                request.log();
+
+                const auto deadline = AdmissionQueue<PendingConnection>::getDeadline(arrival.received,
+                                                                                     request.timeout);
+                PendingConnection connection{header.fd, std::move(request), arrival};
+                if (!admission.push(std::move(connection), deadline)) {
+                    const long retry_after = admission.getRetryAfter();
+                    Log::warn("Rejecting request, %zu requests are waiting", admission.getQueued());
+                    sendError(header.fd, connection.request, "Server is overloaded, retry after " +
+                                                             std::to_string(retry_after) + " ms", retry_after);
+                }
+            } catch (const std::exception &e) {
+                Log::warn("Could not read request header: %s", e.what());
+                ::close(header.fd);
+            }
+        }
+
+        void dispatch() {
+            // every request that fits starts, only those that have to wait may expire
+            PendingConnection connection{-1, RServerRequest(), RequestArrival()};
+            while (admission.start(connection)) {
+                try {
+                    fork(connection);
+                } catch (const std::exception &e) {
+                    Log::error("Could not fork: %s", e.what());
+                    admission.release();
+                    sendError(connection.fd, connection.request, e.what());
+                    continue;
+                }
+                ::close(connection.fd);
+            }
+
+            for (auto &expired : admission.takeExpired(Clock::now())) {
+                Log::warn("Dropping request that cannot finish before its timeout of %d s", expired.request.timeout);
+                sendError(expired.fd, expired.request, "Server is overloaded, the request could not start "
+                                                       "before its timeout", admission.getRetryAfter());
+            }
+
+            if (admission.getQueued() > 0)
+                Log::info("Admission: %zu running, %zu waiting", admission.getRunning(), admission.getQueued());
+        }
+
+        void fork(const PendingConnection &connection) {
+            prepare(connection.request);
+
+            pid_t pid = ::fork();
+            if (pid < 0)
+                throw PlatformException(std::string("fork() failed: ") + strerror(errno));
+            if (pid > 0) {
+                children[pid] = Child{Clock::now()};
+                return;
+            }
+
+            // the child only keeps the connection of its request
+            for (int listen_fd : listen_fds)
+                ::close(listen_fd);
+            ::close(signal_fd);
+            admission.forEachQueued([](const PendingConnection &queued) { ::close(queued.fd); });
+            headers.closeAll();
+            sigset_t signals;
+            sigemptyset(&signals);
+            sigaddset(&signals, SIGCHLD);
+            sigprocmask(SIG_UNBLOCK, &signals, nullptr);
+
+            // the time spent waiting counts against the timeout
+            if (connection.request.timeout > 0) {
+                const auto deadline = AdmissionQueue<PendingConnection>::getDeadline(connection.arrival.received,
+                                                                                     connection.request.timeout);
+                const double remaining = std::chrono::duration<double>(deadline - Clock::now()).count();
+                alarm(static_cast<unsigned int>(std::max(1.0, std::ceil(remaining))));
+            }
+
+            int status = 0;
+            try {
+                BinaryStream stream(connection.fd, connection.fd);
+                handler(stream, connection.fd, connection.request, connection.arrival);
+            } catch (const std::exception &e) {
+                Log::warn("Request failed: %s", e.what());
+                status = 1;
+            }
+            exit(status);
+        }
+
+        void reapChildren() {
+            struct signalfd_siginfo info{};
+            while (::read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                // signals are coalesced, so the number of them says nothing
+            }
+
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                auto child = children.find(pid);
+                if (child == children.end())
+                    continue; // e.g. the metrics endpoint
+                if (WIFSIGNALED(status))
+                    Log::warn("Child %d was killed by signal %d", pid, WTERMSIG(status));
+                admission.finish(std::chrono::duration<double>(Clock::now() - child->second.started).count());
+                children.erase(child);
+            }
+        }
+
+        /**
+         * @return milliseconds until the next waiting request expires or a header times out, -1 for none
+         */
+        auto getPollTimeout() const -> int {
+            const int header_timeout = headers.getPollTimeout();
+            const auto expiry = admission.getNextExpiry();
+            if (expiry == Clock::time_point::max())
+                return header_timeout;
+            const auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    expiry - Clock::now()).count();
+            const auto bounded = std::max<long long>(0, std::min<long long>(milliseconds, 60 * 1000));
+            const int timeout = static_cast<int>(bounded) + 1;
+            return header_timeout < 0 ? timeout : std::min(timeout, header_timeout);
+        }
+
+        /**
+         * Answers a request that does not run with an error and closes its connection
+         * @param retry_after milliseconds after which the client should try again, -1 if the error is not caused by
+         *  load. Clients that announced `OVERLOADED` receive it in an `RSERVER_TYPE_OVERLOADED` message.
+         */
+        static void sendError(int fd, const RServerRequest &request, std::string message, long retry_after = -1) {
+            try {
+                BinaryStream stream(fd, fd);
+                // the client waits for the outcome of the codec negotiation first
+                if (request.hasCapability(RServerCapabilities::COMPRESSION)) {
+                    BinaryWriteBuffer codec;
+                    codec.write<uint8_t>(RServerCodecs::NONE);
+                    stream.write(codec);
+                }
+                BinaryWriteBuffer error;
+                if (retry_after >= 0 && request.hasCapability(RServerCapabilities::OVERLOADED)) {
+                    error.write<char>(-RSERVER_TYPE_OVERLOADED);
+                    error.write<std::string &>(message);
+                    error.write<int64_t>(retry_after);
+                } else {
+                    error.write<char>(-RSERVER_TYPE_ERROR);
+                    error.write<std::string &>(message);
+                }
+                stream.write(error);
+            } catch (const std::exception &e) {
+                Log::warn("Could not send error: %s", e.what());
+            }
+        }
+
+        RequestHandler handler;
+        PrepareHandler prepare;
+        AdmissionQueue<PendingConnection> admission;
+        HeaderReader headers;
+        std::vector<int> listen_fds;
+        int signal_fd;
+        std::map<pid_t, Child> children;
+        ServerMetrics *metrics;
+};
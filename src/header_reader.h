@@ -0,0 +1,198 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/log.h"
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Receives the headers of accepted connections inside a `poll()` loop, so that a slow client does not stall it.
+ *
+ * The client sends its header as a single `BinaryStream` message right after connecting. The sockets are read in
+ * nonblocking mode whenever they are readable, but never past the end of the header: whatever the client sends
+ * afterwards is left to the process that serves the request. A client that sends nothing for `timeout` is
+ * disconnected.
+ */
+class HeaderReader {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        /**
+         * A completely received header. Its socket is blocking again and belongs to the caller.
+         */
+        struct Header {
+            int fd;
+            /// the message without the size in front of it
+            std::string payload;
+            /// when the connection was accepted
+            Clock::time_point received;
+        };
+
+        explicit HeaderReader(std::chrono::milliseconds timeout) : timeout(timeout) {
+        }
+
+        ~HeaderReader() {
+            closeAll();
+        }
+
+        HeaderReader(const HeaderReader &) = delete;
+        HeaderReader &operator=(const HeaderReader &) = delete;
+
+        /**
+         * Starts receiving the header of an accepted connection
+         */
+        void add(int fd) {
+            const int flags = fcntl(fd, F_GETFL);
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+            const auto now = Clock::now();
+            connections.push_back(Connection{fd, flags, std::string(), now, now});
+        }
+
+        /**
+         * Adds an entry for every connection that is still receiving, in the order `receive()` expects them
+         */
+        void addPollFds(std::vector<struct pollfd> &fds) const {
+            for (auto &connection : connections)
+                fds.push_back(pollfd{connection.fd, POLLIN, 0});
+        }
+
+        /**
+         * Reads from the readable connections and closes those that failed or timed out. Call `add()` only
+         * afterwards, the entries must match the connections.
+         * @param fds the entries from `addPollFds()` after `poll()` returned
+         * @return the headers that are complete now
+         */
+        auto receive(const struct pollfd *fds) -> std::vector<Header> {
+            std::vector<Header> complete;
+            const auto now = Clock::now();
+            size_t kept = 0;
+            for (size_t i = 0; i < connections.size(); i++) {
+                auto &connection = connections[i];
+                bool open = true;
+                if (fds[i].revents != 0) {
+                    open = read(connection);
+                    connection.last_read = now;
+                } else if (now - connection.last_read >= timeout) {
+                    Log::warn("Client did not send its request header within %ld ms",
+                              static_cast<long>(timeout.count()));
+                    open = false;
+                }
+
+                if (!open) {
+                    ::close(connection.fd);
+                } else if (isComplete(connection)) {
+                    fcntl(connection.fd, F_SETFL, connection.flags);
+                    connection.input.erase(0, sizeof(size_t));
+                    complete.push_back(Header{connection.fd, std::move(connection.input), connection.accepted});
+                } else {
+                    if (kept != i)
+                        connections[kept] = std::move(connection);
+                    kept++;
+                }
+            }
+            connections.resize(kept);
+            return complete;
+        }
+
+        /**
+         * @return the milliseconds until the next connection times out, -1 if there is none
+         */
+        auto getPollTimeout() const -> int {
+            if (connections.empty())
+                return -1;
+            auto next = connections.front().last_read;
+            for (auto &connection : connections)
+                next = std::min(next, connection.last_read);
+            const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(next + timeout -
+                                                                                         Clock::now());
+            return static_cast<int>(std::max<long>(remaining.count(), 0) + 1);
+        }
+
+        /**
+         * Closes all connections, e.g. in a forked child that must not keep them open
+         */
+        void closeAll() {
+            for (auto &connection : connections)
+                ::close(connection.fd);
+            connections.clear();
+        }
+
+        auto size() const -> size_t {
+            return connections.size();
+        }
+
+    private:
+        struct Connection {
+            int fd;
+            int flags;
+            std::string input;
+            Clock::time_point accepted;
+            Clock::time_point last_read;
+        };
+
+        /**
+         * @return the bytes of the message so far, including the size in front of it
+         */
+        static auto getExpectedSize(const Connection &connection) -> size_t {
+            if (connection.input.size() < sizeof(size_t))
+                return sizeof(size_t);
+            size_t size;
+            memcpy(&size, connection.input.data(), sizeof(size));
+            return sizeof(size_t) + size;
+        }
+
+        static auto isComplete(const Connection &connection) -> bool {
+            return connection.input.size() >= sizeof(size_t) &&
+                   connection.input.size() == getExpectedSize(connection);
+        }
+
+        /**
+         * Reads what is available, up to the end of the header
+         * @return false if the client closed the connection or it failed
+         */
+        static auto read(Connection &connection) -> bool {
+            auto &input = connection.input;
+            while (!isComplete(connection)) {
+                // the buffer grows with the data that arrived, not with the size the client claims
+                const size_t offset = input.size();
+                const size_t wanted = std::min<size_t>(getExpectedSize(connection) - offset, 64 * 1024);
+                input.resize(offset + wanted);
+                ssize_t r = ::read(connection.fd, &input[offset], wanted);
+                input.resize(offset + static_cast<size_t>(std::max<ssize_t>(r, 0)));
+                if (r > 0)
+                    continue;
+                if (r < 0 && errno == EINTR)
+                    continue;
+                return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            }
+            return true;
+        }
+
+        std::chrono::milliseconds timeout;
+        std::vector<Connection> connections;
+};
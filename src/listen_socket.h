@@ -0,0 +1,87 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+/**
+ * Listens on a TCP port of all interfaces
+ * @return the listening socket
+ */
+int listen_on_port(int portnr) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        throw PlatformException(std::string("socket() failed: ") + strerror(errno));
+
+    int yes = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    struct sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(static_cast<uint16_t>(portnr));
+    if (bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        ::close(listen_fd);
+        throw PlatformException(std::string("bind() failed: ") + strerror(errno));
+    }
+    if (::listen(listen_fd, SOMAXCONN) != 0) {
+        ::close(listen_fd);
+        throw PlatformException(std::string("listen() failed: ") + strerror(errno));
+    }
+    return listen_fd;
+}
+
+/**
+ * Listens on a Unix domain socket, replacing a stale socket file
+ * @param path
+ * @param permissions of the socket file
+ * @return the listening socket
+ */
+int listen_on_unix_socket(const std::string &path, int permissions) {
+    struct sockaddr_un address{};
+    if (path.size() >= sizeof(address.sun_path))
+        throw ArgumentException("Socket path is too long: " + path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        throw PlatformException(std::string("socket() failed: ") + strerror(errno));
+
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    unlink(path.c_str());
+    if (bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        ::close(listen_fd);
+        throw PlatformException(std::string("bind() failed: ") + strerror(errno));
+    }
+    chmod(path.c_str(), static_cast<mode_t>(permissions));
+    if (::listen(listen_fd, SOMAXCONN) != 0) {
+        ::close(listen_fd);
+        throw PlatformException(std::string("listen() failed: ") + strerror(errno));
+    }
+    return listen_fd;
+}
@@ -0,0 +1,291 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+#include "util/log.h"
+
+#include "rserver_protocol.h"
+
+// set by CMake if the libraries are found
+#ifndef RSERVER_HAS_LZ4
+#define RSERVER_HAS_LZ4 0
+#endif
+#ifndef RSERVER_HAS_ZSTD
+#define RSERVER_HAS_ZSTD 0
+#endif
+
+#if RSERVER_HAS_LZ4
+#include <lz4.h>
+#endif
+#if RSERVER_HAS_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+
+/**
+ * Compresses and decompresses the payloads of single messages, see "Compression" in docs/protocol.md.
+ *
+ * Every payload starts with a `uint8_t` codec. A compressed payload continues with the `uint64_t` size of the
+ * original payload and the compressed bytes, an uncompressed one with the original payload. Payloads below a
+ * minimum size or that do not get smaller are sent uncompressed. Incoming payloads are checked against a maximum size
+ * before any memory is allocated for them.
+ */
+class MessageCodec {
+    public:
+        struct Stats {
+            uint64_t messages; // encoded messages
+            uint64_t compressed_messages; // encoded messages that were sent compressed
+            uint64_t raw_bytes; // size of the encoded messages before compression
+            uint64_t compressed_bytes; // size of the encoded messages as sent
+            uint64_t compress_time_us;
+            uint64_t decompress_time_us;
+        };
+
+        /**
+         * @return whether this build supports a codec
+         */
+        static auto isAvailable(uint8_t codec) -> bool {
+            switch (codec) {
+                case RServerCodecs::NONE:
+                    return true;
+                case RServerCodecs::LZ4:
+                    return RSERVER_HAS_LZ4;
+                case RServerCodecs::ZSTD:
+                    return RSERVER_HAS_ZSTD;
+                default:
+                    return false;
+            }
+        }
+
+        /**
+         * @param name none, lz4 or zstd
+         */
+        static auto parse(const std::string &name) -> uint8_t {
+            if (name == "none")
+                return RServerCodecs::NONE;
+            if (name == "lz4")
+                return RServerCodecs::LZ4;
+            if (name == "zstd")
+                return RServerCodecs::ZSTD;
+            throw ArgumentException("Unknown compression codec: " + name);
+        }
+
+        static auto getName(uint8_t codec) -> const char * {
+            switch (codec) {
+                case RServerCodecs::LZ4:
+                    return "lz4";
+                case RServerCodecs::ZSTD:
+                    return "zstd";
+                default:
+                    return "none";
+            }
+        }
+
+        /**
+         * @param codec the codec for outgoing payloads, which must be available
+         * @param level the zstd compression level, for lz4 the acceleration (higher is faster)
+         * @param min_size smaller payloads are not compressed
+         * @param max_size larger incoming payloads are rejected
+         */
+        MessageCodec(uint8_t codec, int level, size_t min_size, size_t max_size)
+                : codec(codec), level(level), min_size(min_size), max_size(max_size), stats{0, 0, 0, 0, 0, 0} {
+            if (!isAvailable(codec))
+                throw ArgumentException(std::string("Compression codec not available: ") + getName(codec));
+        }
+
+        /**
+         * Encodes an outgoing message
+         * @param payload is replaced by its compressed form if that is smaller
+         * @return the bytes to send in front of `payload`, the codec of an uncompressed payload
+         */
+        auto encode(std::string &payload) -> std::string {
+            stats.messages++;
+            stats.raw_bytes += payload.size();
+
+            if (codec != RServerCodecs::NONE && payload.size() >= min_size) {
+                auto start = std::chrono::steady_clock::now();
+                std::string encoded = compress(payload);
+                stats.compress_time_us += elapsedMicroseconds(start);
+                if (!encoded.empty()) {
+                    stats.compressed_messages++;
+                    stats.compressed_bytes += encoded.size();
+                    payload = std::move(encoded);
+                    return "";
+                }
+            }
+
+            stats.compressed_bytes += 1 + payload.size();
+            return std::string(1, static_cast<char>(RServerCodecs::NONE));
+        }
+
+        /**
+         * Decodes an incoming message
+         * @param encoded is replaced by the original payload if it was compressed
+         * @return the position of the original payload in `encoded`
+         */
+        auto decode(std::string &encoded) -> size_t {
+            if (encoded.empty())
+                throw NetworkException("MessageCodec: empty message");
+
+            const auto message_codec = static_cast<uint8_t>(encoded[0]);
+            if (message_codec == RServerCodecs::NONE)
+                return 1;
+
+            uint64_t size;
+            if (encoded.size() < 1 + sizeof(size))
+                throw NetworkException("MessageCodec: truncated message");
+            memcpy(&size, encoded.data() + 1, sizeof(size));
+            const char *data = encoded.data() + 1 + sizeof(size);
+            const size_t data_size = encoded.size() - 1 - sizeof(size);
+
+            // the size comes from the peer, so check it before allocating
+            if (size > max_size)
+                throw NetworkException("MessageCodec: message of " + std::to_string(size) + " bytes exceeds the "
+                                       "maximum of " + std::to_string(max_size));
+            bool plausible = false;
+            switch (message_codec) {
+#if RSERVER_HAS_LZ4
+                case RServerCodecs::LZ4:
+                    // a byte of LZ4 expands to at most 255
+                    plausible = size <= static_cast<uint64_t>(std::numeric_limits<int>::max()) &&
+                                size / 255 <= data_size;
+                    break;
+#endif
+#if RSERVER_HAS_ZSTD
+                case RServerCodecs::ZSTD:
+                    plausible = ZSTD_getFrameContentSize(data, data_size) == size;
+                    break;
+#endif
+                default:
+                    throw NetworkException(std::string("MessageCodec: unsupported codec ") +
+                                           std::to_string(message_codec));
+            }
+            if (!plausible)
+                throw NetworkException("MessageCodec: corrupt message");
+
+            auto start = std::chrono::steady_clock::now();
+            std::string payload(static_cast<size_t>(size), '\0');
+            bool valid = false;
+            switch (message_codec) {
+#if RSERVER_HAS_LZ4
+                case RServerCodecs::LZ4:
+                    valid = LZ4_decompress_safe(data, &payload[0], static_cast<int>(data_size),
+                                                static_cast<int>(size)) == static_cast<int>(size);
+                    break;
+#endif
+#if RSERVER_HAS_ZSTD
+                case RServerCodecs::ZSTD: {
+                    size_t result = ZSTD_decompress(&payload[0], payload.size(), data, data_size);
+                    valid = !ZSTD_isError(result) && result == size;
+                    break;
+                }
+#endif
+                default:
+                    break;
+            }
+            stats.decompress_time_us += elapsedMicroseconds(start);
+
+            if (!valid)
+                throw NetworkException("MessageCodec: corrupt message");
+            encoded = std::move(payload);
+            return 0;
+        }
+
+        auto getStats() const -> Stats {
+            return stats;
+        }
+
+        void logStats() const {
+            Log::info("Compression (%s): %llu of %llu messages, %llu -> %llu bytes, %llu us compressing, "
+                      "%llu us decompressing", getName(codec),
+                      static_cast<unsigned long long>(stats.compressed_messages),
+                      static_cast<unsigned long long>(stats.messages),
+                      static_cast<unsigned long long>(stats.raw_bytes),
+                      static_cast<unsigned long long>(stats.compressed_bytes),
+                      static_cast<unsigned long long>(stats.compress_time_us),
+                      static_cast<unsigned long long>(stats.decompress_time_us));
+        }
+
+    private:
+        /**
+         * @return the encoded payload or an empty string if it should be sent uncompressed
+         */
+        auto compress(const std::string &payload) -> std::string {
+            const size_t header_size = 1 + sizeof(uint64_t);
+            std::string encoded;
+            size_t compressed_size = 0;
+            switch (codec) {
+#if RSERVER_HAS_LZ4
+                case RServerCodecs::LZ4: {
+                    if (payload.size() > LZ4_MAX_INPUT_SIZE)
+                        return "";
+                    const int bound = LZ4_compressBound(static_cast<int>(payload.size()));
+                    encoded.resize(header_size + static_cast<size_t>(bound));
+                    const int result = LZ4_compress_fast(payload.data(), &encoded[header_size],
+                                                         static_cast<int>(payload.size()), bound, std::max(level, 1));
+                    if (result <= 0)
+                        return "";
+                    compressed_size = static_cast<size_t>(result);
+                    break;
+                }
+#endif
+#if RSERVER_HAS_ZSTD
+                case RServerCodecs::ZSTD: {
+                    const size_t bound = ZSTD_compressBound(payload.size());
+                    encoded.resize(header_size + bound);
+                    const size_t result = ZSTD_compress(&encoded[header_size], bound, payload.data(), payload.size(),
+                                                        level);
+                    if (ZSTD_isError(result))
+                        return "";
+                    compressed_size = result;
+                    break;
+                }
+#endif
+                default:
+                    return "";
+            }
+
+            // not worth it, e.g. for noise
+            if (header_size + compressed_size >= payload.size() + 1)
+                return "";
+
+            encoded[0] = static_cast<char>(codec);
+            const uint64_t size = payload.size();
+            memcpy(&encoded[1], &size, sizeof(size));
+            encoded.resize(header_size + compressed_size);
+            return encoded;
+        }
+
+        static auto elapsedMicroseconds(std::chrono::steady_clock::time_point start) -> uint64_t {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count());
+        }
+
+        uint8_t codec;
+        int level;
+        size_t min_size;
+        size_t max_size;
+        Stats stats;
+};
@@ -0,0 +1,267 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+#include "util/binarystream.h"
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+/**
+ * Reads and writes whole `BinaryStream` messages on a nonblocking socket without interpreting them.
+ *
+ * `BinaryStream` frames every message as a `size_t` with the size of the payload followed by the payload. This class
+ * relies on that framing to relay messages between sockets without blocking on a slow peer. Large payloads are read
+ * into the string they are received in and queued payloads are written from the string they were passed in, so
+ * relaying a message does not copy it. Callers that relay between sockets stop receiving while the other side has
+ * more than a few MB queued, see `getQueuedBytes()`.
+ */
+class MessageSocket {
+    public:
+        /**
+         * @param fd a socket, which is switched to nonblocking mode and closed on destruction
+         */
+        explicit MessageSocket(int fd) : fd(fd), size_received(0), expected(0), queued(0), written(0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+
+        ~MessageSocket() {
+            ::close(fd);
+        }
+
+        MessageSocket(const MessageSocket &) = delete;
+        MessageSocket &operator=(const MessageSocket &) = delete;
+
+        auto getFd() const -> int {
+            return fd;
+        }
+
+        /**
+         * Reads what is available, but at most about 1 MB, so that a busy socket does not starve the others of a
+         * `poll()` loop
+         * @param messages receives the payloads of all complete messages
+         * @return false if the peer closed the socket or it failed
+         */
+        auto receive(std::vector<std::string> &messages) -> bool {
+            const size_t max_read = 1024 * 1024;
+            char chunk[64 * 1024];
+            size_t total = 0;
+            while (total < max_read) {
+                ssize_t r;
+                if (size_received == sizeof(size_t) && expected - input.size() >= sizeof(chunk)) {
+                    // the string grows with the data that arrived, not with the size the peer claims
+                    const size_t offset = input.size();
+                    const size_t wanted = std::min(expected - offset, max_read - total);
+                    input.resize(offset + wanted);
+                    r = ::read(fd, &input[offset], wanted);
+                    input.resize(offset + static_cast<size_t>(std::max<ssize_t>(r, 0)));
+                    if (r > 0)
+                        completeMessage(messages);
+                } else {
+                    r = ::read(fd, chunk, sizeof(chunk));
+                    if (r > 0)
+                        consume(chunk, static_cast<size_t>(r), messages);
+                }
+                if (r > 0) {
+                    total += static_cast<size_t>(r);
+                    continue;
+                }
+                if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    return true;
+                if (r < 0 && errno == EINTR)
+                    continue;
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Queues a message, call `flush()` when the socket is writable
+         * @param payload is moved into the queue, pass an rvalue to avoid a copy
+         * @param offset the message starts at this position of `payload`
+         * @param head is sent in front of the payload as part of the message, e.g. a tag
+         */
+        void send(std::string payload, size_t offset = 0, const std::string &head = std::string()) {
+            const size_t size = head.size() + payload.size() - offset;
+            std::string prefix(reinterpret_cast<const char *>(&size), sizeof(size));
+            prefix += head;
+            queued += prefix.size() + payload.size() - offset;
+            output.push_back(Message{std::move(prefix), std::move(payload), offset});
+        }
+
+        /**
+         * Writes as much of the queued messages as possible
+         * @return false if the socket failed
+         */
+        auto flush() -> bool {
+            while (!output.empty()) {
+                const Message &message = output.front();
+                const size_t prefix_size = message.prefix.size();
+                const size_t size = prefix_size + message.payload.size() - message.offset;
+
+                struct iovec parts[2];
+                int count = 0;
+                if (written < prefix_size)
+                    parts[count++] = {const_cast<char *>(message.prefix.data()) + written, prefix_size - written};
+                const size_t payload_written = written > prefix_size ? written - prefix_size : 0;
+                parts[count++] = {const_cast<char *>(message.payload.data()) + message.offset + payload_written,
+                                  message.payload.size() - message.offset - payload_written};
+
+                ssize_t w = ::writev(fd, parts, count);
+                if (w < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return true;
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                written += static_cast<size_t>(w);
+                queued -= static_cast<size_t>(w);
+                if (written == size) {
+                    output.pop_front();
+                    written = 0;
+                }
+            }
+            return true;
+        }
+
+        auto wantsWrite() const -> bool {
+            return !output.empty();
+        }
+
+        /**
+         * @return the bytes that are queued but not written yet
+         */
+        auto getQueuedBytes() const -> size_t {
+            return queued;
+        }
+
+        /**
+         * Parses a payload that was received as raw bytes with the regular `BinaryStream` machinery
+         */
+        static void parse(const std::string &payload, BinaryReadBuffer &buffer) {
+            int message_fd = memfd_create("rserver-message", 0);
+            if (message_fd < 0)
+                throw PlatformException(std::string("memfd_create() failed: ") + strerror(errno));
+
+            const size_t size = payload.size();
+            bool complete = ::write(message_fd, &size, sizeof(size)) == sizeof(size);
+            size_t offset = 0;
+            while (complete && offset < size) {
+                ssize_t w = ::write(message_fd, payload.data() + offset, size - offset);
+                complete = w > 0;
+                offset += complete ? static_cast<size_t>(w) : 0;
+            }
+            if (!complete) {
+                ::close(message_fd);
+                throw PlatformException("MessageSocket: could not buffer message");
+            }
+
+            lseek(message_fd, 0, SEEK_SET);
+            BinaryStream stream(message_fd, message_fd);
+            stream.read(buffer);
+        }
+
+        /**
+         * @return the payload of a message that is written with the regular `BinaryStream` machinery
+         */
+        static auto serialize(BinaryWriteBuffer &buffer) -> std::string {
+            int message_fd = memfd_create("rserver-message", 0);
+            if (message_fd < 0)
+                throw PlatformException(std::string("memfd_create() failed: ") + strerror(errno));
+            {
+                int stream_fd = dup(message_fd);
+                BinaryStream stream(stream_fd, stream_fd);
+                stream.write(buffer);
+            }
+
+            const auto size = static_cast<size_t>(lseek(message_fd, 0, SEEK_END));
+            std::string message(size, '\0');
+            size_t offset = 0;
+            while (offset < size) {
+                ssize_t r = pread(message_fd, &message[offset], size - offset, static_cast<off_t>(offset));
+                if (r <= 0)
+                    break;
+                offset += static_cast<size_t>(r);
+            }
+            ::close(message_fd);
+            if (offset != size || size < sizeof(size_t))
+                throw PlatformException("MessageSocket: could not serialize message");
+            return message.substr(sizeof(size_t));
+        }
+
+    private:
+        /**
+         * A queued message, the payload is sent from `offset` on
+         */
+        struct Message {
+            std::string prefix;
+            std::string payload;
+            size_t offset;
+        };
+
+        /**
+         * Splits received bytes into the sizes and payloads of messages
+         */
+        void consume(const char *data, size_t size, std::vector<std::string> &messages) {
+            while (size > 0) {
+                size_t used;
+                if (size_received < sizeof(size_t)) {
+                    used = std::min(sizeof(size_t) - size_received, size);
+                    memcpy(size_bytes + size_received, data, used);
+                    size_received += used;
+                    if (size_received == sizeof(size_t))
+                        memcpy(&expected, size_bytes, sizeof(expected));
+                } else {
+                    used = std::min(expected - input.size(), size);
+                    input.append(data, used);
+                }
+                data += used;
+                size -= used;
+                completeMessage(messages);
+            }
+        }
+
+        void completeMessage(std::vector<std::string> &messages) {
+            if (size_received < sizeof(size_t) || input.size() < expected)
+                return;
+            messages.push_back(std::move(input));
+            input.clear();
+            size_received = 0;
+        }
+
+        int fd;
+        /// the size of the message that is being received, once all of its bytes are there
+        char size_bytes[sizeof(size_t)];
+        size_t size_received;
+        size_t expected;
+        std::string input;
+        std::deque<Message> output;
+        size_t queued;
+        size_t written;
+};
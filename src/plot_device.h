@@ -0,0 +1,104 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <RInside.h>
+
+#include "util/exceptions.h"
+#include "util/binarystream.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+/**
+ * A graphics device that renders a plot into memory.
+ *
+ * R's bitmap devices can only write to files, so the device writes to an anonymous memory file through its
+ * `/proc/self/fd` path. Nothing touches the disk, and the image is mapped and handed to the response without a copy.
+ */
+class MemoryPlotDevice {
+    public:
+        /**
+         * Opens the device
+         * @param R the R environment
+         * @param format png, jpeg or tiff
+         * @param width in pixels
+         * @param height in pixels
+         * @param quality the JPEG quality (0-100), for TIFF a value > 0 selects LZW compression
+         */
+        MemoryPlotDevice(RInside &R, const std::string &format, size_t width, size_t height, int quality)
+                : R(R), image(nullptr), image_size(0) {
+            fd = memfd_create("rserver-plot", 0);
+            if (fd < 0)
+                throw PlatformException(std::string("memfd_create() failed: ") + strerror(errno));
+
+            const std::string filename = "/proc/self/fd/" + std::to_string(fd);
+            const std::string size = "width=" + std::to_string(width) + ", height=" + std::to_string(height);
+            if (format == "png") {
+                R.parseEvalQ("png(\"" + filename + "\", " + size + ", bg=\"transparent\")");
+            } else if (format == "jpeg") {
+                R.parseEvalQ("jpeg(\"" + filename + "\", " + size + ", quality=" + std::to_string(quality) +
+                             ", bg=\"white\")");
+            } else if (format == "tiff") {
+                R.parseEvalQ("tiff(\"" + filename + "\", " + size + ", compression=\"" +
+                             (quality > 0 ? "lzw" : "none") + "\", bg=\"transparent\")");
+            } else {
+                ::close(fd);
+                throw ArgumentException("Unknown plot format: " + format);
+            }
+        }
+
+        ~MemoryPlotDevice() {
+            if (image != nullptr)
+                munmap(image, image_size);
+            ::close(fd);
+        }
+
+        MemoryPlotDevice(const MemoryPlotDevice &) = delete;
+        MemoryPlotDevice &operator=(const MemoryPlotDevice &) = delete;
+
+        /**
+         * Closes the device and appends the image to the response in the layout of a serialized `std::string`.
+         * The response refers to the mapped image, so the device has to outlive it.
+         */
+        void write(BinaryWriteBuffer &response) {
+            R.parseEvalQ("dev.off()");
+
+            image_size = static_cast<size_t>(lseek(fd, 0, SEEK_END));
+            if (image_size > 0) {
+                image = mmap(nullptr, image_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (image == MAP_FAILED) {
+                    image = nullptr;
+                    throw PlatformException(std::string("mmap() failed: ") + strerror(errno));
+                }
+            }
+
+            response.write<size_t>(image_size);
+            response.write(static_cast<const char *>(image), image_size, true);
+        }
+
+    private:
+        RInside &R;
+        int fd;
+        void *image;
+        size_t image_size;
+};
@@ -0,0 +1,240 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <Rcpp.h>
+#include <Rversion.h>
+#include <R_ext/Rdynload.h>
+
+#include "datatypes/raster.h"
+
+#include "raster_conversion.h"
+#include "rcpp_wrapper.h"
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+
+#if R_VERSION >= R_Version(3, 5, 0)
+#define RSERVER_HAS_ALTREP 1
+#if R_VERSION < R_Version(3, 6, 0)
+// the header of R 3.5 uses `class` as an identifier
+#define class klass
+extern "C" {
+#include <R_ext/Altrep.h>
+}
+#undef class
+#else
+#include <R_ext/Altrep.h>
+#endif
+#else
+#define RSERVER_HAS_ALTREP 0
+#endif
+
+/**
+ * An R numeric vector that is backed by the pixel buffer of a raster.
+ *
+ * Elements are widened to double and no data is mapped to NaN only when they are accessed, so `mean`, subsetting or
+ * `summary` never allocate a double copy of the raster. The copy is only materialized if R asks for the data pointer,
+ * at which point the raster itself is released.
+ *
+ * data1 holds an external pointer to the raster. data2 holds a raw vector with the pixel pointer, the pixel type and
+ * the no data value, so single elements are read without dispatching on the raster, and is replaced by the
+ * materialized vector.
+ */
+class RasterAltrep {
+    public:
+        /**
+         * Create a vector for the raster or, on R versions without ALTREP, a regular copy
+         * @param raster a raster in CPU representation
+         * @return a numeric vector of all pixels in row major order
+         */
+        static SEXP make(std::unique_ptr<GenericRaster> raster) {
+#if RSERVER_HAS_ALTREP
+            if (!initialized)
+                init(R_getEmbeddingDllInfo());
+
+            const PixelView pixels = makeView(*raster);
+            SEXP pointer = PROTECT(R_MakeExternalPtr(raster.get(), R_NilValue, R_NilValue));
+            raster.release();
+            R_RegisterCFinalizerEx(pointer, finalize, TRUE);
+
+            SEXP view = PROTECT(Rf_allocVector(RAWSXP, sizeof(PixelView)));
+            *reinterpret_cast<PixelView *>(RAW(view)) = pixels;
+
+            SEXP vector = R_new_altrep(altrep_class, pointer, view);
+            UNPROTECT(2);
+            return vector;
+#else
+            return Rcpp::create_pixel_vector(*raster);
+#endif
+        }
+
+#if RSERVER_HAS_ALTREP
+    private:
+        /**
+         * The pixels of a raster as they are read by `Elt`
+         */
+        struct PixelView {
+            const void *data;
+            GDALDataType datatype;
+            bool has_no_data;
+            double no_data; // the no data value after a round trip through the pixel type
+        };
+
+        template<typename T>
+        static PixelView makeView(const Raster2D<T> &raster) {
+            const bool has_no_data = raster.dd.has_no_data && is_representable_no_data<T>(raster.dd.no_data);
+            const double no_data = has_no_data ? static_cast<double>(static_cast<T>(raster.dd.no_data)) : 0.0;
+            return PixelView{raster.data, raster.dd.datatype, has_no_data, no_data};
+        }
+
+        static PixelView makeView(const GenericRaster &raster) {
+            switch (raster.dd.datatype) {
+                case GDT_Byte:
+                    return makeView(dynamic_cast<const Raster2D<uint8_t> &>(raster));
+                case GDT_Int16:
+                    return makeView(dynamic_cast<const Raster2D<int16_t> &>(raster));
+                case GDT_UInt16:
+                    return makeView(dynamic_cast<const Raster2D<uint16_t> &>(raster));
+                case GDT_Int32:
+                    return makeView(dynamic_cast<const Raster2D<int32_t> &>(raster));
+                case GDT_UInt32:
+                    return makeView(dynamic_cast<const Raster2D<uint32_t> &>(raster));
+                case GDT_Float32:
+                    return makeView(dynamic_cast<const Raster2D<float> &>(raster));
+                case GDT_Float64:
+                    return makeView(dynamic_cast<const Raster2D<double> &>(raster));
+                default:
+                    throw ArgumentException("RasterAltrep: unsupported raster data type");
+            }
+        }
+
+        static void init(DllInfo *dll) {
+            altrep_class = R_make_altreal_class("mapping_raster", "mapping", dll);
+
+            R_set_altrep_Length_method(altrep_class, Length);
+            R_set_altrep_Inspect_method(altrep_class, Inspect);
+            R_set_altvec_Dataptr_method(altrep_class, Dataptr);
+            R_set_altvec_Dataptr_or_null_method(altrep_class, Dataptr_or_null);
+            R_set_altreal_Elt_method(altrep_class, Elt);
+            R_set_altreal_Get_region_method(altrep_class, Get_region);
+
+            initialized = true;
+        }
+
+        static GenericRaster *getRaster(SEXP x) {
+            return static_cast<GenericRaster *>(R_ExternalPtrAddr(R_altrep_data1(x)));
+        }
+
+        static bool isMaterialized(SEXP x) {
+            return TYPEOF(R_altrep_data2(x)) == REALSXP;
+        }
+
+        static void finalize(SEXP pointer) {
+            delete static_cast<GenericRaster *>(R_ExternalPtrAddr(pointer));
+            R_ClearExternalPtr(pointer);
+        }
+
+        static R_xlen_t Length(SEXP x) {
+            if (isMaterialized(x))
+                return XLENGTH(R_altrep_data2(x));
+            return static_cast<R_xlen_t>(getRaster(x)->getPixelCount());
+        }
+
+        static Rboolean Inspect(SEXP x, int pre, int deep, int pvec, void (*inspect_subtree)(SEXP, int, int, int)) {
+            Rprintf("mapping raster (len=%lld, materialized=%s)\n", static_cast<long long>(Length(x)),
+                    isMaterialized(x) ? "TRUE" : "FALSE");
+            return TRUE;
+        }
+
+        static void *Dataptr(SEXP x, Rboolean writeable) {
+            if (!isMaterialized(x)) {
+                const R_xlen_t length = Length(x);
+                SEXP values = PROTECT(Rf_allocVector(REALSXP, length));
+                convert_raster_to_double(*getRaster(x), 0, static_cast<size_t>(length), REAL(values));
+                R_set_altrep_data2(x, values);
+                UNPROTECT(1);
+
+                // the raster is not needed anymore once all values live in R
+                finalize(R_altrep_data1(x));
+            }
+            return REAL(R_altrep_data2(x));
+        }
+
+        static const void *Dataptr_or_null(SEXP x) {
+            if (isMaterialized(x))
+                return REAL(R_altrep_data2(x));
+            return nullptr;
+        }
+
+        static double Elt(SEXP x, R_xlen_t i) {
+            if (isMaterialized(x))
+                return REAL(R_altrep_data2(x))[i];
+
+            const auto &view = *reinterpret_cast<const PixelView *>(RAW(R_altrep_data2(x)));
+            double value;
+            switch (view.datatype) {
+                case GDT_Byte:
+                    value = static_cast<const uint8_t *>(view.data)[i];
+                    break;
+                case GDT_Int16:
+                    value = static_cast<const int16_t *>(view.data)[i];
+                    break;
+                case GDT_UInt16:
+                    value = static_cast<const uint16_t *>(view.data)[i];
+                    break;
+                case GDT_Int32:
+                    value = static_cast<const int32_t *>(view.data)[i];
+                    break;
+                case GDT_UInt32:
+                    value = static_cast<const uint32_t *>(view.data)[i];
+                    break;
+                case GDT_Float32:
+                    value = static_cast<const float *>(view.data)[i];
+                    break;
+                default:
+                    value = static_cast<const double *>(view.data)[i];
+                    break;
+            }
+            if (view.has_no_data && value == view.no_data)
+                return std::numeric_limits<double>::quiet_NaN();
+            return value;
+        }
+
+        static R_xlen_t Get_region(SEXP x, R_xlen_t start, R_xlen_t size, double *out) {
+            const R_xlen_t count = std::min(size, Length(x) - start);
+            if (count <= 0)
+                return 0;
+
+            if (isMaterialized(x))
+                std::copy_n(REAL(R_altrep_data2(x)) + start, count, out);
+            else
+                convert_raster_to_double(*getRaster(x), static_cast<size_t>(start), static_cast<size_t>(count), out);
+            return count;
+        }
+
+        static R_altrep_class_t altrep_class;
+        static bool initialized;
+#endif
+};
+
+#if RSERVER_HAS_ALTREP
+R_altrep_class_t RasterAltrep::altrep_class;
+bool RasterAltrep::initialized = false;
+#endif
@@ -0,0 +1,196 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+#include "datatypes/raster.h"
+#include "datatypes/raster/raster_priv.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+/**
+ * Widens pixels to double and maps the no data value to NaN.
+ *
+ * The loop is branch free and the pointers do not alias, so the compiler emits vector instructions for it.
+ *
+ * @param in pixels of type T
+ * @param out destination for `count` doubles
+ * @param count number of pixels
+ * @param has_no_data whether `no_data` has to be masked
+ * @param no_data the no data value in the pixel type
+ */
+template<typename T>
+void convert_pixels_to_double(const T *__restrict in, double *__restrict out, size_t count,
+                              bool has_no_data, T no_data) {
+    if (!has_no_data) {
+        for (size_t i = 0; i < count; i++)
+            out[i] = static_cast<double>(in[i]);
+        return;
+    }
+
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    for (size_t i = 0; i < count; i++) {
+        const T value = in[i];
+        out[i] = (value == no_data) ? nan : static_cast<double>(value);
+    }
+}
+
+/**
+ * Checks whether a no data value can be stored in a pixel of type T.
+ * A value outside of its range never matches a pixel, so it must not be cast.
+ */
+template<typename T>
+bool is_representable_no_data(double no_data) {
+    if (std::numeric_limits<T>::is_integer)
+        return no_data >= static_cast<double>(std::numeric_limits<T>::lowest()) &&
+               no_data <= static_cast<double>(std::numeric_limits<T>::max()) &&
+               no_data == static_cast<double>(static_cast<T>(no_data));
+    return true;
+}
+
+template<typename T>
+void convert_raster2d_to_double(const Raster2D<T> &raster, size_t offset, size_t count, double *out) {
+    const bool has_no_data = raster.dd.has_no_data && is_representable_no_data<T>(raster.dd.no_data);
+    const T no_data = has_no_data ? static_cast<T>(raster.dd.no_data) : T();
+    convert_pixels_to_double<T>(raster.data + offset, out, count, has_no_data, no_data);
+}
+
+/**
+ * Converts a range of pixels of a raster to doubles with no data mapped to NaN.
+ * Dispatches once on the concrete pixel type.
+ *
+ * @param raster a raster in CPU representation
+ * @param offset index of the first pixel (row major)
+ * @param count number of pixels
+ * @param out destination for `count` doubles
+ */
+void convert_raster_to_double(const GenericRaster &raster, size_t offset, size_t count, double *out) {
+    switch (raster.dd.datatype) {
+        case GDT_Byte:
+            return convert_raster2d_to_double(dynamic_cast<const Raster2D<uint8_t> &>(raster), offset, count, out);
+        case GDT_Int16:
+            return convert_raster2d_to_double(dynamic_cast<const Raster2D<int16_t> &>(raster), offset, count, out);
+        case GDT_UInt16:
+            return convert_raster2d_to_double(dynamic_cast<const Raster2D<uint16_t> &>(raster), offset, count, out);
+        case GDT_Int32:
+            return convert_raster2d_to_double(dynamic_cast<const Raster2D<int32_t> &>(raster), offset, count, out);
+        case GDT_UInt32:
+            return convert_raster2d_to_double(dynamic_cast<const Raster2D<uint32_t> &>(raster), offset, count, out);
+        case GDT_Float32:
+            return convert_raster2d_to_double(dynamic_cast<const Raster2D<float> &>(raster), offset, count, out);
+        case GDT_Float64:
+            return convert_raster2d_to_double(dynamic_cast<const Raster2D<double> &>(raster), offset, count, out);
+        default:
+            throw ArgumentException("convert_raster_to_double(): unsupported raster data type");
+    }
+}
+
+/**
+ * Narrows doubles to the pixel type and maps NaN (which includes R's `NA`) to the no data value.
+ * Values outside of the range of an integer pixel type become no data as well, casting them is undefined.
+ *
+ * @param in doubles
+ * @param out destination for `count` pixels
+ * @param count number of pixels
+ * @param no_data the no data value in the pixel type
+ * @param missing another value that becomes no data, NaN if there is none
+ */
+template<typename T>
+void convert_double_to_pixels(const double *__restrict in, T *__restrict out, size_t count, T no_data,
+                              double missing = std::numeric_limits<double>::quiet_NaN()) {
+    if (!std::numeric_limits<T>::is_integer) {
+        for (size_t i = 0; i < count; i++) {
+            const double value = in[i];
+            out[i] = (value != value || value == missing) ? no_data : static_cast<T>(value);
+        }
+        return;
+    }
+
+    // both bounds are exact doubles for pixel types up to 32 bits, NaN fails the comparison
+    const double lowest = static_cast<double>(std::numeric_limits<T>::lowest());
+    const double max = static_cast<double>(std::numeric_limits<T>::max());
+    for (size_t i = 0; i < count; i++) {
+        const double value = in[i];
+        out[i] = (value >= lowest && value <= max && value != missing) ? static_cast<T>(value) : no_data;
+    }
+}
+
+/**
+ * Converts integers to the pixel type and maps the integer NA value to the no data value.
+ * The pixel type has to hold every other value, see `choose_integer_datatype`.
+ *
+ * @param in integers
+ * @param out destination for `count` pixels
+ * @param count number of pixels
+ * @param na the value marking a missing integer
+ * @param no_data the no data value in the pixel type
+ * @param missing another value that becomes no data, `na` if there is none
+ */
+template<typename T>
+void convert_integer_to_pixels(const int *__restrict in, T *__restrict out, size_t count, int na, T no_data,
+                               int missing) {
+    for (size_t i = 0; i < count; i++) {
+        const int value = in[i];
+        out[i] = (value == na || value == missing) ? no_data : static_cast<T>(value);
+    }
+}
+
+/**
+ * Chooses the smallest integer pixel type that holds all values in [min, max] and still has its maximum
+ * left over as no data value. If the values reach the maximum of Int32, UInt32 is used for non-negative values and
+ * Float64 (with NaN as no data) otherwise, which holds every 32 bit integer exactly.
+ */
+GDALDataType choose_integer_datatype(double min, double max) {
+    if (min >= 0 && max < std::numeric_limits<uint8_t>::max())
+        return GDT_Byte;
+    if (min >= std::numeric_limits<int16_t>::lowest() && max < std::numeric_limits<int16_t>::max())
+        return GDT_Int16;
+    if (min >= 0 && max < std::numeric_limits<uint16_t>::max())
+        return GDT_UInt16;
+    if (min >= std::numeric_limits<int32_t>::lowest() && max < std::numeric_limits<int32_t>::max())
+        return GDT_Int32;
+    if (min >= 0 && max < std::numeric_limits<uint32_t>::max())
+        return GDT_UInt32;
+    return GDT_Float64;
+}
+
+/**
+ * @return the largest value of a pixel type, which is used as no data value for integer rasters
+ */
+double get_max_pixel_value(GDALDataType datatype) {
+    switch (datatype) {
+        case GDT_Byte:
+            return std::numeric_limits<uint8_t>::max();
+        case GDT_Int16:
+            return std::numeric_limits<int16_t>::max();
+        case GDT_UInt16:
+            return std::numeric_limits<uint16_t>::max();
+        case GDT_Int32:
+            return std::numeric_limits<int32_t>::max();
+        case GDT_UInt32:
+            return std::numeric_limits<uint32_t>::max();
+        case GDT_Float32:
+            return std::numeric_limits<float>::max();
+        case GDT_Float64:
+            return std::numeric_limits<double>::max();
+        default:
+            throw ArgumentException("get_max_pixel_value(): unsupported raster data type");
+    }
+}
@@ -0,0 +1,202 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+#include "util/binarystream.h"
+#include "datatypes/raster.h"
+#include "datatypes/raster/raster_priv.h"
+
+#include "client_stream.h"
+#include "raster_conversion.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/**
+ * Reads a raster that the client sends in chunks, see "Streamed rasters" in docs/protocol.md.
+ *
+ * The first message only describes the raster, so the destination can be allocated before any pixel arrives. Every
+ * following message carries the next run of pixels in row major order and is decoded into the destination right away,
+ * while the client is still sending the rest. Only one chunk is buffered at a time.
+ * `write_raster_stream` produces the same layout.
+ */
+class RasterStreamReader {
+    public:
+        /**
+         * Reads the description of the raster
+         * @param stream the connection to the client, which must not be used otherwise until all pixels are read
+         */
+        explicit RasterStreamReader(ClientStream &stream)
+                : stream(stream), dd(readHeader(stream, header)), stref(header), width(header.read<uint32_t>()),
+                  height(header.read<uint32_t>()) {
+            dd.verify();
+        }
+
+        RasterStreamReader(const RasterStreamReader &) = delete;
+        RasterStreamReader &operator=(const RasterStreamReader &) = delete;
+
+        auto getPixelCount() const -> size_t {
+            return static_cast<size_t>(width) * height;
+        }
+
+        /**
+         * Reads all pixels into a new raster of the announced pixel type
+         * @return a raster in CPU representation
+         */
+        auto readRaster() -> std::unique_ptr<GenericRaster> {
+            auto raster = GenericRaster::create(dd, stref, width, height, GenericRaster::Representation::CPU);
+            auto pixels = static_cast<char *>(raster->getDataForWriting());
+            const size_t pixel_size = static_cast<size_t>(dd.getBPP());
+
+            readChunks([&](BinaryReadBuffer &chunk, size_t offset, size_t count) {
+                chunk.read(pixels + offset * pixel_size, count * pixel_size);
+            });
+            return raster;
+        }
+
+        /**
+         * Reads all pixels, converts them to doubles and maps no data to NaN
+         * @param out destination for `getPixelCount()` doubles
+         */
+        void readAsDouble(double *out) {
+            switch (dd.datatype) {
+                case GDT_Byte:
+                    return readAsDouble<uint8_t>(out);
+                case GDT_Int16:
+                    return readAsDouble<int16_t>(out);
+                case GDT_UInt16:
+                    return readAsDouble<uint16_t>(out);
+                case GDT_Int32:
+                    return readAsDouble<int32_t>(out);
+                case GDT_UInt32:
+                    return readAsDouble<uint32_t>(out);
+                case GDT_Float32:
+                    return readAsDouble<float>(out);
+                case GDT_Float64:
+                    return readAsDouble<double>(out);
+                default:
+                    throw ArgumentException("RasterStreamReader: unsupported raster data type");
+            }
+        }
+
+        const DataDescription &getDataDescription() const {
+            return dd;
+        }
+
+        const SpatioTemporalReference &getSpatioTemporalReference() const {
+            return stref;
+        }
+
+        auto getWidth() const -> uint32_t {
+            return width;
+        }
+
+        auto getHeight() const -> uint32_t {
+            return height;
+        }
+
+    private:
+        static auto readHeader(ClientStream &stream, BinaryReadBuffer &header) -> BinaryReadBuffer & {
+            stream.read(header);
+            return header;
+        }
+
+        template<typename T>
+        void readAsDouble(double *out) {
+            const bool has_no_data = dd.has_no_data && is_representable_no_data<T>(dd.no_data);
+            const T no_data = has_no_data ? static_cast<T>(dd.no_data) : T();
+
+            std::vector<T> pixels;
+            readChunks([&](BinaryReadBuffer &chunk, size_t offset, size_t count) {
+                pixels.resize(count);
+                chunk.read(reinterpret_cast<char *>(pixels.data()), count * sizeof(T));
+                convert_pixels_to_double<T>(pixels.data(), out + offset, count, has_no_data, no_data);
+            });
+        }
+
+        /**
+         * Reads chunk messages until all pixels have arrived
+         * @param consume is called with each chunk positioned at its pixels, their offset and their count
+         */
+        template<typename Consumer>
+        void readChunks(Consumer consume) {
+            const size_t pixel_count = getPixelCount();
+            size_t offset = 0;
+            while (offset < pixel_count) {
+                BinaryReadBuffer chunk;
+                stream.read(chunk);
+                const auto count = static_cast<size_t>(chunk.read<uint64_t>());
+                if (count == 0 || count > pixel_count - offset)
+                    throw NetworkException("Client sent an invalid raster chunk");
+                consume(chunk, offset, count);
+                offset += count;
+            }
+        }
+
+        ClientStream &stream;
+        BinaryReadBuffer header;
+        DataDescription dd;
+        SpatioTemporalReference stref;
+        uint32_t width;
+        uint32_t height;
+};
+
+/**
+ * Sends a raster as a header message followed by chunks of pixels in row major order, the layout that
+ * `RasterStreamReader` reads. Only one chunk is buffered at a time, so the pixels can be produced while sending.
+ *
+ * @param stream the connection to the client
+ * @param type if not 0, the header message starts with this type code
+ * @param dd the data description of the raster
+ * @param stref the spatio-temporal reference of the raster
+ * @param width
+ * @param height
+ * @param chunk_size maximum number of bytes of pixels per chunk
+ * @param fill writes `count` pixels starting at index `offset` to a buffer
+ */
+void write_raster_stream(ClientStream &stream, char type, const DataDescription &dd,
+                         const SpatioTemporalReference &stref, uint32_t width, uint32_t height, size_t chunk_size,
+                         const std::function<void(size_t offset, size_t count, char *pixels)> &fill) {
+    BinaryWriteBuffer header;
+    if (type != 0)
+        header.write<char>(type);
+    header.write<const DataDescription &>(dd);
+    header.write<const SpatioTemporalReference &>(stref);
+    header.write<uint32_t>(width);
+    header.write<uint32_t>(height);
+    stream.write(header);
+
+    const size_t pixel_count = static_cast<size_t>(width) * height;
+    const auto pixel_size = static_cast<size_t>(dd.getBPP());
+    const size_t pixels_per_chunk = std::max<size_t>(1, chunk_size / pixel_size);
+    std::vector<char> pixels(std::min(pixels_per_chunk, pixel_count) * pixel_size);
+
+    for (size_t offset = 0; offset < pixel_count; offset += pixels_per_chunk) {
+        const size_t count = std::min(pixels_per_chunk, pixel_count - offset);
+        fill(offset, count, pixels.data());
+
+        BinaryWriteBuffer chunk;
+        chunk.write<uint64_t>(count);
+        chunk.write(pixels.data(), count * pixel_size, true);
+        stream.write(chunk);
+    }
+}
@@ -0,0 +1,154 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+#include "datatypes/raster.h"
+#include "datatypes/raster/raster_priv.h"
+#include "operators/queryrectangle.h"
+
+#include "raster_conversion.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * A part of a raster query rectangle
+ */
+struct RasterTile {
+    uint32_t x; // offset of the first column in the whole raster
+    uint32_t y; // offset of the first row in the whole raster
+    uint32_t width;
+    uint32_t height;
+    QueryRectangle rect; // the area of the tile with a resolution of `width` x `height` pixels
+};
+
+/**
+ * Splits a query rectangle into tiles on its pixel grid, row by row.
+ * Tiles in the last column and row are smaller if the resolution is not a multiple of the tile size.
+ *
+ * @param rect a query rectangle with a resolution in pixels
+ * @param tile_width maximum width of a tile in pixels
+ * @param tile_height maximum height of a tile in pixels
+ */
+auto split_into_tiles(const QueryRectangle &rect, uint32_t tile_width, uint32_t tile_height)
+        -> std::vector<RasterTile> {
+    if (rect.restype != QueryResolution::Type::PIXELS)
+        throw ArgumentException("Tiles require a query rectangle with a resolution in pixels");
+    if (tile_width == 0 || tile_height == 0)
+        throw ArgumentException("Tiles must not be empty");
+
+    const auto width = static_cast<uint32_t>(rect.xres);
+    const auto height = static_cast<uint32_t>(rect.yres);
+    const double pixel_width = (rect.x2 - rect.x1) / width;
+    const double pixel_height = (rect.y2 - rect.y1) / height;
+
+    std::vector<RasterTile> tiles;
+    for (uint32_t y = 0; y < height; y += tile_height) {
+        for (uint32_t x = 0; x < width; x += tile_width) {
+            const uint32_t w = std::min(tile_width, width - x);
+            const uint32_t h = std::min(tile_height, height - y);
+            // the last tiles end exactly at the border to avoid rounding errors
+            const double x2 = (x + w == width) ? rect.x2 : rect.x1 + (x + w) * pixel_width;
+            const double y2 = (y + h == height) ? rect.y2 : rect.y1 + (y + h) * pixel_height;
+
+            tiles.push_back(RasterTile{x, y, w, h, QueryRectangle(
+                    SpatialReference(rect.crsId, rect.x1 + x * pixel_width, rect.y1 + y * pixel_height, x2, y2),
+                    TemporalReference(rect.timetype, rect.t1, rect.t2),
+                    QueryResolution::pixels(w, h)
+            )});
+        }
+    }
+    return tiles;
+}
+
+/**
+ * Assembles a result raster from tiles.
+ *
+ * The raster is allocated once in its final pixel type and every tile is converted into it when it is written, so
+ * the script never holds the whole result as an R vector of doubles. Pixels that are never written are no data.
+ */
+class TileWriter {
+    public:
+        /**
+         * @param rect the area and resolution of the result
+         * @param datatype the pixel type of the result, `GDT_Float32` or `GDT_Float64`
+         */
+        TileWriter(const QueryRectangle &rect, GDALDataType datatype) {
+            if (rect.restype != QueryResolution::Type::PIXELS)
+                throw ArgumentException("A tile writer requires a query rectangle with a resolution in pixels");
+            if (datatype != GDT_Float32 && datatype != GDT_Float64)
+                throw ArgumentException("A tile writer only supports float32 and float64 pixels");
+
+            DataDescription dd(datatype, Unit::unknown());
+            dd.addNoData();
+            dd.verify();
+            SpatioTemporalReference stref(
+                    SpatialReference(rect.crsId, rect.x1, rect.y1, rect.x2, rect.y2),
+                    TemporalReference(rect.timetype, rect.t1, rect.t2)
+            );
+            raster = GenericRaster::create(dd, stref, static_cast<uint32_t>(rect.xres),
+                                           static_cast<uint32_t>(rect.yres), GenericRaster::Representation::CPU);
+            raster->clear(dd.no_data);
+        }
+
+        /**
+         * Converts the values of a tile into the result
+         * @param x offset of the first column of the tile
+         * @param y offset of the first row of the tile
+         * @param width of the tile
+         * @param height of the tile
+         * @param values `width * height` doubles in row major order, NaN becomes no data
+         */
+        void write(uint32_t x, uint32_t y, uint32_t width, uint32_t height, const double *values) {
+            if (!raster)
+                throw ArgumentException("The tile writer has already been finished");
+            if (x + width > raster->width || y + height > raster->height)
+                throw ArgumentException("The tile lies outside of the raster of the tile writer");
+
+            if (raster->dd.datatype == GDT_Float32)
+                writeTile<float>(x, y, width, height, values);
+            else
+                writeTile<double>(x, y, width, height, values);
+        }
+
+        /**
+         * @return the assembled raster, the writer cannot be used afterwards
+         */
+        auto finish() -> std::unique_ptr<GenericRaster> {
+            if (!raster)
+                throw ArgumentException("The tile writer has already been finished");
+            return std::move(raster);
+        }
+
+    private:
+        template<typename T>
+        void writeTile(uint32_t x, uint32_t y, uint32_t width, uint32_t height, const double *values) {
+            auto pixels = static_cast<T *>(raster->getDataForWriting());
+            const auto no_data = static_cast<T>(raster->dd.no_data);
+            for (uint32_t row = 0; row < height; row++) {
+                convert_double_to_pixels<T>(values + static_cast<size_t>(row) * width,
+                                            pixels + static_cast<size_t>(y + row) * raster->width + x, width, no_data);
+            }
+        }
+
+        std::unique_ptr<GenericRaster> raster;
+};
@@ -25,6 +25,18 @@
 #include "datatypes/linecollection.h"
 #include "datatypes/polygoncollection.h"
 
+#include "feature_conversion.h"
+#include "raster_conversion.h"
+#include "request_trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
 namespace Rcpp {
 
     /**
@@ -51,66 +63,134 @@ namespace Rcpp {
         return bbox;
     }
 
+    /**
+     * Helper function that de-interleaves a range of coordinates into a two-column matrix.
+     */
+    auto create_coordinate_matrix(const std::vector<Coordinate> &coordinates, size_t begin,
+                                  size_t end) -> Rcpp::NumericMatrix {
+        const auto rows = static_cast<int>(end - begin);
+        Rcpp::NumericMatrix matrix(Rcpp::no_init(rows, 2));
+        deinterleave_coordinates(coordinates.data() + begin, matrix.begin(), matrix.begin() + rows, end - begin);
+        return matrix;
+    }
+
+    /**
+     * Helper function that copies a numeric attribute into an R vector.
+     * @param size the number of features, the attribute must hold exactly one value for each, see
+     *             `create_attribute_data_frame`
+     */
+    auto create_numeric_column(const SimpleFeatureCollection &collection, const std::string &key,
+                               size_t size) -> SEXP {
+        Rcpp::NumericVector column(Rcpp::no_init(size));
+        if (size == 0)
+            return column;
+        // the attribute values are stored contiguously
+        std::memcpy(column.begin(), &collection.feature_attributes.numeric(key).get(0), size * sizeof(double));
+        return column;
+    }
+
+    /**
+     * Helper function that copies a textual attribute into an R vector.
+     * Every distinct value is converted to a CHARSXP once, repeated values share it.
+     */
+    auto create_textual_column(const SimpleFeatureCollection &collection, const std::string &key,
+                               size_t size) -> SEXP {
+        const auto &attribute = collection.feature_attributes.textual(key);
+        Rcpp::CharacterVector column(Rcpp::no_init(size));
+        std::unordered_map<std::string, SEXP> dictionary;
+        for (size_t i = 0; i < size; i++) {
+            const std::string &value = attribute.get(i);
+            auto entry = dictionary.find(value);
+            if (entry == dictionary.end()) {
+                SEXP charsxp = Rf_mkCharLenCE(value.data(), static_cast<int>(value.size()), CE_UTF8);
+                entry = dictionary.emplace(value, charsxp).first;
+            }
+            // the column keeps the CHARSXP alive
+            SET_STRING_ELT(column, static_cast<R_xlen_t>(i), entry->second);
+        }
+        return column;
+    }
+
+    /**
+     * Helper function that returns `name` with underscores appended until it differs from all `names`.
+     */
+    auto make_unique_column_name(std::string name, const std::vector<std::string> &names) -> std::string {
+        while (std::find(names.begin(), names.end(), name) != names.end()) {
+            // append underscore until unique
+            name.push_back('_');
+        }
+        return name;
+    }
+
     /**
      * Helper function that generate an R `DataFrame` out of the attributes of a feature collection.
+     * The list and its names are allocated once and every column is copied in bulk.
      * @param collection
      * @return `DataFrame` of R with attributes
      */
     auto create_attribute_data_frame(const SimpleFeatureCollection &collection) -> Rcpp::DataFrame {
         const size_t size = collection.getFeatureCount();
 
-        Rcpp::DataFrame data;
-
-        auto numeric_keys = collection.feature_attributes.getNumericKeys();
-        for (auto &key : numeric_keys) {
-            Rcpp::NumericVector vec(size);
-            for (size_t i = 0; i < size; i++) {
-                double value = collection.feature_attributes.numeric(key).get(i);
-                vec[i] = value;
-            }
-            data[key] = vec;
+        // the columns are copied in bulk, so every attribute has to hold exactly one value per feature
+        try {
+            collection.feature_attributes.validate(size);
+        } catch (const std::exception &e) {
+            throw OperatorException(std::string("Attributes do not match the number of features: ") + e.what());
         }
 
+        auto numeric_keys = collection.feature_attributes.getNumericKeys();
         auto string_keys = collection.feature_attributes.getTextualKeys();
-        for (const auto &key : string_keys) {
-            Rcpp::StringVector vec(size);
-            for (size_t i = 0; i < size; i++) {
-                auto &value = collection.feature_attributes.textual(key).get(i);
-                vec[i] = value;
-            }
-            data[key] = vec;
-        }
+
+        std::vector<std::string> names;
+        names.reserve(numeric_keys.size() + string_keys.size() + 2);
+        names.insert(names.end(), numeric_keys.begin(), numeric_keys.end());
+        names.insert(names.end(), string_keys.begin(), string_keys.end());
 
         // append temporal information
+        // TODO: find a way to rely on names
         if (collection.hasTime()) {
-            // TODO: find a way to rely on names
-            std::string time_start_key = "time_start";
-            while (std::find(std::begin(numeric_keys), std::end(numeric_keys), time_start_key) !=
-                   std::end(numeric_keys) ||
-                   std::find(std::begin(string_keys), std::end(string_keys), time_start_key) != std::end(string_keys)) {
-                // append underscore until unique
-                time_start_key.push_back('_');
-            }
-            std::string time_end_key = "time_end";
-            while (std::find(std::begin(numeric_keys), std::end(numeric_keys), time_end_key) !=
-                   std::end(numeric_keys) ||
-                   std::find(std::begin(string_keys), std::end(string_keys), time_end_key) != std::end(string_keys)) {
-                // append underscore until unique
-                time_end_key.push_back('_');
-            }
+            auto time_start_key = make_unique_column_name("time_start", names);
+            auto time_end_key = make_unique_column_name("time_end", names);
+            names.push_back(std::move(time_start_key));
+            names.push_back(std::move(time_end_key));
+        }
+
+        Rcpp::List data(names.size());
+        size_t column = 0;
+        for (const auto &key : numeric_keys)
+            data[column++] = create_numeric_column(collection, key, size);
+        for (const auto &key : string_keys)
+            data[column++] = create_textual_column(collection, key, size);
 
-            Rcpp::NumericVector time_start(size);
-            Rcpp::NumericVector time_end(size);
+        if (collection.hasTime()) {
+            Rcpp::NumericVector time_start(Rcpp::no_init(size));
+            Rcpp::NumericVector time_end(Rcpp::no_init(size));
             for (size_t i = 0; i < size; i++) {
                 const auto &time_interval = collection.time[i];
                 time_start[i] = time_interval.t1;
                 time_end[i] = time_interval.t2;
             }
-            data[time_start_key] = time_start;
-            data[time_end_key] = time_end;
+            data[column++] = time_start;
+            data[column++] = time_end;
         }
 
-        return data;
+        data.attr("names") = Rcpp::CharacterVector(names.begin(), names.end());
+        data.attr("row.names") = Rcpp::IntegerVector::create(NA_INTEGER, -static_cast<int>(size));
+        data.attr("class") = "data.frame";
+
+        return Rcpp::DataFrame(data);
+    }
+
+    /**
+     * Helper function that converts the pixels of a raster to an R vector with no data mapped to NaN.
+     * @param raster a raster in CPU representation
+     * @return `NumericVector` of R in row major order
+     */
+    auto create_pixel_vector(const GenericRaster &raster) -> Rcpp::NumericVector {
+        const size_t pixel_count = raster.getPixelCount();
+        Rcpp::NumericVector pixels(Rcpp::no_init(pixel_count));
+        convert_raster_to_double(raster, 0, pixel_count, pixels.begin());
+        return pixels;
     }
 
     /**
@@ -118,7 +198,7 @@ namespace Rcpp {
      */
     template<>
     SEXP wrap(const QueryRectangle &rect) {
-        //Profiler::Profiler p("Rcpp: wrapping qrect");
+        //TraceSpan span("Rcpp: wrapping qrect");
         Rcpp::List list;
 
         list["t1"] = rect.t1;
@@ -147,7 +227,7 @@ namespace Rcpp {
      */
     template<>
     QueryRectangle as(SEXP sexp) {
-        //Profiler::Profiler p("Rcpp: unwrapping qrect");
+        //TraceSpan span("Rcpp: unwrapping qrect");
         auto list = Rcpp::as<Rcpp::List>(sexp);
 
         auto xres = static_cast<uint32_t>((int) list["xres"]);
@@ -160,6 +240,45 @@ namespace Rcpp {
         );
     }
 
+    /**
+     * Create an R RasterLayer around pixels that were already converted to doubles
+     * @param dd the data description of the raster
+     * @param stref the spatio-temporal reference of the raster
+     * @param width
+     * @param height
+     * @param pixels `width * height` doubles in row major order with no data mapped to NaN
+     * @return RasterLayer
+     */
+    auto create_raster_layer(const DataDescription &dd, const SpatioTemporalReference &stref, uint32_t width,
+                             uint32_t height, Rcpp::NumericVector pixels) -> SEXP {
+        Rcpp::S4 data(".SingleLayerData");
+        data.slot("values") = pixels;
+        data.slot("inmemory") = true;
+        data.slot("fromdisk") = false;
+        data.slot("haveminmax") = true;
+        data.slot("min") = dd.unit.getMin();
+        data.slot("max") = dd.unit.getMax();
+
+        // TODO: how exactly would R like the Extent to be?
+        Rcpp::S4 extent("Extent");
+        extent.slot("xmin") = stref.x1;
+        extent.slot("ymin") = stref.y1;
+        extent.slot("xmax") = stref.x2;
+        extent.slot("ymax") = stref.y2;
+
+        Rcpp::S4 crs("CRS");
+        crs.slot("projargs") = stref.crsId.to_string();
+
+        Rcpp::S4 rasterlayer("RasterLayer");
+        rasterlayer.slot("data") = data;
+        rasterlayer.slot("extent") = extent;
+        rasterlayer.slot("crs") = crs;
+        rasterlayer.slot("ncols") = width;
+        rasterlayer.slot("nrows") = height;
+
+        return Rcpp::wrap(rasterlayer);
+    }
+
     /**
      * Convert GenericRaster to R RasterLayer
      * @param raster
@@ -190,48 +309,8 @@ namespace Rcpp {
         $class: c("RasterLayer", "raster")
 
          */
-        Profiler::Profiler {"Rcpp: wrapping raster"};
-        int width = raster.width;
-        int height = raster.height;
-
-        Rcpp::NumericVector pixels(raster.getPixelCount());
-        int pos = 0;
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                double val = raster.getAsDouble(x, y);
-                if (raster.dd.is_no_data(val))
-                    pixels[pos++] = NAN;
-                else
-                    pixels[pos++] = val;
-            }
-        }
-
-        Rcpp::S4 data(".SingleLayerData");
-        data.slot("values") = pixels;
-        data.slot("inmemory") = true;
-        data.slot("fromdisk") = false;
-        data.slot("haveminmax") = true;
-        data.slot("min") = raster.dd.unit.getMin();
-        data.slot("max") = raster.dd.unit.getMax();
-
-        // TODO: how exactly would R like the Extent to be?
-        Rcpp::S4 extent("Extent");
-        extent.slot("xmin") = raster.stref.x1;
-        extent.slot("ymin") = raster.stref.y1;
-        extent.slot("xmax") = raster.stref.x2;
-        extent.slot("ymax") = raster.stref.y2;
-
-        Rcpp::S4 crs("CRS");
-        crs.slot("projargs") = raster.stref.crsId.to_string();
-
-        Rcpp::S4 rasterlayer("RasterLayer");
-        rasterlayer.slot("data") = data;
-        rasterlayer.slot("extent") = extent;
-        rasterlayer.slot("crs") = crs;
-        rasterlayer.slot("ncols") = raster.width;
-        rasterlayer.slot("nrows") = raster.height;
-
-        return Rcpp::wrap(rasterlayer);
+        TraceSpan span("Rcpp: wrapping raster");
+        return create_raster_layer(raster.dd, raster.stref, raster.width, raster.height, create_pixel_vector(raster));
     }
 
     /**
@@ -244,10 +323,105 @@ namespace Rcpp {
         return Rcpp::wrap(*raster);
     }
 
-    template<>
-    std::unique_ptr<GenericRaster> as(SEXP sexp) {
-        Profiler::Profiler {"Rcpp: unwrapping raster"};
+    /**
+     * Helper function that converts integer or logical values of R to pixels of the type chosen by
+     * `choose_integer_datatype`. `NA` and `missing` become the no data value of the raster.
+     */
+    auto fill_pixels_from_integers(const int *values, size_t count, const DataDescription &dd, int missing,
+                                   void *pixels) -> void {
+        const double no_data = dd.no_data;
+        switch (dd.datatype) {
+            case GDT_Byte:
+                return convert_integer_to_pixels(values, static_cast<uint8_t *>(pixels), count, NA_INTEGER,
+                                                 static_cast<uint8_t>(no_data), missing);
+            case GDT_Int16:
+                return convert_integer_to_pixels(values, static_cast<int16_t *>(pixels), count, NA_INTEGER,
+                                                 static_cast<int16_t>(no_data), missing);
+            case GDT_UInt16:
+                return convert_integer_to_pixels(values, static_cast<uint16_t *>(pixels), count, NA_INTEGER,
+                                                 static_cast<uint16_t>(no_data), missing);
+            case GDT_Int32:
+                return convert_integer_to_pixels(values, static_cast<int32_t *>(pixels), count, NA_INTEGER,
+                                                 static_cast<int32_t>(no_data), missing);
+            case GDT_UInt32:
+                return convert_integer_to_pixels(values, static_cast<uint32_t *>(pixels), count, NA_INTEGER,
+                                                 static_cast<uint32_t>(no_data), missing);
+            case GDT_Float64:
+                return convert_integer_to_pixels(values, static_cast<double *>(pixels), count, NA_INTEGER,
+                                                 no_data, missing);
+            default:
+                throw ArgumentException("fill_pixels_from_integers(): unsupported raster data type");
+        }
+    }
 
+    /**
+     * Helper function that converts double values of R to pixels of a floating point type.
+     * `NA`, `NaN` and `missing` become the no data value of the raster.
+     */
+    auto fill_pixels_from_doubles(const double *values, size_t count, const DataDescription &dd, double missing,
+                                  void *pixels) -> void {
+        const double no_data = dd.no_data;
+        switch (dd.datatype) {
+            case GDT_Float32:
+                return convert_double_to_pixels(values, static_cast<float *>(pixels), count,
+                                                static_cast<float>(no_data), missing);
+            case GDT_Float64:
+                return convert_double_to_pixels(values, static_cast<double *>(pixels), count, no_data, missing);
+            default:
+                throw ArgumentException("fill_pixels_from_doubles(): raster has no floating point pixel type");
+        }
+    }
+
+    /**
+     * Helper function that converts the `NAvalue` of a layer for comparing it with integer values
+     * @return the `NAvalue` as an integer, or `NA_INTEGER` if it is not one
+     */
+    auto get_integer_na_value(double na_value) -> int {
+        if (na_value >= std::numeric_limits<int>::lowest() && na_value <= std::numeric_limits<int>::max() &&
+            na_value == std::trunc(na_value))
+            return static_cast<int>(na_value);
+        return NA_INTEGER;
+    }
+
+    /**
+     * The values of an R RasterLayer and the description of the raster they are converted to
+     */
+    struct RasterLayerValues {
+        DataDescription dd;
+        SpatioTemporalReference stref;
+        uint32_t width;
+        uint32_t height;
+        SEXP values; // kept alive by the RasterLayer
+        double na_value; // the `NAvalue` of the layer, NaN if it has none
+
+        auto getPixelCount() const -> size_t {
+            return static_cast<size_t>(width) * height;
+        }
+
+        /**
+         * Converts a range of values (row major) to pixels of the type in `dd`
+         * @param offset index of the first value
+         * @param count number of values
+         * @param pixels destination for `count` pixels
+         */
+        void convert(size_t offset, size_t count, void *pixels) const {
+            if (TYPEOF(values) == REALSXP) {
+                fill_pixels_from_doubles(REAL(values) + offset, count, dd, na_value, pixels);
+            } else {
+                const int *input = (TYPEOF(values) == LGLSXP) ? LOGICAL(values) : INTEGER(values);
+                fill_pixels_from_integers(input + offset, count, dd, get_integer_na_value(na_value), pixels);
+            }
+        }
+    };
+
+    /**
+     * Reads the layout of an R RasterLayer and chooses the pixel type without converting any values.
+     * The pixel type follows the storage type of the values: integer and logical values become the smallest
+     * integer raster that holds them (see `choose_integer_datatype`), double values a Float32 (or Float64 for `FLT8S`)
+     * raster. Values equal to a finite `NAvalue` of the layer become no data like `NA`; the default of `-Inf` is kept.
+     * @param sexp a RasterLayer
+     */
+    auto read_raster_layer(SEXP sexp) -> RasterLayerValues {
         Rcpp::S4 rasterlayer(sexp);
         if (!rasterlayer.is("RasterLayer"))
             throw OperatorException("Result is not a RasterLayer");
@@ -274,27 +448,369 @@ namespace Rcpp {
         if (!(bool) data.slot("haveminmax"))
             throw OperatorException("Result raster does not have min/max");
 
-        double min = data.slot("min");
-        double max = data.slot("max");
-
-        Unit u = Unit::unknown();
-        u.setMinMax(min, max);
-        DataDescription dd(GDT_Float32, u);
-        dd.addNoData();
-        dd.verify();
-        auto raster_out = GenericRaster::create(dd, stref, static_cast<uint32_t>(width), static_cast<uint32_t>(height),
-                                                GenericRaster::Representation::CPU);
-        auto &raster2d = dynamic_cast<Raster2D<float> &>(*raster_out);
-
-        Rcpp::NumericVector pixels = data.slot("values");
-        int pos = 0;
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                float val = pixels[pos++];
-                raster2d.set(x, y, val);
+        SEXP values = data.slot("values");
+        const auto pixel_count = static_cast<size_t>(width) * static_cast<size_t>(height);
+        if (static_cast<size_t>(XLENGTH(values)) != pixel_count)
+            throw OperatorException("Result raster has the wrong number of values");
+
+        Rcpp::S4 file = rasterlayer.slot("file");
+        double na_value = std::numeric_limits<double>::quiet_NaN();
+        if (file.hasSlot("NAvalue")) {
+            const double value = Rcpp::as<double>(file.slot("NAvalue"));
+            if (std::isfinite(value))
+                na_value = value;
+        }
+
+        switch (TYPEOF(values)) {
+            case LGLSXP:
+            case INTSXP: {
+                const int *input = (TYPEOF(values) == LGLSXP) ? LOGICAL(values) : INTEGER(values);
+                const int missing = get_integer_na_value(na_value);
+                double min = 0, max = 0;
+                bool has_values = false;
+                for (size_t i = 0; i < pixel_count; i++) {
+                    if (input[i] == NA_INTEGER || input[i] == missing)
+                        continue;
+                    if (!has_values || input[i] < min)
+                        min = input[i];
+                    if (!has_values || input[i] > max)
+                        max = input[i];
+                    has_values = true;
+                }
+
+                GDALDataType datatype = choose_integer_datatype(min, max);
+                Unit u = Unit::unknown();
+                u.setMinMax(min, max);
+                // values that reach the maximum of Int32 leave no integer for no data and become Float64 with NaN
+                const bool integer = datatype != GDT_Float64;
+                DataDescription dd(datatype, u, integer, integer ? get_max_pixel_value(datatype) : 0);
+                if (!integer)
+                    dd.addNoData();
+                dd.verify();
+                return RasterLayerValues{dd, stref, static_cast<uint32_t>(width), static_cast<uint32_t>(height),
+                                         values, na_value};
             }
+
+            case REALSXP: {
+                // rasters that were written with double precision keep it, all others are sent as Float32
+                std::string datanotation = file.slot("datanotation");
+                GDALDataType datatype = (datanotation == "FLT8S") ? GDT_Float64 : GDT_Float32;
+
+                Unit u = Unit::unknown();
+                u.setMinMax(data.slot("min"), data.slot("max"));
+                DataDescription dd(datatype, u);
+                dd.addNoData();
+                dd.verify();
+                return RasterLayerValues{dd, stref, static_cast<uint32_t>(width), static_cast<uint32_t>(height),
+                                         values, na_value};
+            }
+
+            default:
+                throw OperatorException("Result raster values are neither numeric, integer nor logical");
         }
-        return raster_out;
+    }
+
+    /**
+     * Convert R RasterLayer to GenericRaster, see `read_raster_layer` for the pixel type
+     * @param sexp
+     * @return GenericRaster
+     */
+    template<>
+    std::unique_ptr<GenericRaster> as(SEXP sexp) {
+        TraceSpan span("Rcpp: unwrapping raster");
+
+        auto layer = read_raster_layer(sexp);
+        auto raster = GenericRaster::create(layer.dd, layer.stref, layer.width, layer.height,
+                                            GenericRaster::Representation::CPU);
+        layer.convert(0, layer.getPixelCount(), raster->getDataForWriting());
+        return raster;
+    }
+
+    /**
+     * Helper function that adds the columns of an R `data.frame` as attributes to a feature collection.
+     *
+     * Column types are checked with `TYPEOF` and the values are read from the raw column memory. Numeric columns are
+     * copied in bulk, factor and character columns convert each distinct value to a `std::string` only once.
+     * Numeric columns named `time_start` and `time_end`, as created by `create_attribute_data_frame`, become the time
+     * intervals of the features.
+     * @param collection a collection that already contains all features
+     * @param data a `data.frame` with one row per feature
+     * @param size the number of features
+     * @param skip_column a column that is not an attribute, e.g. the geometry column of an `sf` data frame
+     */
+    auto add_feature_attributes(SimpleFeatureCollection &collection, SEXP data, size_t size,
+                                const std::string &skip_column = "") -> void {
+        SEXP names = Rf_getAttrib(data, R_NamesSymbol);
+        const R_xlen_t column_count = Rf_xlength(data);
+
+        SEXP time_start = R_NilValue;
+        SEXP time_end = R_NilValue;
+
+        for (R_xlen_t c = 0; c < column_count; c++) {
+            SEXP column = VECTOR_ELT(data, c);
+            std::string name = CHAR(STRING_ELT(names, c));
+            if (name == skip_column)
+                continue;
+            if (static_cast<size_t>(Rf_xlength(column)) != size)
+                throw OperatorException("Attribute " + name + " has the wrong length");
+
+            if (Rf_isFactor(column)) {
+                SEXP levels = Rf_getAttrib(column, R_LevelsSymbol);
+                std::vector<std::string> dictionary;
+                dictionary.reserve(static_cast<size_t>(Rf_xlength(levels)));
+                for (R_xlen_t l = 0; l < Rf_xlength(levels); l++)
+                    dictionary.emplace_back(CHAR(STRING_ELT(levels, l)));
+
+                auto &vec = collection.feature_attributes.addTextualAttribute(name, Unit::unknown());
+                vec.reserve(size);
+                const int *codes = INTEGER(column);
+                const std::string empty;
+                for (size_t i = 0; i < size; i++) {
+                    const int code = codes[i];
+                    if (code == NA_INTEGER) {
+                        vec.set(i, empty);
+                        continue;
+                    }
+                    if (code < 1 || static_cast<size_t>(code) > dictionary.size())
+                        throw OperatorException("Attribute " + name + " has a code without a factor level");
+                    vec.set(i, dictionary[code - 1]);
+                }
+                continue;
+            }
+
+            switch (TYPEOF(column)) {
+                case REALSXP: {
+                    if (name == "time_start") {
+                        time_start = column;
+                        break;
+                    }
+                    if (name == "time_end") {
+                        time_end = column;
+                        break;
+                    }
+
+                    const double *values = REAL(column);
+                    collection.feature_attributes.addNumericAttribute(name, Unit::unknown(),
+                                                                      std::vector<double>(values, values + size));
+                    break;
+                }
+
+                case INTSXP:
+                case LGLSXP: {
+                    const int *values = (TYPEOF(column) == LGLSXP) ? LOGICAL(column) : INTEGER(column);
+                    std::vector<double> converted(size);
+                    for (size_t i = 0; i < size; i++)
+                        converted[i] = values[i] == NA_INTEGER ? NAN : static_cast<double>(values[i]);
+                    collection.feature_attributes.addNumericAttribute(name, Unit::unknown(), std::move(converted));
+                    break;
+                }
+
+                case STRSXP: {
+                    // equal strings share a CHARSXP in R's global cache, so the pointer identifies the value
+                    std::unordered_map<SEXP, std::string> dictionary;
+                    auto &vec = collection.feature_attributes.addTextualAttribute(name, Unit::unknown());
+                    vec.reserve(size);
+                    for (size_t i = 0; i < size; i++) {
+                        SEXP value = STRING_ELT(column, static_cast<R_xlen_t>(i));
+                        auto entry = dictionary.find(value);
+                        if (entry == dictionary.end())
+                            entry = dictionary.emplace(value, value == NA_STRING ? "" : CHAR(value)).first;
+                        vec.set(i, entry->second);
+                    }
+                    break;
+                }
+
+                default:
+                    throw OperatorException("Attribute " + name + " has an unsupported type");
+            }
+        }
+
+        if (time_start != R_NilValue && time_end != R_NilValue) {
+            const double *t1 = REAL(time_start);
+            const double *t2 = REAL(time_end);
+            collection.time.reserve(size);
+            for (size_t i = 0; i < size; i++)
+                collection.time.emplace_back(t1[i], t2[i]);
+        } else {
+            // a single time column is a regular attribute
+            for (SEXP column : {time_start, time_end}) {
+                if (column == R_NilValue)
+                    continue;
+                const double *values = REAL(column);
+                collection.feature_attributes.addNumericAttribute(column == time_start ? "time_start" : "time_end",
+                                                                  Unit::unknown(),
+                                                                  std::vector<double>(values, values + size));
+            }
+        }
+    }
+
+    /**
+     * The representations in which feature collections are handed to R.
+     */
+    enum class FeatureRepresentation {
+        SP,  // S4 classes of the `sp` package
+        SF,  // a data frame of the `sf` package
+        WKB  // a data frame with a list column of well-known binary geometries
+    };
+
+    auto parse_feature_representation(const std::string &name) -> FeatureRepresentation {
+        if (name == "sp")
+            return FeatureRepresentation::SP;
+        if (name == "sf")
+            return FeatureRepresentation::SF;
+        if (name == "wkb")
+            return FeatureRepresentation::WKB;
+        throw ArgumentException("Unknown feature representation: " + name);
+    }
+
+    /**
+     * Helper function that returns the geometry column of an `sf` data frame and its name.
+     */
+    auto get_sf_geometry(SEXP sf) -> std::pair<SEXP, std::string> {
+        std::string geometry_column = Rcpp::as<std::string>(Rf_getAttrib(sf, Rf_install("sf_column")));
+        SEXP names = Rf_getAttrib(sf, R_NamesSymbol);
+        for (R_xlen_t c = 0; c < Rf_xlength(sf); c++) {
+            if (geometry_column == CHAR(STRING_ELT(names, c)))
+                return std::make_pair(VECTOR_ELT(sf, c), geometry_column);
+        }
+        throw OperatorException("Result has no geometry column " + geometry_column);
+    }
+
+    /**
+     * Helper function that reads the `crs` attribute of an `sf` geometry column.
+     */
+    auto get_sf_crs(SEXP sfc) -> CrsId {
+        Rcpp::List crs(Rf_getAttrib(sfc, Rf_install("crs")));
+        // sf >= 0.9 stores the user input, earlier versions the proj4 string
+        std::string srs = crs.containsElementNamed("input") ? Rcpp::as<std::string>(crs["input"])
+                                                            : Rcpp::as<std::string>(crs["proj4string"]);
+        return CrsId::from_srs_string(srs);
+    }
+
+    /**
+     * Helper function that adds the rows of a two-column coordinate matrix to a collection.
+     */
+    template<typename Collection>
+    auto add_matrix_coordinates(Collection &collection, const Rcpp::NumericMatrix &matrix) -> void {
+        const auto rows = static_cast<size_t>(matrix.nrow());
+        const double *x = matrix.begin();
+        const double *y = matrix.begin() + rows;
+        for (size_t i = 0; i < rows; i++)
+            collection.addCoordinate(x[i], y[i]);
+    }
+
+    /**
+     * Helper function that counts the coordinates of an `sf` geometry, i.e. of nested lists of matrices.
+     */
+    auto count_sf_coordinates(SEXP geometry) -> size_t {
+        if (TYPEOF(geometry) == VECSXP) {
+            size_t count = 0;
+            for (R_xlen_t i = 0; i < Rf_xlength(geometry); i++)
+                count += count_sf_coordinates(VECTOR_ELT(geometry, i));
+            return count;
+        }
+        if (Rf_isMatrix(geometry))
+            return static_cast<size_t>(Rf_nrows(geometry));
+        return 1; // POINT
+    }
+
+    /**
+     * Convert an `sf` data frame of POINT or MULTIPOINT geometries to a PointCollection
+     */
+    auto create_points_from_sf(SEXP sf) -> std::unique_ptr<PointCollection> {
+        auto geometry = get_sf_geometry(sf);
+        SEXP sfc = geometry.first;
+        const auto feature_count = static_cast<size_t>(Rf_xlength(sfc));
+
+        auto points = std::make_unique<PointCollection>(SpatioTemporalReference(get_sf_crs(sfc), TIMETYPE_UNIX));
+        points->coordinates.reserve(count_sf_coordinates(sfc));
+        points->start_feature.reserve(feature_count + 1);
+
+        for (size_t f = 0; f < feature_count; f++) {
+            SEXP sfg = VECTOR_ELT(sfc, static_cast<R_xlen_t>(f));
+            if (Rf_inherits(sfg, "POINT")) {
+                const double *xy = REAL(sfg);
+                points->addSinglePointFeature(Coordinate(xy[0], xy[1]));
+            } else if (Rf_inherits(sfg, "MULTIPOINT")) {
+                add_matrix_coordinates(*points, Rcpp::NumericMatrix(sfg));
+                points->finishFeature();
+            } else
+                throw OperatorException("Result contains a geometry that is neither POINT nor MULTIPOINT");
+        }
+
+        add_feature_attributes(*points, sf, feature_count, geometry.second);
+        return points;
+    }
+
+    /**
+     * Convert an `sf` data frame of LINESTRING or MULTILINESTRING geometries to a LineCollection
+     */
+    auto create_lines_from_sf(SEXP sf) -> std::unique_ptr<LineCollection> {
+        auto geometry = get_sf_geometry(sf);
+        SEXP sfc = geometry.first;
+        const auto feature_count = static_cast<size_t>(Rf_xlength(sfc));
+
+        auto lines = std::make_unique<LineCollection>(SpatioTemporalReference(get_sf_crs(sfc), TIMETYPE_UNIX));
+        lines->coordinates.reserve(count_sf_coordinates(sfc));
+        lines->start_feature.reserve(feature_count + 1);
+
+        for (size_t f = 0; f < feature_count; f++) {
+            SEXP sfg = VECTOR_ELT(sfc, static_cast<R_xlen_t>(f));
+            if (Rf_inherits(sfg, "LINESTRING")) {
+                add_matrix_coordinates(*lines, Rcpp::NumericMatrix(sfg));
+                lines->finishLine();
+            } else if (Rf_inherits(sfg, "MULTILINESTRING")) {
+                for (R_xlen_t l = 0; l < Rf_xlength(sfg); l++) {
+                    add_matrix_coordinates(*lines, Rcpp::NumericMatrix(VECTOR_ELT(sfg, l)));
+                    lines->finishLine();
+                }
+            } else
+                throw OperatorException("Result contains a geometry that is neither LINESTRING nor MULTILINESTRING");
+            lines->finishFeature();
+        }
+
+        add_feature_attributes(*lines, sf, feature_count, geometry.second);
+        return lines;
+    }
+
+    /**
+     * Helper function that adds the rings of an `sf` POLYGON as one polygon to a collection
+     */
+    auto add_sf_polygon(PolygonCollection &polygons, SEXP sfg) -> void {
+        for (R_xlen_t r = 0; r < Rf_xlength(sfg); r++) {
+            add_matrix_coordinates(polygons, Rcpp::NumericMatrix(VECTOR_ELT(sfg, r)));
+            polygons.finishRing();
+        }
+        polygons.finishPolygon();
+    }
+
+    /**
+     * Convert an `sf` data frame of POLYGON or MULTIPOLYGON geometries to a PolygonCollection
+     */
+    auto create_polygons_from_sf(SEXP sf) -> std::unique_ptr<PolygonCollection> {
+        auto geometry = get_sf_geometry(sf);
+        SEXP sfc = geometry.first;
+        const auto feature_count = static_cast<size_t>(Rf_xlength(sfc));
+
+        auto polygons = std::make_unique<PolygonCollection>(
+                SpatioTemporalReference(get_sf_crs(sfc), TIMETYPE_UNIX));
+        polygons->coordinates.reserve(count_sf_coordinates(sfc));
+        polygons->start_feature.reserve(feature_count + 1);
+
+        for (size_t f = 0; f < feature_count; f++) {
+            SEXP sfg = VECTOR_ELT(sfc, static_cast<R_xlen_t>(f));
+            if (Rf_inherits(sfg, "POLYGON")) {
+                add_sf_polygon(*polygons, sfg);
+            } else if (Rf_inherits(sfg, "MULTIPOLYGON")) {
+                for (R_xlen_t p = 0; p < Rf_xlength(sfg); p++)
+                    add_sf_polygon(*polygons, VECTOR_ELT(sfg, p));
+            } else
+                throw OperatorException("Result contains a geometry that is neither POLYGON nor MULTIPOLYGON");
+            polygons->finishFeature();
+        }
+
+        add_feature_attributes(*polygons, sf, feature_count, geometry.second);
+        return polygons;
     }
 
     // PointCollection
@@ -310,7 +826,7 @@ namespace Rcpp {
             , projargs = NA_character_
         )
         */
-        Profiler::Profiler {"Rcpp: wrapping pointcollection"};
+        TraceSpan span("Rcpp: wrapping pointcollection");
 
         Rcpp::S4 SPDF{"SpatialPointsDataFrame"};
 
@@ -318,12 +834,7 @@ namespace Rcpp {
 
         Rcpp::DataFrame data = create_attribute_data_frame(points);
 
-        Rcpp::NumericMatrix coords(static_cast<const int &>(size), 2);
-        for (decltype(size) i = 0; i < size; i++) {
-            const Coordinate &p = points.coordinates[i];
-            coords(i, 0) = p.x;
-            coords(i, 1) = p.y;
-        }
+        Rcpp::NumericMatrix coords = create_coordinate_matrix(points.coordinates, 0, size);
 
         Rcpp::NumericMatrix bbox = create_bbox(points);
 
@@ -347,7 +858,10 @@ namespace Rcpp {
 
     template<>
     std::unique_ptr<PointCollection> as(SEXP sexp) {
-        Profiler::Profiler {"Rcpp: unwrapping pointcollection"};
+        TraceSpan span("Rcpp: unwrapping pointcollection");
+
+        if (Rf_inherits(sexp, "sf"))
+            return create_points_from_sf(sexp);
 
         Rcpp::S4 SPDF(sexp);
         if (!SPDF.is("SpatialPointsDataFrame"))
@@ -366,40 +880,18 @@ namespace Rcpp {
 
         auto coords = Rcpp::as<Rcpp::NumericMatrix>(SPDF.slot("coords"));
 
+        // the matrix is column major, so x and y are two contiguous columns
         auto size = static_cast<size_t>(coords.nrow());
-        points->coordinates.reserve(size);
-        for (size_t i = 0; i < size; i++) {
-            double x = coords(i, 0);
-            double y = coords(i, 1);
-            points->addSinglePointFeature(Coordinate(x, y));
-        }
+        interleave_coordinates(coords.begin(), coords.begin() + size, size, points->coordinates);
 
-        auto data = Rcpp::as<Rcpp::DataFrame>(SPDF.slot("data"));
+        // every feature is a single point, so each one ends one coordinate after the previous one
+        auto &start_feature = points->start_feature;
+        auto end = start_feature.back();
+        start_feature.reserve(start_feature.size() + size);
+        for (size_t i = 0; i < size; i++)
+            start_feature.push_back(++end);
 
-        Rcpp::Function attributes("attributes");
-        Rcpp::List attrs = attributes(data);
-
-        Rcpp::StringVector a = attrs["names"];
-        auto len = a.length();
-        for (int i = 0; i < len; i++) {
-            auto attr = Rcpp::as<std::string>(a[i]);
-            try {
-                Rcpp::NumericVector rvec = data[attr];
-                auto &vec = points->feature_attributes.addNumericAttribute(attr, Unit::unknown());
-                vec.reserve(size);
-                for (size_t j = 0; j < size; j++)
-                    vec.set(j, (double) rvec[j]);
-            }
-            catch (const Rcpp::not_compatible &e) {
-                Rcpp::StringVector rvec = data[attr];
-                auto &vec = points->feature_attributes.addTextualAttribute(attr, Unit::unknown());
-                vec.reserve(size);
-                for (size_t j = 0; j < size; j++)
-                    vec.set(j, (std::string) rvec[j]);
-            }
-        }
-
-        // TODO: convert time vector
+        add_feature_attributes(*points, SPDF.slot("data"), size);
 
         return points;
     }
@@ -427,13 +919,13 @@ namespace Rcpp {
     auto
     create_polygons(const PolygonCollection::PolygonPolygonReference<const PolygonCollection> &polygon) -> Rcpp::S4 {
         Rcpp::S4 r_polygons("Polygons");
-        Rcpp::List r_polygon_list;
+        Rcpp::List r_polygon_list(polygon.size());
 
-        bool is_hole = false; // all but the first one are holes
+        R_xlen_t index = 0;
         for (const auto &ring : polygon) {
-            r_polygon_list.push_back(create_polygon(ring, is_hole));
-
-            is_hole = true;
+            // all but the first one are holes
+            r_polygon_list[index] = create_polygon(ring, index > 0);
+            ++index;
         }
 
         r_polygons.slot("Polygons") = r_polygon_list;
@@ -444,10 +936,11 @@ namespace Rcpp {
     auto create_spatial_polygons(
             const PolygonCollection::PolygonFeatureReference<const PolygonCollection> &feature) -> Rcpp::S4 {
         Rcpp::S4 r_spatial_polygons("SpatialPolygons");
-        Rcpp::List r_polygons_list;
+        Rcpp::List r_polygons_list(feature.size());
 
+        R_xlen_t index = 0;
         for (const auto &polygon : feature) {
-            r_polygons_list.push_back(create_polygons(polygon));
+            r_polygons_list[index++] = create_polygons(polygon);
         }
 
         r_spatial_polygons.slot("polygons") = r_polygons_list;
@@ -462,11 +955,12 @@ namespace Rcpp {
      */
     template<>
     SEXP wrap(const PolygonCollection &polygonCollection) {
-        Profiler::Profiler {"Rcpp: wrapping PolygonCollection"};
+        TraceSpan span("Rcpp: wrapping PolygonCollection");
 
-        Rcpp::List r_spatial_polygons_list;
+        Rcpp::List r_spatial_polygons_list(polygonCollection.getFeatureCount());
+        R_xlen_t index = 0;
         for (const auto &feature : polygonCollection) {
-            r_spatial_polygons_list.push_back(create_spatial_polygons(feature));
+            r_spatial_polygons_list[index++] = create_spatial_polygons(feature);
         }
 
         Rcpp::S4 r_spatial_polygons_data_frame("SpatialPolygonsDataFrame");
@@ -507,9 +1001,9 @@ namespace Rcpp {
 
     auto create_lines(const LineCollection::LineLineReference<const LineCollection> &line) -> Rcpp::S4 {
         Rcpp::S4 r_lines("Lines");
-        Rcpp::List r_lines_list;
+        Rcpp::List r_lines_list(1);
 
-        r_lines_list.push_back(create_line(line));
+        r_lines_list[0] = create_line(line);
 
         r_lines.slot("Lines") = r_lines_list;
 
@@ -518,10 +1012,11 @@ namespace Rcpp {
 
     auto create_spatial_lines(const LineCollection::LineFeatureReference<const LineCollection> &feature) -> Rcpp::S4 {
         Rcpp::S4 r_spatial_lines("SpatialLines");
-        Rcpp::List r_lines_list;
+        Rcpp::List r_lines_list(feature.size());
 
+        R_xlen_t index = 0;
         for (const auto &line : feature) {
-            r_lines_list.push_back(create_lines(line));
+            r_lines_list[index++] = create_lines(line);
         }
 
         r_spatial_lines.slot("lines") = r_lines_list;
@@ -536,11 +1031,12 @@ namespace Rcpp {
      */
     template<>
     SEXP wrap(const LineCollection &lineCollection) {
-        Profiler::Profiler {"Rcpp: wrapping LineCollection"};
+        TraceSpan span("Rcpp: wrapping LineCollection");
 
-        Rcpp::List r_spatial_lines_list;
+        Rcpp::List r_spatial_lines_list(lineCollection.getFeatureCount());
+        R_xlen_t index = 0;
         for (const auto &feature : lineCollection) {
-            r_spatial_lines_list.push_back(create_spatial_lines(feature));
+            r_spatial_lines_list[index++] = create_spatial_lines(feature);
         }
 
         Rcpp::S4 r_spatial_lines_data_frame("SpatialLinesDataFrame");
@@ -562,4 +1058,567 @@ namespace Rcpp {
         return Rcpp::wrap(*lineCollection);
     }
 
+
+    /**
+     * Helper function that collects the coordinate matrices of the lines of a feature.
+     * A feature is either a `Lines` object or, as created by `wrap`, a `SpatialLines` object.
+     * @param feature
+     * @param lines receives one coordinate matrix per line
+     * @return the number of coordinates
+     */
+    auto collect_feature_lines(const Rcpp::S4 &feature, std::vector<Rcpp::NumericMatrix> &lines) -> size_t {
+        size_t coordinate_count = 0;
+        if (feature.is("SpatialLines")) {
+            Rcpp::List r_lines_list = feature.slot("lines");
+            for (R_xlen_t i = 0; i < r_lines_list.size(); i++)
+                coordinate_count += collect_feature_lines(Rcpp::S4(r_lines_list[i]), lines);
+        } else if (feature.is("Lines")) {
+            Rcpp::List r_line_list = feature.slot("Lines");
+            for (R_xlen_t i = 0; i < r_line_list.size(); i++) {
+                Rcpp::S4 r_line(r_line_list[i]);
+                lines.emplace_back(r_line.slot("coords"));
+                coordinate_count += static_cast<size_t>(lines.back().nrow());
+            }
+        } else
+            throw OperatorException("Result contains a feature that is neither Lines nor SpatialLines");
+        return coordinate_count;
+    }
+
+    /**
+     * Convert a SpatialLinesDataFrame to a LineCollection.
+     * The first pass collects all coordinate matrices and sizes the coordinate, line and feature arrays,
+     * the second one fills them.
+     * @param sexp
+     * @return LineCollection
+     */
+    template<>
+    std::unique_ptr<LineCollection> as(SEXP sexp) {
+        TraceSpan span("Rcpp: unwrapping LineCollection");
+
+        if (Rf_inherits(sexp, "sf"))
+            return create_lines_from_sf(sexp);
+
+        Rcpp::S4 r_spatial_lines_data_frame(sexp);
+        if (!r_spatial_lines_data_frame.is("SpatialLinesDataFrame"))
+            throw OperatorException("Result is not a SpatialLinesDataFrame");
+
+        Rcpp::S4 crs = r_spatial_lines_data_frame.slot("proj4string");
+        std::string crs_string = crs.slot("projargs");
+        auto lineCollection = std::make_unique<LineCollection>(
+                SpatioTemporalReference(CrsId::from_srs_string(crs_string), TIMETYPE_UNIX));
+
+        Rcpp::List r_features = r_spatial_lines_data_frame.slot("lines");
+        const auto feature_count = static_cast<size_t>(r_features.size());
+
+        std::vector<std::vector<Rcpp::NumericMatrix>> features(feature_count);
+        size_t coordinate_count = 0;
+        size_t line_count = 0;
+        for (size_t f = 0; f < feature_count; f++) {
+            coordinate_count += collect_feature_lines(Rcpp::S4(r_features[f]), features[f]);
+            line_count += features[f].size();
+        }
+
+        lineCollection->coordinates.reserve(coordinate_count);
+        lineCollection->start_line.reserve(line_count + 1);
+        lineCollection->start_feature.reserve(feature_count + 1);
+
+        for (const auto &feature : features) {
+            for (const auto &line : feature) {
+                const auto rows = static_cast<size_t>(line.nrow());
+                const double *x = line.begin();
+                const double *y = line.begin() + rows;
+                for (size_t i = 0; i < rows; i++)
+                    lineCollection->addCoordinate(x[i], y[i]);
+                lineCollection->finishLine();
+            }
+            lineCollection->finishFeature();
+        }
+
+        add_feature_attributes(*lineCollection, r_spatial_lines_data_frame.slot("data"), feature_count);
+
+        return lineCollection;
+    }
+
+    /**
+     * Helper function that groups the rings of a `Polygons` object into polygons.
+     * Holes belong to the exterior ring named by the `comment` attribute (as maintained by rgeos) or, without it,
+     * to the preceding exterior ring. A hole without such an exterior ring is an error.
+     * @param r_polygons
+     * @param polygons receives one list of rings per polygon, the exterior ring first
+     * @return the number of coordinates
+     */
+    auto collect_polygons(const Rcpp::S4 &r_polygons,
+                          std::vector<std::vector<Rcpp::NumericMatrix>> &polygons) -> size_t {
+        Rcpp::List r_polygon_list = r_polygons.slot("Polygons");
+        const auto ring_count = static_cast<size_t>(r_polygon_list.size());
+
+        std::vector<int> exterior_of_ring;
+        SEXP comment = Rf_getAttrib(r_polygons, R_CommentSymbol);
+        if (comment != R_NilValue) {
+            std::istringstream indices(CHAR(STRING_ELT(comment, 0)));
+            int index;
+            while (indices >> index)
+                exterior_of_ring.push_back(index);
+        }
+        const bool has_comment = exterior_of_ring.size() == ring_count;
+
+        // holes do not start a polygon, so they map to none
+        const size_t no_polygon = std::numeric_limits<size_t>::max();
+        std::vector<size_t> polygon_of_ring(ring_count, no_polygon);
+        size_t coordinate_count = 0;
+
+        // exterior rings first, so holes can refer to them
+        for (size_t r = 0; r < ring_count; r++) {
+            Rcpp::S4 r_polygon(r_polygon_list[r]);
+            bool is_hole = has_comment ? exterior_of_ring[r] != 0 : Rcpp::as<bool>(r_polygon.slot("hole"));
+            if (is_hole)
+                continue;
+            polygon_of_ring[r] = polygons.size();
+            polygons.emplace_back();
+            polygons.back().emplace_back(r_polygon.slot("coords"));
+            coordinate_count += static_cast<size_t>(polygons.back().back().nrow());
+        }
+
+        size_t last_exterior = no_polygon;
+        for (size_t r = 0; r < ring_count; r++) {
+            Rcpp::S4 r_polygon(r_polygon_list[r]);
+            bool is_hole = has_comment ? exterior_of_ring[r] != 0 : Rcpp::as<bool>(r_polygon.slot("hole"));
+            if (!is_hole) {
+                last_exterior = polygon_of_ring[r];
+                continue;
+            }
+            size_t polygon = last_exterior;
+            if (has_comment) {
+                auto exterior = static_cast<size_t>(exterior_of_ring[r] - 1);
+                if (exterior >= ring_count)
+                    throw OperatorException("Result contains a Polygons comment that refers to an unknown ring");
+                polygon = polygon_of_ring[exterior];
+            }
+            if (polygon >= polygons.size())
+                throw OperatorException("Result contains a hole without exterior ring");
+            polygons[polygon].emplace_back(r_polygon.slot("coords"));
+            coordinate_count += static_cast<size_t>(polygons[polygon].back().nrow());
+        }
+
+        return coordinate_count;
+    }
+
+    /**
+     * Helper function that collects the polygons of a feature.
+     * A feature is either a `Polygons` object or, as created by `wrap`, a `SpatialPolygons` object.
+     * @param feature
+     * @param polygons receives one list of rings per polygon, the exterior ring first
+     * @return the number of coordinates
+     */
+    auto collect_feature_polygons(const Rcpp::S4 &feature,
+                                  std::vector<std::vector<Rcpp::NumericMatrix>> &polygons) -> size_t {
+        if (feature.is("Polygons"))
+            return collect_polygons(feature, polygons);
+        if (feature.is("SpatialPolygons")) {
+            size_t coordinate_count = 0;
+            Rcpp::List r_polygons_list = feature.slot("polygons");
+            for (R_xlen_t i = 0; i < r_polygons_list.size(); i++)
+                coordinate_count += collect_polygons(Rcpp::S4(r_polygons_list[i]), polygons);
+            return coordinate_count;
+        }
+        throw OperatorException("Result contains a feature that is neither Polygons nor SpatialPolygons");
+    }
+
+    /**
+     * Convert a SpatialPolygonsDataFrame to a PolygonCollection.
+     * The first pass collects all rings and sizes the coordinate, ring, polygon and feature arrays,
+     * the second one fills them.
+     * @param sexp
+     * @return PolygonCollection
+     */
+    template<>
+    std::unique_ptr<PolygonCollection> as(SEXP sexp) {
+        TraceSpan span("Rcpp: unwrapping PolygonCollection");
+
+        if (Rf_inherits(sexp, "sf"))
+            return create_polygons_from_sf(sexp);
+
+        Rcpp::S4 r_spatial_polygons_data_frame(sexp);
+        if (!r_spatial_polygons_data_frame.is("SpatialPolygonsDataFrame"))
+            throw OperatorException("Result is not a SpatialPolygonsDataFrame");
+
+        Rcpp::S4 crs = r_spatial_polygons_data_frame.slot("proj4string");
+        std::string crs_string = crs.slot("projargs");
+        auto polygonCollection = std::make_unique<PolygonCollection>(
+                SpatioTemporalReference(CrsId::from_srs_string(crs_string), TIMETYPE_UNIX));
+
+        Rcpp::List r_features = r_spatial_polygons_data_frame.slot("polygons");
+        const auto feature_count = static_cast<size_t>(r_features.size());
+
+        std::vector<std::vector<std::vector<Rcpp::NumericMatrix>>> features(feature_count);
+        size_t coordinate_count = 0;
+        size_t polygon_count = 0;
+        size_t ring_count = 0;
+        for (size_t f = 0; f < feature_count; f++) {
+            coordinate_count += collect_feature_polygons(Rcpp::S4(r_features[f]), features[f]);
+            polygon_count += features[f].size();
+            for (const auto &polygon : features[f])
+                ring_count += polygon.size();
+        }
+
+        polygonCollection->coordinates.reserve(coordinate_count);
+        polygonCollection->start_ring.reserve(ring_count + 1);
+        polygonCollection->start_polygon.reserve(polygon_count + 1);
+        polygonCollection->start_feature.reserve(feature_count + 1);
+
+        for (const auto &feature : features) {
+            for (const auto &polygon : feature) {
+                for (const auto &ring : polygon) {
+                    const auto rows = static_cast<size_t>(ring.nrow());
+                    const double *x = ring.begin();
+                    const double *y = ring.begin() + rows;
+                    for (size_t i = 0; i < rows; i++)
+                        polygonCollection->addCoordinate(x[i], y[i]);
+                    polygonCollection->finishRing();
+                }
+                polygonCollection->finishPolygon();
+            }
+            polygonCollection->finishFeature();
+        }
+
+        add_feature_attributes(*polygonCollection, r_spatial_polygons_data_frame.slot("data"), feature_count);
+
+        return polygonCollection;
+    }
+
+
+    /**
+     * Helper function that sets the attributes of an `sfc` geometry column.
+     * @param geometries one `sfg` object per feature
+     * @param type the geometry type, e.g. `POINT`
+     * @param collection
+     */
+    auto finish_sfc(Rcpp::List &geometries, const std::string &type, const SimpleFeatureCollection &collection) -> void {
+        auto mbr = collection.getCollectionMBR();
+        Rcpp::NumericVector bbox = Rcpp::NumericVector::create(Rcpp::Named("xmin") = mbr.x1,
+                                                               Rcpp::Named("ymin") = mbr.y1,
+                                                               Rcpp::Named("xmax") = mbr.x2,
+                                                               Rcpp::Named("ymax") = mbr.y2);
+        bbox.attr("class") = "bbox";
+
+        Rcpp::Environment sf = Rcpp::Environment::namespace_env("sf");
+        Rcpp::Function st_crs = sf["st_crs"];
+
+        geometries.attr("precision") = 0.0;
+        geometries.attr("bbox") = bbox;
+        geometries.attr("crs") = st_crs(collection.stref.crsId.to_string());
+        geometries.attr("n_empty") = 0;
+        geometries.attr("class") = Rcpp::CharacterVector::create("sfc_" + type, "sfc");
+    }
+
+    /**
+     * Create an `sfc` column of POINT geometries, or MULTIPOINT if any feature has more than one point
+     */
+    auto create_sfc(const PointCollection &points) -> Rcpp::List {
+        const size_t feature_count = points.getFeatureCount();
+        bool is_multi = false;
+        for (size_t f = 0; f < feature_count && !is_multi; f++)
+            is_multi = points.start_feature[f + 1] - points.start_feature[f] != 1;
+
+        const std::string type = is_multi ? "MULTIPOINT" : "POINT";
+        Rcpp::CharacterVector sfg_class = Rcpp::CharacterVector::create("XY", type, "sfg");
+
+        Rcpp::List geometries(feature_count);
+        for (size_t f = 0; f < feature_count; f++) {
+            if (is_multi) {
+                Rcpp::NumericMatrix sfg = create_coordinate_matrix(points.coordinates, points.start_feature[f],
+                                                                   points.start_feature[f + 1]);
+                sfg.attr("class") = sfg_class;
+                geometries[f] = sfg;
+            } else {
+                const Coordinate &coordinate = points.coordinates[points.start_feature[f]];
+                Rcpp::NumericVector sfg = Rcpp::NumericVector::create(coordinate.x, coordinate.y);
+                sfg.attr("class") = sfg_class;
+                geometries[f] = sfg;
+            }
+        }
+
+        finish_sfc(geometries, type, points);
+        return geometries;
+    }
+
+    /**
+     * Create an `sfc` column of LINESTRING geometries, or MULTILINESTRING if any feature has more than one line
+     */
+    auto create_sfc(const LineCollection &lines) -> Rcpp::List {
+        const size_t feature_count = lines.getFeatureCount();
+        bool is_multi = false;
+        for (size_t f = 0; f < feature_count && !is_multi; f++)
+            is_multi = lines.start_feature[f + 1] - lines.start_feature[f] != 1;
+
+        const std::string type = is_multi ? "MULTILINESTRING" : "LINESTRING";
+        Rcpp::CharacterVector sfg_class = Rcpp::CharacterVector::create("XY", type, "sfg");
+
+        Rcpp::List geometries(feature_count);
+        for (size_t f = 0; f < feature_count; f++) {
+            const size_t first_line = lines.start_feature[f];
+            const size_t last_line = lines.start_feature[f + 1];
+            if (is_multi) {
+                Rcpp::List sfg(last_line - first_line);
+                for (size_t l = first_line; l < last_line; l++)
+                    sfg[l - first_line] = create_coordinate_matrix(lines.coordinates, lines.start_line[l],
+                                                                   lines.start_line[l + 1]);
+                sfg.attr("class") = sfg_class;
+                geometries[f] = sfg;
+            } else {
+                Rcpp::NumericMatrix sfg = create_coordinate_matrix(lines.coordinates, lines.start_line[first_line],
+                                                                   lines.start_line[first_line + 1]);
+                sfg.attr("class") = sfg_class;
+                geometries[f] = sfg;
+            }
+        }
+
+        finish_sfc(geometries, type, lines);
+        return geometries;
+    }
+
+    /**
+     * Helper function that creates the list of ring matrices of a polygon
+     */
+    auto create_sf_polygon(const PolygonCollection &polygons, size_t polygon) -> Rcpp::List {
+        const size_t first_ring = polygons.start_polygon[polygon];
+        const size_t last_ring = polygons.start_polygon[polygon + 1];
+        Rcpp::List rings(last_ring - first_ring);
+        for (size_t r = first_ring; r < last_ring; r++)
+            rings[r - first_ring] = create_coordinate_matrix(polygons.coordinates, polygons.start_ring[r],
+                                                             polygons.start_ring[r + 1]);
+        return rings;
+    }
+
+    /**
+     * Create an `sfc` column of POLYGON geometries, or MULTIPOLYGON if any feature has more than one polygon
+     */
+    auto create_sfc(const PolygonCollection &polygons) -> Rcpp::List {
+        const size_t feature_count = polygons.getFeatureCount();
+        bool is_multi = false;
+        for (size_t f = 0; f < feature_count && !is_multi; f++)
+            is_multi = polygons.start_feature[f + 1] - polygons.start_feature[f] != 1;
+
+        const std::string type = is_multi ? "MULTIPOLYGON" : "POLYGON";
+        Rcpp::CharacterVector sfg_class = Rcpp::CharacterVector::create("XY", type, "sfg");
+
+        Rcpp::List geometries(feature_count);
+        for (size_t f = 0; f < feature_count; f++) {
+            const size_t first_polygon = polygons.start_feature[f];
+            const size_t last_polygon = polygons.start_feature[f + 1];
+            if (is_multi) {
+                Rcpp::List sfg(last_polygon - first_polygon);
+                for (size_t p = first_polygon; p < last_polygon; p++)
+                    sfg[p - first_polygon] = create_sf_polygon(polygons, p);
+                sfg.attr("class") = sfg_class;
+                geometries[f] = sfg;
+            } else {
+                Rcpp::List sfg = create_sf_polygon(polygons, first_polygon);
+                sfg.attr("class") = sfg_class;
+                geometries[f] = sfg;
+            }
+        }
+
+        finish_sfc(geometries, type, polygons);
+        return geometries;
+    }
+
+    /**
+     * Helper class that encodes geometries as well-known binary in host byte order.
+     */
+    class WkbWriter {
+        public:
+            enum Type : uint32_t {
+                POINT = 1, LINESTRING = 2, POLYGON = 3, MULTIPOINT = 4, MULTILINESTRING = 5, MULTIPOLYGON = 6
+            };
+
+            void point(const Coordinate &coordinate) {
+                header(POINT);
+                append(coordinate.x);
+                append(coordinate.y);
+            }
+
+            void lineString(const std::vector<Coordinate> &coordinates, size_t begin, size_t end) {
+                header(LINESTRING);
+                points(coordinates, begin, end);
+            }
+
+            void polygon(const PolygonCollection &polygons, size_t polygon) {
+                const size_t first_ring = polygons.start_polygon[polygon];
+                const size_t last_ring = polygons.start_polygon[polygon + 1];
+                header(POLYGON);
+                append(static_cast<uint32_t>(last_ring - first_ring));
+                for (size_t r = first_ring; r < last_ring; r++)
+                    points(polygons.coordinates, polygons.start_ring[r], polygons.start_ring[r + 1]);
+            }
+
+            /**
+             * Starts a multi geometry, followed by `count` single geometries
+             */
+            void multi(Type type, size_t count) {
+                header(type);
+                append(static_cast<uint32_t>(count));
+            }
+
+            /**
+             * @return the encoded geometry as R raw vector; the writer is empty afterwards
+             */
+            auto toRaw() -> Rcpp::RawVector {
+                Rcpp::RawVector raw(Rcpp::no_init(bytes.size()));
+                std::copy(bytes.begin(), bytes.end(), raw.begin());
+                bytes.clear();
+                return raw;
+            }
+
+        private:
+            void header(Type type) {
+                const uint16_t probe = 1;
+                const auto is_little_endian = static_cast<uint8_t>(*reinterpret_cast<const uint8_t *>(&probe));
+                bytes.push_back(is_little_endian);
+                append(static_cast<uint32_t>(type));
+            }
+
+            void points(const std::vector<Coordinate> &coordinates, size_t begin, size_t end) {
+                append(static_cast<uint32_t>(end - begin));
+                for (size_t i = begin; i < end; i++) {
+                    append(coordinates[i].x);
+                    append(coordinates[i].y);
+                }
+            }
+
+            template<typename T>
+            void append(T value) {
+                const auto *value_bytes = reinterpret_cast<const uint8_t *>(&value);
+                bytes.insert(bytes.end(), value_bytes, value_bytes + sizeof(T));
+            }
+
+            std::vector<uint8_t> bytes;
+    };
+
+    /**
+     * Create a list column of WKB geometries, one raw vector per feature
+     */
+    auto create_wkb(const PointCollection &points) -> Rcpp::List {
+        const size_t feature_count = points.getFeatureCount();
+        Rcpp::List geometries(feature_count);
+        WkbWriter writer;
+        for (size_t f = 0; f < feature_count; f++) {
+            const size_t begin = points.start_feature[f];
+            const size_t end = points.start_feature[f + 1];
+            if (end - begin != 1)
+                writer.multi(WkbWriter::MULTIPOINT, end - begin);
+            for (size_t i = begin; i < end; i++)
+                writer.point(points.coordinates[i]);
+            geometries[f] = writer.toRaw();
+        }
+        geometries.attr("class") = "WKB";
+        return geometries;
+    }
+
+    auto create_wkb(const LineCollection &lines) -> Rcpp::List {
+        const size_t feature_count = lines.getFeatureCount();
+        Rcpp::List geometries(feature_count);
+        WkbWriter writer;
+        for (size_t f = 0; f < feature_count; f++) {
+            const size_t first_line = lines.start_feature[f];
+            const size_t last_line = lines.start_feature[f + 1];
+            if (last_line - first_line != 1)
+                writer.multi(WkbWriter::MULTILINESTRING, last_line - first_line);
+            for (size_t l = first_line; l < last_line; l++)
+                writer.lineString(lines.coordinates, lines.start_line[l], lines.start_line[l + 1]);
+            geometries[f] = writer.toRaw();
+        }
+        geometries.attr("class") = "WKB";
+        return geometries;
+    }
+
+    auto create_wkb(const PolygonCollection &polygons) -> Rcpp::List {
+        const size_t feature_count = polygons.getFeatureCount();
+        Rcpp::List geometries(feature_count);
+        WkbWriter writer;
+        for (size_t f = 0; f < feature_count; f++) {
+            const size_t first_polygon = polygons.start_feature[f];
+            const size_t last_polygon = polygons.start_feature[f + 1];
+            if (last_polygon - first_polygon != 1)
+                writer.multi(WkbWriter::MULTIPOLYGON, last_polygon - first_polygon);
+            for (size_t p = first_polygon; p < last_polygon; p++)
+                writer.polygon(polygons, p);
+            geometries[f] = writer.toRaw();
+        }
+        geometries.attr("class") = "WKB";
+        return geometries;
+    }
+
+    /**
+     * Helper function that appends a geometry column to the attributes of a collection.
+     * @param collection
+     * @param geometry a column with one geometry per feature
+     * @param is_sf whether to create an `sf` data frame or a plain `data.frame`
+     * @return the data frame
+     */
+    auto create_geometry_data_frame(const SimpleFeatureCollection &collection, SEXP geometry,
+                                    bool is_sf) -> Rcpp::List {
+        Rcpp::List attributes = create_attribute_data_frame(collection);
+        const R_xlen_t attribute_count = attributes.size();
+
+        std::vector<std::string> names;
+        names.reserve(static_cast<size_t>(attribute_count + 1));
+        if (attribute_count > 0) {
+            Rcpp::CharacterVector attribute_names = attributes.names();
+            for (R_xlen_t c = 0; c < attribute_count; c++)
+                names.emplace_back(attribute_names[c]);
+        }
+
+        std::string geometry_column = make_unique_column_name("geometry", names);
+
+        Rcpp::List data(attribute_count + 1);
+        for (R_xlen_t c = 0; c < attribute_count; c++)
+            data[c] = attributes[c];
+        data[attribute_count] = geometry;
+
+        Rcpp::CharacterVector column_names(names.begin(), names.end());
+        column_names.push_back(geometry_column);
+        data.attr("names") = column_names;
+        data.attr("row.names") = Rcpp::IntegerVector::create(NA_INTEGER,
+                                                             -static_cast<int>(collection.getFeatureCount()));
+
+        if (is_sf) {
+            Rcpp::IntegerVector agr(attribute_count, NA_INTEGER);
+            agr.attr("names") = Rcpp::CharacterVector(names.begin(), names.end());
+            agr.attr("levels") = Rcpp::CharacterVector::create("constant", "aggregate", "identity");
+            agr.attr("class") = "factor";
+
+            data.attr("sf_column") = geometry_column;
+            data.attr("agr") = agr;
+            data.attr("class") = Rcpp::CharacterVector::create("sf", "data.frame");
+        } else {
+            data.attr("class") = "data.frame";
+        }
+
+        return data;
+    }
+
+    /**
+     * Convert a feature collection into the requested representation
+     * @param collection a PointCollection, LineCollection or PolygonCollection
+     * @param representation
+     * @return an `sp` object, an `sf` data frame or a data frame with a `WKB` column
+     */
+    template<typename Collection>
+    auto wrap_features(const Collection &collection, FeatureRepresentation representation) -> SEXP {
+        switch (representation) {
+            case FeatureRepresentation::SF: {
+                TraceSpan span("Rcpp: wrapping features as sf");
+                return create_geometry_data_frame(collection, create_sfc(collection), true);
+            }
+            case FeatureRepresentation::WKB: {
+                TraceSpan span("Rcpp: wrapping features as WKB");
+                return create_geometry_data_frame(collection, create_wkb(collection), false);
+            }
+            case FeatureRepresentation::SP:
+            default:
+                return Rcpp::wrap(collection);
+        }
+    }
+
 }
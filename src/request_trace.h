@@ -0,0 +1,282 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+#include "util/log.h"
+#include "raster/profiler.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * When a request arrived, measured in the process that read its header.
+ * `steady_clock` is the system wide monotonic clock, so the times stay valid in forked children and pool workers.
+ */
+struct RequestArrival {
+    std::chrono::steady_clock::time_point received; // before the header was read or parsed
+    std::chrono::steady_clock::time_point parsed; // after the header was parsed
+};
+
+/**
+ * The spans of a single request, see docs/tracing.md.
+ *
+ * Every request gets a random trace id. Only sampled requests record spans; they are written to a file when the
+ * trace is destroyed, also if the request failed. While a sampled request runs, its trace is the active one, so
+ * `TraceSpan` can record spans anywhere in the code without passing the trace around. Spans are recorded by the
+ * thread running the request only.
+ */
+class RequestTrace {
+    public:
+        enum class Format {
+            JSON_LINES, // one line per trace in traces.jsonl
+            CHROME // one trace_event file per trace, for chrome://tracing or Perfetto
+        };
+
+        using Clock = std::chrono::steady_clock;
+
+        static auto parseFormat(const std::string &name) -> Format {
+            if (name == "jsonl")
+                return Format::JSON_LINES;
+            if (name == "chrome")
+                return Format::CHROME;
+            throw ArgumentException("Unknown trace format: " + name);
+        }
+
+        /**
+         * Starts the trace of a request and makes it the active one if it is sampled
+         * @param name describes the whole request, e.g. its result type
+         * @param sample_rate the fraction of requests to record (0 = none, 1 = all)
+         * @param directory where sampled traces are written
+         * @param format
+         */
+        RequestTrace(std::string name, double sample_rate, std::string directory, Format format)
+                : name(std::move(name)), id(makeId()), start(Clock::now()), sampled(false),
+                  directory(std::move(directory)), format(format) {
+            // the id is random, so it decides the sampling as well
+            sampled = sample_rate > 0 && static_cast<double>(id) / 18446744073709551616.0 < sample_rate;
+            if (sampled)
+                active() = this;
+        }
+
+        ~RequestTrace() {
+            if (active() == this)
+                active() = nullptr;
+            if (sampled)
+                write();
+        }
+
+        RequestTrace(const RequestTrace &) = delete;
+        RequestTrace &operator=(const RequestTrace &) = delete;
+
+        /**
+         * @return the trace of the running request or `nullptr` if it is not sampled
+         */
+        static auto active() -> RequestTrace *& {
+            static RequestTrace *trace = nullptr;
+            return trace;
+        }
+
+        /**
+         * @return the id as 16 hex digits
+         */
+        auto getId() const -> std::string {
+            char hex[17];
+            snprintf(hex, sizeof(hex), "%016" PRIx64, id);
+            return hex;
+        }
+
+        auto isSampled() const -> bool {
+            return sampled;
+        }
+
+        /**
+         * Adds a span that was measured elsewhere, e.g. in the parent before the fork
+         * @param args pairs of names and values that are already JSON
+         */
+        void addSpan(const std::string &span_name, Clock::time_point begin, Clock::time_point end,
+                     std::vector<std::pair<std::string, std::string>> args = {}) {
+            if (sampled)
+                spans.push_back(Span{span_name, begin, end, std::move(args)});
+        }
+
+        /**
+         * @return a string as a JSON string literal
+         */
+        static auto quote(const std::string &value) -> std::string {
+            std::string out = "\"";
+            for (char c : value) {
+                if (c == '"' || c == '\\') {
+                    out += '\\';
+                    out += c;
+                } else if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+            }
+            return out + "\"";
+        }
+
+    private:
+        struct Span {
+            std::string name;
+            Clock::time_point begin;
+            Clock::time_point end;
+            std::vector<std::pair<std::string, std::string>> args;
+        };
+
+        void write() const {
+            // spans added from the arrival of the request may start before the trace
+            auto first = start;
+            for (const auto &span : spans)
+                first = std::min(first, span.begin);
+            const auto end = Clock::now();
+            std::string out;
+            std::string path;
+            if (format == Format::JSON_LINES) {
+                path = directory + "/traces.jsonl";
+                out = "{\"trace_id\":\"" + getId() + "\",\"name\":" + quote(name) + ",\"pid\":" +
+                      std::to_string(getpid()) + ",\"duration_us\":" + std::to_string(microseconds(first, end)) +
+                      ",\"spans\":[";
+                for (size_t i = 0; i < spans.size(); i++) {
+                    const auto &span = spans[i];
+                    out += std::string(i > 0 ? "," : "") + "{\"name\":" + quote(span.name) + ",\"start_us\":" +
+                           std::to_string(microseconds(first, span.begin)) + ",\"duration_us\":" +
+                           std::to_string(microseconds(span.begin, span.end)) + ",\"args\":" +
+                           formatArgs(span.args) + "}";
+                }
+                out += "]}\n";
+            } else {
+                path = directory + "/trace-" + getId() + ".json";
+                const std::string pid = std::to_string(getpid());
+                out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+                out += completeEvent(name, first, end, pid, {{"trace_id", quote(getId())}});
+                for (const auto &span : spans)
+                    out += "," + completeEvent(span.name, span.begin, span.end, pid, span.args);
+                out += "]}\n";
+            }
+
+            // traces.jsonl is shared by all processes, a single append keeps the lines whole
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                Log::warn("Cannot write trace to %s", path.c_str());
+                return;
+            }
+            if (::write(fd, out.data(), out.size()) != static_cast<ssize_t>(out.size()))
+                Log::warn("Cannot write trace to %s", path.c_str());
+            ::close(fd);
+        }
+
+        static auto makeId() -> uint64_t {
+            // forked children inherit the state of any generator, so ask the kernel every time
+            std::random_device device;
+            return (static_cast<uint64_t>(device()) << 32) | device();
+        }
+
+        static auto microseconds(Clock::time_point from, Clock::time_point to) -> long long {
+            return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+        }
+
+        static auto formatArgs(const std::vector<std::pair<std::string, std::string>> &args) -> std::string {
+            std::string out = "{";
+            for (size_t i = 0; i < args.size(); i++)
+                out += std::string(i > 0 ? "," : "") + quote(args[i].first) + ":" + args[i].second;
+            return out + "}";
+        }
+
+        static auto completeEvent(const std::string &name, Clock::time_point begin, Clock::time_point end,
+                                  const std::string &pid, const std::vector<std::pair<std::string, std::string>> &args)
+                                  -> std::string {
+            return "{\"name\":" + quote(name) + ",\"ph\":\"X\",\"ts\":" +
+                   std::to_string(microseconds(Clock::time_point(), begin)) + ",\"dur\":" +
+                   std::to_string(microseconds(begin, end)) + ",\"pid\":" + pid + ",\"tid\":" + pid + ",\"args\":" +
+                   formatArgs(args) + "}";
+        }
+
+        std::string name;
+        uint64_t id;
+        Clock::time_point start;
+        bool sampled;
+        std::string directory;
+        Format format;
+        std::vector<Span> spans;
+};
+
+/**
+ * Measures a scope as a span of the active trace and reports it to the `Profiler` as well
+ */
+class TraceSpan {
+    public:
+        explicit TraceSpan(const char *name) : name(name), profiler(name), begin(RequestTrace::Clock::now()) {
+        }
+
+        ~TraceSpan() {
+            RequestTrace *trace = RequestTrace::active();
+            if (trace != nullptr)
+                trace->addSpan(name, begin, RequestTrace::Clock::now(), std::move(args));
+        }
+
+        TraceSpan(const TraceSpan &) = delete;
+        TraceSpan &operator=(const TraceSpan &) = delete;
+
+        /**
+         * @return whether the span is recorded, so that expensive arguments can be skipped otherwise
+         */
+        auto isRecording() const -> bool {
+            return RequestTrace::active() != nullptr;
+        }
+
+        /**
+         * Attaches a number to the span
+         */
+        template<typename T>
+        void arg(const char *key, T value) {
+            if (RequestTrace::active() != nullptr)
+                args.emplace_back(key, std::to_string(value));
+        }
+
+        /**
+         * Attaches a string to the span
+         */
+        void arg(const char *key, const std::string &value) {
+            if (RequestTrace::active() != nullptr)
+                args.emplace_back(key, RequestTrace::quote(value));
+        }
+
+        void arg(const char *key, const char *value) {
+            arg(key, std::string(value));
+        }
+
+    private:
+        const char *name;
+        Profiler::Profiler profiler;
+        RequestTrace::Clock::time_point begin;
+        std::vector<std::pair<std::string, std::string>> args;
+};
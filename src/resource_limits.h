@@ -0,0 +1,482 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/binarystream.h"
+#include "util/log.h"
+
+#include "message_socket.h"
+#include "server_metrics.h"
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * Limits the resources of the process running a request, see `rserver.limits` in docs/configuration.md.
+ *
+ * `apply()` runs in the child right after the fork, or in a pool worker before every request, and `release()` after
+ * the request, see `ResourceLimits::Scope`. Address space and CPU time are limited with `setrlimit()`. Resident
+ * memory is limited with a cgroup v2 of its own below `rserver.limits.cgroup` if that is set and writable, and with
+ * the size of the data segment otherwise.
+ *
+ * Temporary files are not limited with `RLIMIT_FSIZE`, as that also applies to the memory files that plots, large
+ * messages and the source cache are written to. Instead, every request gets a temporary directory of its own that R's
+ * `tempdir()` points to, and a watchdog thread checks how much it takes up.
+ *
+ * A request that hits a limit is answered with an error naming it, see "Resource limits" in docs/protocol.md:
+ * failed allocations surface as errors of R or C++ that `explain()` recognizes, while the CPU time limit raises a
+ * signal whose handler sends a prepared error message and exits, and the watchdog does the same. The cgroup limit
+ * kills the child, so its client only sees the connection close.
+ */
+class ResourceLimits {
+    public:
+        /**
+         * Applies the limits for as long as it exists
+         */
+        class Scope {
+            public:
+                /**
+                 * @param limits the limits to apply, or `nullptr` if the request runs unlimited
+                 */
+                explicit Scope(ResourceLimits *limits) : limits(limits) {
+                    if (limits != nullptr)
+                        limits->apply();
+                }
+
+                ~Scope() {
+                    if (limits != nullptr)
+                        limits->release();
+                }
+
+                Scope(const Scope &) = delete;
+                Scope &operator=(const Scope &) = delete;
+
+            private:
+                ResourceLimits *limits;
+        };
+
+        /**
+         * @param address_space_mb limit of virtual memory (0 = none)
+         * @param memory_mb limit of resident memory (0 = none)
+         * @param cpu_seconds limit of CPU time per request (0 = none)
+         * @param temp_files_mb limit of the temporary files of a request (0 = none)
+         * @param cgroup a cgroup v2 directory that the server may create groups in, or empty
+         * @param hard_limits whether to lower the hard limits as well, so that a request cannot raise its limits
+         *  again. Only possible if every process serves a single request; pool workers need other limits for their
+         *  next one.
+         * @param temp_directory the variable holding the temporary directory of the process, i.e. `R_TempDir`. It
+         *  points to the directory of the request while that runs, and request directories are created below the
+         *  directory it holds now.
+         * @param metrics counts the requests that hit a limit
+         */
+        ResourceLimits(size_t address_space_mb, size_t memory_mb, size_t cpu_seconds, size_t temp_files_mb,
+                       std::string cgroup, bool hard_limits, char **temp_directory, ServerMetrics *metrics)
+                : address_space_mb(address_space_mb), memory_mb(memory_mb), cpu_seconds(cpu_seconds),
+                  temp_files_mb(temp_files_mb), cgroup(std::move(cgroup)), hard_limits(hard_limits),
+                  temp_directory(temp_directory),
+                  temp_base(*temp_directory != nullptr ? *temp_directory : P_tmpdir), metrics(metrics),
+                  memory_in_cgroup(false), watchdog_stopped(false) {
+        }
+
+        ResourceLimits(const ResourceLimits &) = delete;
+        ResourceLimits &operator=(const ResourceLimits &) = delete;
+
+        auto isEnabled() const -> bool {
+            return address_space_mb > 0 || memory_mb > 0 || cpu_seconds > 0 || temp_files_mb > 0;
+        }
+
+        /**
+         * @return the limits of the running request or `nullptr` if it is not limited
+         */
+        static auto active() -> ResourceLimits *& {
+            static ResourceLimits *limits = nullptr;
+            return limits;
+        }
+
+        /**
+         * Limits the calling process. The CPU time counts from now on.
+         */
+        void apply() {
+            if (!isEnabled())
+                return;
+            active() = this;
+
+            getState().client_fd = -1;
+
+            if (address_space_mb > 0)
+                setLimit(RLIMIT_AS, address_space_mb * 1024 * 1024, address_space_mb * 1024 * 1024);
+
+            if (memory_mb > 0) {
+                memory_in_cgroup = !cgroup.empty() && joinCgroup();
+                if (!memory_in_cgroup)
+                    setLimit(RLIMIT_DATA, memory_mb * 1024 * 1024, memory_mb * 1024 * 1024);
+            }
+
+            if (cpu_seconds > 0) {
+                // a pool worker has used CPU time for earlier requests already
+                struct rusage usage{};
+                getrusage(RUSAGE_SELF, &usage);
+                const auto used = static_cast<size_t>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec);
+                // SIGKILL at the hard limit, which leaves the handler of SIGXCPU time to report the limit
+                setLimit(RLIMIT_CPU, used + cpu_seconds, used + cpu_seconds + 5);
+                installHandler(SIGXCPU);
+            }
+
+            if (temp_files_mb > 0)
+                startWatchdog();
+        }
+
+        /**
+         * Stops watching the temporary directory of the request and removes it. The lowered limits stay.
+         */
+        void release() {
+            getState().client_fd = -1;
+            if (active() == this)
+                active() = nullptr;
+            if (watchdog.joinable()) {
+                {
+                    std::lock_guard<std::mutex> guard(watchdog_mutex);
+                    watchdog_stopped = true;
+                }
+                watchdog_wakeup.notify_all();
+                watchdog.join();
+                *temp_directory = const_cast<char *>(temp_base.c_str());
+                removeTree(request_directory);
+            }
+        }
+
+        /**
+         * Prepares the error messages that are sent when the CPU time or temporary file limit is hit
+         * @param fd the connection to the client, or -1 if messages cannot be written to it directly, e.g. because
+         *  they are compressed
+         * @param sending is true while a message is being written to `fd`, the error is not written then
+         */
+        void setClient(int fd, const std::atomic<bool> *sending) {
+            auto &state = getState();
+            state.client_fd = -1;
+            state.cpu_time_message = frame(describe(ResourceLimit::CPU_TIME));
+            state.temp_files_message = frame(describe(ResourceLimit::TEMP_FILES));
+            state.sending = sending;
+            state.metrics = metrics;
+            state.client_fd = fd;
+        }
+
+        /**
+         * Recognizes errors that were caused by a memory limit and counts them
+         * @param message the error of a failed request
+         * @return the error to send to the client, naming the limit if one was hit
+         */
+        auto explain(const std::string &message) -> std::string {
+            const bool allocation_failed = message.find("cannot allocate") != std::string::npos ||
+                                           message.find("bad_alloc") != std::string::npos;
+            if (!allocation_failed)
+                return message;
+
+            // both limits make allocations fail, the lower one is the likely culprit
+            ResourceLimit limit;
+            if (memory_mb > 0 && !memory_in_cgroup && (address_space_mb == 0 || memory_mb <= address_space_mb))
+                limit = ResourceLimit::MEMORY;
+            else if (address_space_mb > 0)
+                limit = ResourceLimit::ADDRESS_SPACE;
+            else
+                return message;
+
+            metrics->addLimitBreach(limit);
+            return describe(limit) + ": " + message;
+        }
+
+    private:
+        /**
+         * What the signal handler needs, prepared in advance because it must not allocate
+         */
+        struct State {
+            volatile int client_fd = -1;
+            std::string cpu_time_message;
+            std::string temp_files_message;
+            const std::atomic<bool> *sending = nullptr;
+            ServerMetrics *metrics = nullptr;
+        };
+
+        static auto getState() -> State & {
+            static State state;
+            return state;
+        }
+
+        /**
+         * @return the error message for a limit, e.g. `Resource limit exceeded: cpu_time=60 s`
+         */
+        auto describe(ResourceLimit limit) const -> std::string {
+            std::string value;
+            switch (limit) {
+                case ResourceLimit::ADDRESS_SPACE:
+                    value = std::to_string(address_space_mb) + " MB";
+                    break;
+                case ResourceLimit::MEMORY:
+                    value = std::to_string(memory_mb) + " MB";
+                    break;
+                case ResourceLimit::CPU_TIME:
+                    value = std::to_string(cpu_seconds) + " s";
+                    break;
+                default:
+                    value = std::to_string(temp_files_mb) + " MB";
+                    break;
+            }
+            return std::string("Resource limit exceeded: ") + ServerMetrics::getLimitName(limit) + "=" + value;
+        }
+
+        /**
+         * @return an error message as it is written to the socket, including the size
+         */
+        static auto frame(const std::string &message) -> std::string {
+            std::string text = message;
+            BinaryWriteBuffer error;
+            error.write<char>(-RSERVER_TYPE_ERROR);
+            error.write<std::string &>(text);
+            std::string payload = MessageSocket::serialize(error);
+            const size_t size = payload.size();
+            return std::string(reinterpret_cast<const char *>(&size), sizeof(size)) + payload;
+        }
+
+        static void installHandler(int signum) {
+            struct sigaction action{};
+            action.sa_handler = &ResourceLimits::onLimitSignal;
+            sigemptyset(&action.sa_mask);
+            sigaction(signum, &action, nullptr);
+        }
+
+        static void onLimitSignal(int) {
+            reportAndExit(ResourceLimit::CPU_TIME);
+        }
+
+        /**
+         * Reports the limit to the client unless a message is half written and exits, only async-signal-safe calls
+         */
+        static void reportAndExit(ResourceLimit limit) {
+            auto &state = getState();
+            if (state.metrics != nullptr)
+                state.metrics->addLimitBreach(limit);
+
+            const int fd = state.client_fd;
+            if (fd >= 0 && state.sending != nullptr && !state.sending->load()) {
+                const std::string &message = limit == ResourceLimit::CPU_TIME ? state.cpu_time_message
+                                                                              : state.temp_files_message;
+                size_t offset = 0;
+                while (offset < message.size()) {
+                    ssize_t written = ::write(fd, message.data() + offset, message.size() - offset);
+                    if (written <= 0)
+                        break;
+                    offset += static_cast<size_t>(written);
+                }
+            }
+            _exit(1);
+        }
+
+        /**
+         * Sets the soft limit, and the hard limit too if `hard_limits` is set: a lowered hard limit cannot be raised
+         * again. Neither is raised above the current hard limit.
+         */
+        void setLimit(int resource, rlim_t soft, rlim_t hard) {
+            struct rlimit limit{};
+            getrlimit(resource, &limit);
+            const rlim_t max = limit.rlim_max;
+            limit.rlim_cur = max == RLIM_INFINITY ? soft : std::min(soft, max);
+            if (hard_limits)
+                limit.rlim_max = max == RLIM_INFINITY ? hard : std::min(hard, max);
+            if (setrlimit(resource, &limit) != 0)
+                Log::warn("setrlimit(%d) failed: %s", resource, strerror(errno));
+        }
+
+        /**
+         * Creates the temporary directory of the request, points the process to it and starts checking its size
+         * every 100 ms. Removes the directories that processes which were killed during a request left behind.
+         */
+        void startWatchdog() {
+            removeStaleDirectories();
+
+            std::string path = temp_base + "/request-" + std::to_string(getpid()) + "-XXXXXX";
+            if (mkdtemp(&path[0]) == nullptr) {
+                Log::warn("Cannot create temporary directory below %s: %s", temp_base.c_str(), strerror(errno));
+                return;
+            }
+            request_directory = path;
+            *temp_directory = const_cast<char *>(request_directory.c_str());
+
+            watchdog_stopped = false;
+            watchdog = std::thread([this]() {
+                const size_t limit = temp_files_mb * 1024 * 1024;
+                std::unique_lock<std::mutex> lock(watchdog_mutex);
+                while (!watchdog_wakeup.wait_for(lock, std::chrono::milliseconds(100),
+                                                 [this]() { return watchdog_stopped; })) {
+                    if (getUsage(request_directory) > limit) {
+                        removeTree(request_directory);
+                        reportAndExit(ResourceLimit::TEMP_FILES);
+                    }
+                }
+            });
+        }
+
+        void removeStaleDirectories() {
+            DIR *directory = opendir(temp_base.c_str());
+            if (directory == nullptr)
+                return;
+            while (struct dirent *entry = readdir(directory)) {
+                const std::string name = entry->d_name;
+                if (name.compare(0, 8, "request-") != 0)
+                    continue;
+                const pid_t pid = static_cast<pid_t>(std::strtol(name.c_str() + 8, nullptr, 10));
+                if (pid > 0 && (pid == getpid() || (kill(pid, 0) != 0 && errno == ESRCH)))
+                    removeTree(temp_base + "/" + name);
+            }
+            closedir(directory);
+        }
+
+        /**
+         * @return the bytes that the files below `path` take up on disk
+         */
+        static auto getUsage(const std::string &path) -> size_t {
+            DIR *directory = opendir(path.c_str());
+            if (directory == nullptr)
+                return 0;
+            size_t usage = 0;
+            while (struct dirent *entry = readdir(directory)) {
+                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                    continue;
+                struct stat info{};
+                if (fstatat(dirfd(directory), entry->d_name, &info, AT_SYMLINK_NOFOLLOW) != 0)
+                    continue;
+                usage += static_cast<size_t>(info.st_blocks) * 512;
+                if (S_ISDIR(info.st_mode))
+                    usage += getUsage(path + "/" + entry->d_name);
+            }
+            closedir(directory);
+            return usage;
+        }
+
+        static void removeTree(const std::string &path) {
+            DIR *directory = opendir(path.c_str());
+            if (directory == nullptr)
+                return;
+            while (struct dirent *entry = readdir(directory)) {
+                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                    continue;
+                const std::string child = path + "/" + entry->d_name;
+                struct stat info{};
+                if (lstat(child.c_str(), &info) == 0 && S_ISDIR(info.st_mode))
+                    removeTree(child);
+                else
+                    unlink(child.c_str());
+            }
+            closedir(directory);
+            rmdir(path.c_str());
+        }
+
+        /**
+         * Moves the process into a cgroup of its own with the memory limit, and removes the groups of exited
+         * processes, counting those that were killed for exceeding the limit
+         * @return false if the cgroup could not be set up
+         */
+        auto joinCgroup() -> bool {
+            removeStaleCgroups();
+
+            const std::string path = cgroup + "/rserver-" + std::to_string(getpid());
+            if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+                Log::warn("Cannot create cgroup %s: %s", path.c_str(), strerror(errno));
+                return false;
+            }
+            // without swap, the limit holds for the memory that is actually used
+            const bool limited = writeFile(path + "/memory.max", std::to_string(memory_mb * 1024 * 1024)) &&
+                                 writeFile(path + "/cgroup.procs", std::to_string(getpid()));
+            if (!limited) {
+                Log::warn("Cannot limit memory with cgroup %s", path.c_str());
+                rmdir(path.c_str());
+                return false;
+            }
+            writeFile(path + "/memory.swap.max", "0");
+            return true;
+        }
+
+        void removeStaleCgroups() {
+            DIR *directory = opendir(cgroup.c_str());
+            if (directory == nullptr)
+                return;
+            const std::string own = "rserver-" + std::to_string(getpid());
+            while (struct dirent *entry = readdir(directory)) {
+                const std::string name = entry->d_name;
+                if (name.compare(0, 8, "rserver-") != 0 || name == own)
+                    continue;
+                const std::string path = cgroup + "/" + name;
+                const bool killed = getOomKills(path) > 0;
+                // only empty groups can be removed, so only one process counts a killed one
+                if (rmdir(path.c_str()) == 0 && killed)
+                    metrics->addLimitBreach(ResourceLimit::MEMORY);
+            }
+            closedir(directory);
+        }
+
+        static auto getOomKills(const std::string &path) -> size_t {
+            std::ifstream events(path + "/memory.events");
+            std::string key;
+            size_t value;
+            while (events >> key >> value) {
+                if (key == "oom_kill")
+                    return value;
+            }
+            return 0;
+        }
+
+        static auto writeFile(const std::string &path, const std::string &value) -> bool {
+            int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+            if (fd < 0)
+                return false;
+            const bool written = ::write(fd, value.data(), value.size()) == static_cast<ssize_t>(value.size());
+            ::close(fd);
+            return written;
+        }
+
+        size_t address_space_mb;
+        size_t memory_mb;
+        size_t cpu_seconds;
+        size_t temp_files_mb;
+        std::string cgroup;
+        bool hard_limits;
+        char **temp_directory;
+        std::string temp_base;
+        std::string request_directory;
+        ServerMetrics *metrics;
+        bool memory_in_cgroup;
+        std::thread watchdog;
+        std::mutex watchdog_mutex;
+        std::condition_variable watchdog_wakeup;
+        bool watchdog_stopped;
+};
@@ -15,8 +15,6 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
-#define RSERVER_FORKED_MODE true // specify whether the server runs forked or threaded
-
 #include "util/exceptions.h"
 #include "util/binarystream.h"
 #include "util/server_nonblocking.h"
@@ -29,10 +27,13 @@
 #include "datatypes/raster.h"
 #include "raster/profiler.h"
 
+#include <chrono>
+#include <deque>
 #include <iostream>
 #include <fstream>
 
 #include <csignal>
+#include <cstring>
 
 
 #ifdef __clang__ // Prevent GCC from complaining about unknown pragmas.
@@ -46,351 +47,888 @@
 #pragma clang diagnostic pop // ignored "-Wunused-parameter"
 
 #include "rcpp_wrapper.h"
+#include "raster_altrep.h"
+#include "feature_stream.h"
+#include "raster_stream.h"
+#include "raster_tiles.h"
+#include "plot_device.h"
 #include "rinside_callbacks.h"
+#include "client_stream.h"
+#include "compressing_relay.h"
+#include "forking_server.h"
+#include "request_trace.h"
+#include "resource_limits.h"
+#include "rserver_protocol.h"
+#include "rserver_request.h"
+#include "rserver_settings.h"
+#include "script_cache.h"
+#include "server_metrics.h"
+#include "source_cache.h"
+#include "source_prefetcher.h"
+#include "worker_pool.h"
 
 
 // Set to true while you're sending. If an exception happens when not sending, an error message can be returned
 std::atomic<bool> is_sending(false);
 
 
-std::unique_ptr<GenericRaster> query_raster_source(BinaryStream &stream, int childidx, const QueryRectangle &rect) {
-    Profiler::Profiler{"requesting Raster"};
+class RasterTileIterator;
 
-    Log::debug("requesting raster %d with rect (%f,%f -> %f,%f)", childidx, rect.x1, rect.y1, rect.x2, rect.y2);
-    is_sending = true;
+/**
+ * Everything a script needs to load its sources
+ */
+struct SourceChannel {
+    ClientStream &stream;
+    const RServerRequest &request;
+    SourcePrefetcher *prefetcher; // the prefetched sources of the request or `nullptr`
+    SourceCache *cache; // the cache shared by all children or `nullptr`
+    RasterTileIterator *tiles; // the tile iterator that has requests in flight or `nullptr`
+    RequestTimer &timer;
+};
+
+void settle_tiles(SourceChannel &channel);
+
+/**
+ * Attaches the type, index and query rectangle of a source to a span
+ */
+void describe_source(TraceSpan &span, char type, int childidx, const QueryRectangle &rect) {
+    if (!span.isRecording())
+        return;
+    char description[256];
+    snprintf(description, sizeof(description), "%s %f,%f -> %f,%f", rect.crsId.to_string().c_str(), rect.x1, rect.y1,
+             rect.x2, rect.y2);
+    span.arg("type", static_cast<int>(type));
+    span.arg("index", childidx);
+    span.arg("rect", description);
+}
+
+/**
+ * Sends a request for a single source without waiting for the reply
+ */
+void send_source_request(SourceChannel &channel, char type, int childidx, const QueryRectangle &rect) {
     BinaryWriteBuffer response;
-    response.write<const char &>(RSERVER_TYPE_RASTER);
+    response.write<const char &>(type);
     response.write<int &>(childidx);
     response.write<const QueryRectangle &>(rect);
-    stream.write(response);
+
+    is_sending = true;
+    channel.stream.write(response);
     is_sending = false;
+}
+
+/**
+ * Reads the reply for a source, straight into the shared cache if it has a key
+ * @param key the cache key of the source or an empty string
+ */
+void read_source_reply(SourceChannel &channel, const std::string &key, BinaryReadBuffer &reply) {
+    auto slot = receive_source_reply(channel.stream, key.empty() ? nullptr : channel.cache, 0,
+                                     [&key](const char *) { return key; }, reply);
+    if (slot) {
+        slot.read(reply);
+        slot.commit();
+    }
+}
 
-    BinaryReadBuffer new_request;
-    stream.read(new_request);
-    auto raster = GenericRaster::deserialize(new_request);
+/**
+ * Requests a source from the client and returns its reply
+ * @param key the cache key of the source or an empty string
+ */
+std::unique_ptr<BinaryReadBuffer> request_source(SourceChannel &channel, char type, int childidx,
+                                                 const QueryRectangle &rect, const std::string &key) {
+    PhaseScope phase(channel.timer, RequestPhase::SOURCES);
+    TraceSpan span("requesting source");
+    describe_source(span, type, childidx, rect);
+    if (channel.prefetcher != nullptr) {
+        auto reply = channel.prefetcher->take(type, childidx, rect);
+        if (reply) {
+            Log::debug("source %d of type %d was prefetched", childidx, type);
+            span.arg("prefetched", 1);
+            return reply;
+        }
+        channel.prefetcher->finish();
+    }
+    settle_tiles(channel);
+
+    const uint64_t received = channel.stream.getBytesReceived();
+    send_source_request(channel, type, childidx, rect);
+
+    auto reply = std::make_unique<BinaryReadBuffer>();
+    read_source_reply(channel, key, *reply);
+    span.arg("bytes", channel.stream.getBytesReceived() - received);
+    return reply;
+}
+
+/**
+ * @return the key of a source in the shared cache or an empty string if it cannot be cached
+ */
+std::string get_cache_key(const SourceChannel &channel, char type, int childidx, const QueryRectangle &rect) {
+    if (channel.cache == nullptr)
+        return "";
+    return SourceCache::makeKey(channel.request.getSourceId(type, childidx), type, rect);
+}
+
+/**
+ * Adds a source that was not received as a whole, e.g. a streamed raster, to the shared cache
+ */
+template<typename T>
+void store_source(SourceChannel &channel, const std::string &key, T &source) {
+    if (channel.cache == nullptr || key.empty())
+        return;
+    BinaryWriteBuffer buffer;
+    buffer.write<T &>(source, true);
+    channel.cache->put(key, buffer);
+}
+
+std::unique_ptr<GenericRaster> deserialize_raster(BinaryReadBuffer &buffer) {
+    TraceSpan span("deserializing raster");
+    auto raster = GenericRaster::deserialize(buffer);
     raster->setRepresentation(GenericRaster::Representation::CPU);
     return raster;
 }
 
-Rcpp::NumericVector query_raster_source_as_array(BinaryStream &stream, int childidx, const QueryRectangle &rect) {
-    auto raster = query_raster_source(stream, childidx, rect);
+template<typename Collection>
+std::unique_ptr<Collection> deserialize_collection(BinaryReadBuffer &buffer) {
+    TraceSpan span("deserializing features");
+    return std::make_unique<Collection>(buffer);
+}
 
-    // convert to vector
-    raster->setRepresentation(GenericRaster::Representation::CPU);
-    int width = raster->width;
-    int height = raster->height;
-    Rcpp::NumericVector pixels(raster->getPixelCount());
-    int pos = 0;
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            double val = raster->getAsDouble(x, y);
-            if (raster->dd.is_no_data(val))
-                pixels[pos++] = NAN;
-            else
-                pixels[pos++] = val;
+/**
+ * Loads a source from the shared cache, or requests it and adds its reply to the cache
+ */
+template<typename T>
+std::unique_ptr<T> load_source(SourceChannel &channel, char type, int childidx, const QueryRectangle &rect,
+                               std::unique_ptr<T> (*deserialize)(BinaryReadBuffer &)) {
+    PhaseScope phase(channel.timer, RequestPhase::SOURCES);
+    auto key = get_cache_key(channel, type, childidx, rect);
+    if (!key.empty()) {
+        BinaryReadBuffer cached;
+        TraceSpan span("reading cached source");
+        if (channel.cache->get(key, cached)) {
+            Log::debug("source %d of type %d was cached", childidx, type);
+            return deserialize(cached);
         }
     }
-    return pixels;
+
+    auto reply = request_source(channel, type, childidx, rect, key);
+    return deserialize(*reply);
 }
 
-std::unique_ptr<PointCollection> query_points_source(BinaryStream &stream, int childidx, const QueryRectangle &rect) {
-    Profiler::Profiler{"requesting Points"};
+/**
+ * Requests a raster in chunks if the client supports it and the raster is neither cached nor prefetched
+ * @param key the cache key of the raster or an empty string
+ * @return the reader for the pixels or `nullptr` if the raster has to be loaded as a whole
+ */
+std::unique_ptr<RasterStreamReader> stream_raster_source(SourceChannel &channel, const std::string &key, int childidx,
+                                                         const QueryRectangle &rect) {
+    if (!channel.request.hasCapability(RServerCapabilities::STREAMED_RASTERS))
+        return nullptr;
+    PhaseScope phase(channel.timer, RequestPhase::SOURCES);
+    if (!key.empty() && channel.cache->contains(key))
+        return nullptr;
+    if (channel.prefetcher != nullptr) {
+        if (channel.prefetcher->contains(RSERVER_TYPE_RASTER, childidx, rect))
+            return nullptr;
+        channel.prefetcher->finish();
+    }
+    settle_tiles(channel);
 
-    Log::debug("requesting points %d with rect (%f,%f -> %f,%f)", childidx, rect.x1, rect.y1, rect.x2, rect.y2);
-    is_sending = true;
-    BinaryWriteBuffer response;
-    response.write<const char &>(RSERVER_TYPE_POINTS);
-    response.write<int &>(childidx);
-    response.write<const QueryRectangle &>(rect);
-    stream.write(response);
-    is_sending = false;
+    send_source_request(channel, RSERVER_TYPE_RASTER_STREAM, childidx, rect);
+    return std::make_unique<RasterStreamReader>(channel.stream);
+}
+
+std::unique_ptr<GenericRaster> query_raster_source(SourceChannel &channel, int childidx, const QueryRectangle &rect) {
+    TraceSpan span("requesting Raster");
+    describe_source(span, RSERVER_TYPE_RASTER, childidx, rect);
+    PhaseScope phase(channel.timer, RequestPhase::SOURCES);
 
-    BinaryReadBuffer new_request;
-    stream.read(new_request);
-    auto points = std::make_unique<PointCollection>(new_request);
-    return points;
+    Log::debug("requesting raster %d with rect (%f,%f -> %f,%f)", childidx, rect.x1, rect.y1, rect.x2, rect.y2);
+    auto key = get_cache_key(channel, RSERVER_TYPE_RASTER, childidx, rect);
+    auto reader = stream_raster_source(channel, key, childidx, rect);
+    if (reader) {
+        span.arg("streamed", 1);
+        auto raster = reader->readRaster();
+        store_source(channel, key, *raster);
+        return raster;
+    }
+    return load_source(channel, RSERVER_TYPE_RASTER, childidx, rect, deserialize_raster);
 }
 
-std::unique_ptr<LineCollection> query_lines_source(BinaryStream &stream, int childidx, const QueryRectangle &rect) {
-    Profiler::Profiler{"requesting Lines"};
-    Log::debug("requesting lines %d with rect (%f,%f -> %f,%f)", childidx, rect.x1, rect.y1, rect.x2, rect.y2);
+/**
+ * Requests a raster as an R RasterLayer.
+ * Streamed rasters that do not go into the cache are decoded into the R vector as the chunks arrive, so the pixels
+ * only exist once.
+ */
+SEXP query_raster_source_as_layer(SourceChannel &channel, int childidx, const QueryRectangle &rect) {
+    if (get_cache_key(channel, RSERVER_TYPE_RASTER, childidx, rect).empty()) {
+        auto reader = stream_raster_source(channel, "", childidx, rect);
+        if (reader) {
+            TraceSpan span("streaming Raster");
+            describe_source(span, RSERVER_TYPE_RASTER, childidx, rect);
+            // the pixels are decoded while they arrive, so this counts as waiting for the source
+            PhaseScope phase(channel.timer, RequestPhase::SOURCES);
+            Log::debug("streaming raster %d with rect (%f,%f -> %f,%f)", childidx, rect.x1, rect.y1, rect.x2, rect.y2);
+            Rcpp::NumericVector pixels(Rcpp::no_init(reader->getPixelCount()));
+            reader->readAsDouble(pixels.begin());
+            return Rcpp::create_raster_layer(reader->getDataDescription(), reader->getSpatioTemporalReference(),
+                                             reader->getWidth(), reader->getHeight(), pixels);
+        }
+    }
+    auto raster = query_raster_source(channel, childidx, rect);
+    PhaseScope phase(channel.timer, RequestPhase::CONVERSION);
+    return Rcpp::wrap(*raster);
+}
 
-    BinaryWriteBuffer response;
-    response.write<const char &>(RSERVER_TYPE_LINES);
-    response.write<int &>(childidx);
-    response.write<const QueryRectangle &>(rect);
+/**
+ * Requests a raster and exposes its pixels as an R vector without copying them
+ * @return an SEXP, since wrapping it in an `Rcpp::NumericVector` would materialize all values
+ */
+SEXP query_raster_source_as_array(SourceChannel &channel, int childidx, const QueryRectangle &rect) {
+    auto raster = query_raster_source(channel, childidx, rect);
+    return RasterAltrep::make(std::move(raster));
+}
 
-    is_sending = true;
-    stream.write(response);
-    is_sending = false;
+std::unique_ptr<PointCollection> query_points_source(SourceChannel &channel, int childidx, const QueryRectangle &rect) {
+    TraceSpan span("requesting Points");
+
+    Log::debug("requesting points %d with rect (%f,%f -> %f,%f)", childidx, rect.x1, rect.y1, rect.x2, rect.y2);
+    return load_source(channel, RSERVER_TYPE_POINTS, childidx, rect, deserialize_collection<PointCollection>);
+}
 
-    BinaryReadBuffer new_request;
-    stream.read(new_request);
+std::unique_ptr<LineCollection> query_lines_source(SourceChannel &channel, int childidx, const QueryRectangle &rect) {
+    TraceSpan span("requesting Lines");
+    Log::debug("requesting lines %d with rect (%f,%f -> %f,%f)", childidx, rect.x1, rect.y1, rect.x2, rect.y2);
 
-    return std::make_unique<LineCollection>(new_request);
+    return load_source(channel, RSERVER_TYPE_LINES, childidx, rect, deserialize_collection<LineCollection>);
 }
 
 std::unique_ptr<PolygonCollection>
-query_polygons_source(BinaryStream &stream, int childidx, const QueryRectangle &rect) {
-    Profiler::Profiler{"requesting Polygons"};
+query_polygons_source(SourceChannel &channel, int childidx, const QueryRectangle &rect) {
+    TraceSpan span("requesting Polygons");
     Log::debug("requesting polygons %d with rect (%f,%f -> %f,%f)", childidx, rect.x1, rect.y1, rect.x2, rect.y2);
 
-    BinaryWriteBuffer response;
-    response.write<const char &>(RSERVER_TYPE_POLYGONS);
-    response.write<int &>(childidx);
-    response.write<const QueryRectangle &>(rect);
+    return load_source(channel, RSERVER_TYPE_POLYGONS, childidx, rect, deserialize_collection<PolygonCollection>);
+}
 
-    is_sending = true;
-    stream.write(response);
-    is_sending = false;
 
-    BinaryReadBuffer new_request;
-    stream.read(new_request);
+/**
+ * A source that a script requests through `mapping.loadSources`
+ */
+struct SourceRequest {
+    char type;
+    int childidx;
+    QueryRectangle rect;
+};
 
-    return std::make_unique<PolygonCollection>(new_request);
+static char parse_source_type(const std::string &name) {
+    if (name == "raster")
+        return RSERVER_TYPE_RASTER;
+    if (name == "points")
+        return RSERVER_TYPE_POINTS;
+    if (name == "lines")
+        return RSERVER_TYPE_LINES;
+    if (name == "polygons")
+        return RSERVER_TYPE_POLYGONS;
+    throw ArgumentException("Unknown source type: " + name);
 }
 
-
-static std::string read_file_as_string(const std::string &filename) {
-    std::ifstream in(filename, std::ios::in | std::ios::binary);
-    if (in) {
-        std::string contents;
-        in.seekg(0, std::ios::end);
-        contents.resize(static_cast<unsigned long>(in.tellg()));
-        in.seekg(0, std::ios::beg);
-        in.read(&contents[0], contents.size());
-        in.close();
-        return contents;
+/**
+ * Converts the reply for a single source to R
+ */
+SEXP convert_source(SourceChannel &channel, BinaryReadBuffer &buffer, char type,
+                    Rcpp::FeatureRepresentation representation) {
+    PhaseScope phase(channel.timer, RequestPhase::CONVERSION);
+    switch (type) {
+        case RSERVER_TYPE_RASTER: {
+            auto raster = deserialize_raster(buffer);
+            return Rcpp::wrap(raster);
+        }
+        case RSERVER_TYPE_POINTS: {
+            auto points = deserialize_collection<PointCollection>(buffer);
+            return Rcpp::wrap_features(*points, representation);
+        }
+        case RSERVER_TYPE_LINES: {
+            auto lines = deserialize_collection<LineCollection>(buffer);
+            return Rcpp::wrap_features(*lines, representation);
+        }
+        case RSERVER_TYPE_POLYGONS: {
+            auto polygons = deserialize_collection<PolygonCollection>(buffer);
+            return Rcpp::wrap_features(*polygons, representation);
+        }
+        default:
+            throw ArgumentException("Unknown source type");
     }
-    throw PlatformException("Could not read plot file");
 }
 
+/**
+ * Requests several sources at once.
+ *
+ * Cached sources are taken from the cache. If the client supports batches, all other requests are sent in one
+ * message, so the client can compute them in parallel. The replies arrive in any order, each one tagged with the index
+ * of its request, and are converted as they arrive.
+ * Otherwise, or if the sources were prefetched, they are requested one after another.
+ *
+ * @return a list with one R object per source in the order of `sources`
+ */
+Rcpp::List query_sources(SourceChannel &channel, const std::vector<SourceRequest> &sources,
+                         Rcpp::FeatureRepresentation representation) {
+    TraceSpan span("requesting sources");
+    span.arg("count", sources.size());
+    PhaseScope phase(channel.timer, RequestPhase::SOURCES);
+
+    Rcpp::List results(sources.size());
+    const bool batch = channel.request.hasCapability(RServerCapabilities::BATCH) && channel.prefetcher == nullptr;
+
+    std::vector<size_t> pending;
+    std::vector<std::string> keys(sources.size());
+    for (size_t i = 0; i < sources.size(); i++) {
+        const auto &source = sources[i];
+        keys[i] = get_cache_key(channel, source.type, source.childidx, source.rect);
+
+        BinaryReadBuffer cached;
+        if (!keys[i].empty() && channel.cache->get(keys[i], cached)) {
+            results[i] = convert_source(channel, cached, source.type, representation);
+        } else if (batch) {
+            pending.push_back(i);
+        } else {
+            auto reply = request_source(channel, source.type, source.childidx, source.rect, keys[i]);
+            results[i] = convert_source(channel, *reply, source.type, representation);
+        }
+    }
+    if (pending.empty())
+        return results;
 
-void signal_handler(int signum) {
-    Log::error("Caught signal %d, exiting", signum);
-    exit(signum);
+    settle_tiles(channel);
+    Log::debug("requesting %zu sources in a batch", pending.size());
+    BinaryWriteBuffer response;
+    response.write<const char &>(RSERVER_TYPE_BATCH);
+    response.write<uint32_t>(static_cast<uint32_t>(pending.size()));
+    for (auto i : pending) {
+        response.write<const char &>(sources[i].type);
+        response.write<const int &>(sources[i].childidx);
+        response.write<const QueryRectangle &>(sources[i].rect);
+    }
+
+    is_sending = true;
+    channel.stream.write(response);
+    is_sending = false;
+
+    // replies with a cache key are read straight into the cache, their tag tells which source they belong to
+    SourceCache *cache = nullptr;
+    for (auto i : pending) {
+        if (!keys[i].empty())
+            cache = channel.cache;
+    }
+    auto key_of = [&](const char *tag) -> std::string {
+        uint32_t index;
+        memcpy(&index, tag, sizeof(index));
+        return index < pending.size() ? keys[pending[index]] : "";
+    };
+
+    const uint64_t received_bytes = channel.stream.getBytesReceived();
+    std::vector<bool> received(pending.size(), false);
+    for (size_t r = 0; r < pending.size(); r++) {
+        BinaryReadBuffer reply;
+        auto slot = receive_source_reply(channel.stream, cache, sizeof(uint32_t), key_of, reply);
+        if (slot) {
+            slot.read(reply);
+            slot.commit();
+        }
+        auto index = reply.read<uint32_t>();
+        if (index >= pending.size() || received[index])
+            throw NetworkException("Client sent an unexpected reply to a batch");
+        received[index] = true;
+
+        const size_t i = pending[index];
+        results[i] = convert_source(channel, reply, sources[i].type, representation);
+    }
+    span.arg("batched", pending.size());
+    span.arg("bytes", channel.stream.getBytesReceived() - received_bytes);
+    return results;
 }
 
 
-class RServerConnection : public NonblockingServer::Connection {
+/**
+ * Loads the tiles of a raster one after another for `mapping.rasterTiles`.
+ *
+ * While the script works on a tile, the requests for the next `lookahead` tiles are already sent, so the client
+ * computes them in the meantime. Their replies arrive in order on the same stream. Before anything else uses the
+ * stream, `settle()` reads the replies in flight and buffers them. Each tile is released once it is converted to R.
+ */
+class RasterTileIterator {
     public:
-        RServerConnection(NonblockingServer &server, int fd, int id);
-
-        ~RServerConnection() override;
+        /**
+         * @param channel the sources of the request
+         * @param childidx the raster source
+         * @param tiles the tiles in the order they are returned
+         * @param lookahead the number of tiles to request ahead of the script, at least 1
+         */
+        RasterTileIterator(SourceChannel &channel, int childidx, std::vector<RasterTile> tiles, size_t lookahead)
+                : channel(channel), childidx(childidx), tiles(std::move(tiles)),
+                  lookahead(std::max<size_t>(1, lookahead)), next(0), requested(0), in_flight(0) {
+        }
 
-    private:
-        void processData(std::unique_ptr<BinaryReadBuffer> request) override;
+        RasterTileIterator(const RasterTileIterator &) = delete;
+        RasterTileIterator &operator=(const RasterTileIterator &) = delete;
 
-        auto processDataForked(BinaryStream stream) -> void override;
+        auto getCount() const -> size_t {
+            return tiles.size();
+        }
 
-        auto processDataAsync(BinaryStream stream) -> void override;
+        auto hasNext() const -> bool {
+            return next < tiles.size();
+        }
 
-        std::string source;
-        char expected_result;
-        int rastersourcecount;
-        int pointssourcecount;
-        int linessourcecount;
-        int polygonssourcecount;
-        QueryRectangle qrect;
+        /**
+         * @return a list with the `raster` of the next tile, its position `x` and `y` in the whole raster, its
+         *         `width` and `height` and its `qrect`
+         */
+        auto nextElem() -> Rcpp::List {
+            if (!hasNext())
+                throw ArgumentException("mapping.rasterTiles: there are no more tiles");
+
+            PhaseScope phase(channel.timer, RequestPhase::SOURCES);
+            TraceSpan span("loading tile");
+            requestAhead();
+            const RasterTile &tile = tiles[next];
+            span.arg("index", next);
+            Pending source = std::move(pending.front());
+            pending.pop_front();
+            next++;
+
+            if (!source.cached && !source.reply) {
+                source.reply = std::make_unique<BinaryReadBuffer>();
+                read_source_reply(channel, source.key, *source.reply);
+                in_flight--;
+            }
 
-        size_t plot_width;
-        size_t plot_height;
-};
+            std::unique_ptr<GenericRaster> raster;
+            if (source.reply) {
+                raster = deserialize_raster(*source.reply);
+                source.reply.reset();
+            } else {
+                BinaryReadBuffer cached;
+                if (channel.cache->get(source.key, cached)) {
+                    raster = deserialize_raster(cached);
+                } else {
+                    // evicted since it was looked up
+                    auto reply = request_source(channel, RSERVER_TYPE_RASTER, childidx, tile.rect, source.key);
+                    raster = deserialize_raster(*reply);
+                }
+            }
 
-class RServer : public NonblockingServer {
-    public:
-        RServer(RInside *R, RInsideCallbacks *callbacks) : NonblockingServer(),
-                                                           R(R), callbacks(callbacks) {
+            // the client computes the next tiles while the script works on this one
+            requestAhead();
+
+            PhaseScope conversion(channel.timer, RequestPhase::CONVERSION);
+            Rcpp::List result = Rcpp::List::create(
+                    Rcpp::Named("raster") = Rcpp::wrap(*raster),
+                    Rcpp::Named("x") = tile.x,
+                    Rcpp::Named("y") = tile.y,
+                    Rcpp::Named("width") = tile.width,
+                    Rcpp::Named("height") = tile.height,
+                    Rcpp::Named("qrect") = tile.rect
+            );
+            return result;
         }
 
-        ~RServer() override = default;
+        /**
+         * Reads the replies of all requests in flight, so that the stream can be used for other requests
+         */
+        void settle() {
+            PhaseScope phase(channel.timer, RequestPhase::SOURCES);
+            for (auto &source : pending) {
+                if (in_flight == 0)
+                    break;
+                if (source.cached || source.reply)
+                    continue;
+                source.reply = std::make_unique<BinaryReadBuffer>();
+                read_source_reply(channel, source.key, *source.reply);
+                in_flight--;
+            }
+            if (channel.tiles == this)
+                channel.tiles = nullptr;
+        }
 
     private:
-        std::unique_ptr<Connection> createConnection(int fd, int id) override;
-
-        RInside *R;
-        RInsideCallbacks *callbacks;
+        struct Pending {
+            std::string key; // the cache key of the tile or an empty string
+            bool cached; // whether the tile was in the cache when it would have been requested
+            std::unique_ptr<BinaryReadBuffer> reply; // the buffered reply once it has been read
+        };
+
+        void requestAhead() {
+            if (requested >= tiles.size() || pending.size() >= lookahead)
+                return;
+
+            if (channel.prefetcher != nullptr)
+                channel.prefetcher->finish();
+            if (channel.tiles != this)
+                settle_tiles(channel);
+
+            while (requested < tiles.size() && pending.size() < lookahead) {
+                const RasterTile &tile = tiles[requested++];
+                Pending source{get_cache_key(channel, RSERVER_TYPE_RASTER, childidx, tile.rect), false, nullptr};
+                source.cached = !source.key.empty() && channel.cache->contains(source.key);
+                if (!source.cached) {
+                    send_source_request(channel, RSERVER_TYPE_RASTER, childidx, tile.rect);
+                    in_flight++;
+                }
+                pending.push_back(std::move(source));
+            }
+            if (in_flight > 0)
+                channel.tiles = this;
+        }
 
-        friend class RServerConnection;
+        SourceChannel &channel;
+        int childidx;
+        std::vector<RasterTile> tiles;
+        size_t lookahead;
+        size_t next; // the index of the tile that `nextElem` returns
+        size_t requested; // tiles before this index are pending or returned
+        size_t in_flight; // pending tiles whose reply has not been read yet
+        std::deque<Pending> pending;
 };
 
-
-RServerConnection::RServerConnection(NonblockingServer &server, int fd, int id) : Connection(server, fd, id),
-                                                                                  source(""), expected_result(-1),
-                                                                                  rastersourcecount(-1),
-                                                                                  pointssourcecount(-1),
-                                                                                  linessourcecount(-1),
-                                                                                  polygonssourcecount(-1),
-                                                                                  plot_width(0),
-                                                                                  plot_height(0),
-                                                                                  qrect(SpatialReference::unreferenced(),
-                                                                                        TemporalReference::unreferenced(),
-                                                                                        QueryResolution::none()) {
-    Log::info("%d: connected", id);
+/**
+ * Lets the tile iterator with requests in flight read their replies
+ */
+void settle_tiles(SourceChannel &channel) {
+    if (channel.tiles != nullptr)
+        channel.tiles->settle();
 }
 
-RServerConnection::~RServerConnection() = default;
 
-void RServerConnection::processData(std::unique_ptr<BinaryReadBuffer> request) {
-    auto magic = request->read<int>();
-    if (magic != RSERVER_MAGIC_NUMBER)
-        throw PlatformException("Client sent the wrong magic number");
-    expected_result = request->read<char>();
-    Log::info("Requested type: %d", expected_result);
-    request->read(&source);
-    rastersourcecount = request->read<int>();
-    pointssourcecount = request->read<int>();
-    linessourcecount = request->read<int>();
-    polygonssourcecount = request->read<int>();
-    Log::info("Requested counts: %d %d %d %d", rastersourcecount, pointssourcecount, linessourcecount,
-              polygonssourcecount);
-    qrect = QueryRectangle(*request);
-    Log::info("rectangle is rect (%f,%f -> %f,%f)", qrect.x1, qrect.y1, qrect.x2, qrect.y2);
-
-    auto timeout = request->read<int>();
-
-    if (expected_result == RSERVER_TYPE_PLOT) {
-        plot_width = request->read<size_t>();
-        plot_height = request->read<size_t>();
-    }
-
-#if RSERVER_FORKED_MODE
-    forkAndProcess(timeout);
-#else
-    enqueueForAsyncProcessing();
-#endif
+void signal_handler(int signum) {
+    Log::error("Caught signal %d, exiting", signum);
+    exit(signum);
 }
 
-auto RServerConnection::processDataAsync(BinaryStream stream) -> void {
-    processDataForked(std::move(stream));
+
+/**
+ * Sends the result of a request and records it as the sending phase. No error reply may be written while this runs.
+ * @param chunked whether `write` splits the result into several messages
+ * @param write writes the result to the stream, e.g. a buffer or a chunked raster or collection
+ */
+template<typename Writer>
+void send_result(ClientStream &stream, RequestTimer &timer, bool chunked, Writer &&write) {
+    PhaseScope sending(timer, RequestPhase::SENDING);
+    TraceSpan span("sending result");
+    if (chunked)
+        span.arg("chunked", 1);
+    const uint64_t sent = stream.getBytesSent();
+    is_sending = true;
+    write();
+    is_sending = false;
+    span.arg("bytes", stream.getBytesSent() - sent);
 }
 
 
-auto RServerConnection::processDataForked(BinaryStream stream) -> void {
-    auto &rserver = (RServer &) server;
-    RInside &R = *(rserver.R);
-
-    Log::info("Here's our client!");
+/**
+ * Prepares R for a request, runs its script and sends the result to the client.
+ * Everything that can fail is done here, so that `process_request` reports it to the client.
+ * @param prefetcher receives the prefetcher of the request, which has to outlive an error reply
+ */
+void run_request(RInside &R, RInsideCallbacks &callbacks, ClientStream &stream, const RServerRequest &request,
+                 const RServerSettings &settings, SourceCache *cache, ScriptCache &scripts, RequestTimer &timer,
+                 std::unique_ptr<SourcePrefetcher> &prefetcher) {
+    SourceChannel channel{stream, request, nullptr, cache, nullptr, timer};
+
+    // request the declared sources before anything else, so that the client computes them while R is prepared
+    if (settings.prefetch) {
+        PhaseScope phase(timer, RequestPhase::SOURCES);
+        prefetcher = std::make_unique<SourcePrefetcher>(stream, request, cache, is_sending);
+        channel.prefetcher = prefetcher.get();
+    }
 
-    if (expected_result == RSERVER_TYPE_PLOT) {
-        R.parseEval(R"(rserver_plot_tempfile = tempfile("rs_plot", fileext=".png"))");
-        R.parseEval(concat("png(rserver_plot_tempfile, width=", plot_width, ", height=", plot_height,
-                           ", bg=\"transparent\")"));
-        fprintf(stderr, "width: %zu, height: %zu\n", plot_width, plot_height);
+    std::unique_ptr<MemoryPlotDevice> plot;
+    if (request.expected_result == RSERVER_TYPE_PLOT) {
+        const auto &format = request.plot_format.empty() ? settings.plot_format : request.plot_format;
+        const int quality = request.plot_quality >= 0 ? request.plot_quality : settings.plot_quality;
+        Log::debug("plot: %s, width: %zu, height: %zu", format.c_str(), request.plot_width, request.plot_height);
+        plot = std::make_unique<MemoryPlotDevice>(R, format, request.plot_width, request.plot_height, quality);
     }
 
-    R["mapping.rastercount"] = rastersourcecount;
-    std::function<std::unique_ptr<GenericRaster>(int, const QueryRectangle &)> bound_raster_source = [&stream](
-            int childidx, const QueryRectangle &rect) -> std::unique_ptr<GenericRaster> {
-        return query_raster_source(stream, childidx, rect);
+    R["mapping.rastercount"] = request.rastersourcecount;
+    std::function<SEXP(int, const QueryRectangle &)> bound_raster_source = [&channel](
+            int childidx, const QueryRectangle &rect) -> SEXP {
+        return query_raster_source_as_layer(channel, childidx, rect);
     };
     R["mapping.loadRaster"] = Rcpp::InternalFunction(bound_raster_source);
 
-    std::function<Rcpp::NumericVector(int, const QueryRectangle &)> bound_raster_source_as_array = [&stream](
-            int childidx, const QueryRectangle &rect) -> Rcpp::NumericVector {
-        return query_raster_source_as_array(stream, childidx, rect);
+    std::function<SEXP(int, const QueryRectangle &)> bound_raster_source_as_array = [&channel](
+            int childidx, const QueryRectangle &rect) -> SEXP {
+        return query_raster_source_as_array(channel, childidx, rect);
     };
     R["mapping.loadRasterAsVector"] = Rcpp::InternalFunction(bound_raster_source_as_array);
 
-    std::function<std::unique_ptr<PointCollection>(int, const QueryRectangle &)> bound_points_source = [&stream](
-            int childidx, const QueryRectangle &rect) -> std::unique_ptr<PointCollection> {
-        return query_points_source(stream, childidx, rect);
+    // iterators and writers live until the response is sent, R only holds functions that refer to them
+    std::vector<std::unique_ptr<RasterTileIterator>> tile_iterators;
+    std::function<Rcpp::List(int, const QueryRectangle &, int, int)> bound_raster_tiles = [&channel, &settings,
+            &tile_iterators](int childidx, const QueryRectangle &rect, int tile_width, int tile_height) -> Rcpp::List {
+        if (tile_width <= 0 || tile_height <= 0)
+            throw ArgumentException("mapping.rasterTiles: the tile size must be positive");
+        auto tiles = split_into_tiles(rect, static_cast<uint32_t>(tile_width), static_cast<uint32_t>(tile_height));
+        tile_iterators.push_back(std::make_unique<RasterTileIterator>(channel, childidx, std::move(tiles),
+                                                                      settings.tile_lookahead));
+        RasterTileIterator *iterator = tile_iterators.back().get();
+
+        std::function<bool()> has_next = [iterator]() -> bool {
+            return iterator->hasNext();
+        };
+        std::function<Rcpp::List()> next_elem = [iterator]() -> Rcpp::List {
+            return iterator->nextElem();
+        };
+        return Rcpp::List::create(
+                Rcpp::Named("count") = iterator->getCount(),
+                Rcpp::Named("hasNext") = Rcpp::InternalFunction(has_next),
+                Rcpp::Named("nextElem") = Rcpp::InternalFunction(next_elem)
+        );
+    };
+    R["mapping.rasterTiles"] = Rcpp::InternalFunction(bound_raster_tiles);
+
+    std::vector<std::unique_ptr<TileWriter>> tile_writers;
+    std::function<Rcpp::List(const QueryRectangle &, std::string)> bound_tile_writer = [&tile_writers](
+            const QueryRectangle &rect, std::string type) -> Rcpp::List {
+        GDALDataType datatype;
+        if (type == "float32")
+            datatype = GDT_Float32;
+        else if (type == "float64")
+            datatype = GDT_Float64;
+        else
+            throw ArgumentException("mapping.tileWriter: unknown pixel type " + type);
+        tile_writers.push_back(std::make_unique<TileWriter>(rect, datatype));
+        TileWriter *writer = tile_writers.back().get();
+
+        std::function<bool(Rcpp::List, SEXP)> write = [writer](Rcpp::List tile, SEXP values) -> bool {
+            if (Rf_isS4(values) && Rf_inherits(values, "RasterLayer")) {
+                Rcpp::S4 data = Rcpp::S4(values).slot("data");
+                values = data.slot("values");
+            }
+            Rcpp::NumericVector pixels(values);
+            const auto width = Rcpp::as<uint32_t>(tile["width"]);
+            const auto height = Rcpp::as<uint32_t>(tile["height"]);
+            if (static_cast<size_t>(pixels.size()) != static_cast<size_t>(width) * height)
+                throw ArgumentException("mapping.tileWriter: the values do not match the size of the tile");
+            writer->write(Rcpp::as<uint32_t>(tile["x"]), Rcpp::as<uint32_t>(tile["y"]), width, height,
+                          pixels.begin());
+            return true;
+        };
+        Rcpp::List result = Rcpp::List::create(
+                Rcpp::Named("id") = static_cast<int>(tile_writers.size() - 1),
+                Rcpp::Named("write") = Rcpp::InternalFunction(write)
+        );
+        result.attr("class") = "mapping.tileWriter";
+        return result;
+    };
+    R["mapping.tileWriter"] = Rcpp::InternalFunction(bound_tile_writer);
+
+    // scripts may switch the representation of feature collections by overwriting this variable
+    R["mapping.featureRepresentation"] = settings.feature_representation;
+    auto feature_representation = [&R]() -> Rcpp::FeatureRepresentation {
+        return Rcpp::parse_feature_representation(Rcpp::as<std::string>(R["mapping.featureRepresentation"]));
     };
-    R["mapping.pointscount"] = pointssourcecount;
+
+    std::function<SEXP(int, const QueryRectangle &)> bound_points_source = [&channel, feature_representation](
+            int childidx, const QueryRectangle &rect) -> SEXP {
+        auto features = query_points_source(channel, childidx, rect);
+        PhaseScope phase(channel.timer, RequestPhase::CONVERSION);
+        return Rcpp::wrap_features(*features, feature_representation());
+    };
+    R["mapping.pointscount"] = request.pointssourcecount;
     R["mapping.loadPoints"] = Rcpp::InternalFunction(bound_points_source);
 
-    std::function<std::unique_ptr<LineCollection>(int, const QueryRectangle &)> bound_lines_source = [&stream](
-            int childidx, const QueryRectangle &rect) -> std::unique_ptr<LineCollection> {
-        return query_lines_source(stream, childidx, rect);
+    std::function<SEXP(int, const QueryRectangle &)> bound_lines_source = [&channel, feature_representation](
+            int childidx, const QueryRectangle &rect) -> SEXP {
+        auto features = query_lines_source(channel, childidx, rect);
+        PhaseScope phase(channel.timer, RequestPhase::CONVERSION);
+        return Rcpp::wrap_features(*features, feature_representation());
     };
-    R["mapping.linessourcecount"] = linessourcecount;
+    R["mapping.linessourcecount"] = request.linessourcecount;
     R["mapping.loadLines"] = Rcpp::InternalFunction(bound_lines_source);
 
-    std::function<std::unique_ptr<PolygonCollection>(int, const QueryRectangle &)> bound_polygons_source = [&stream](
-            int childidx, const QueryRectangle &rect) -> std::unique_ptr<PolygonCollection> {
-        return query_polygons_source(stream, childidx, rect);
+    std::function<SEXP(int, const QueryRectangle &)> bound_polygons_source = [&channel, feature_representation](
+            int childidx, const QueryRectangle &rect) -> SEXP {
+        auto features = query_polygons_source(channel, childidx, rect);
+        PhaseScope phase(channel.timer, RequestPhase::CONVERSION);
+        return Rcpp::wrap_features(*features, feature_representation());
     };
-    R["mapping.polygonssourcecount"] = polygonssourcecount;
+    R["mapping.polygonssourcecount"] = request.polygonssourcecount;
     R["mapping.loadPolygons"] = Rcpp::InternalFunction(bound_polygons_source);
 
-    R["mapping.qrect"] = qrect;
-
-    Profiler::start("running R script");
-    try {
-        std::string delimiter = "\n\n";
-        size_t start = 0;
-        size_t end = 0;
-        while (true) {
-            end = source.find(delimiter, start);
-            if (end == std::string::npos)
-                break;
-            std::string line = source.substr(start, end - start);
-            start = end + delimiter.length();
-            Log::debug("src: %s", line.c_str());
-            R.parseEval(line);
+    std::function<SEXP(Rcpp::List)> bound_sources = [&channel, &request, feature_representation](
+            Rcpp::List list) -> SEXP {
+        std::vector<SourceRequest> sources;
+        sources.reserve(static_cast<size_t>(list.size()));
+        for (R_xlen_t i = 0; i < list.size(); i++) {
+            Rcpp::List entry(list[i]);
+            SourceRequest source{parse_source_type(Rcpp::as<std::string>(entry["type"])),
+                                 Rcpp::as<int>(entry["index"]),
+                                 entry.containsElementNamed("qrect") ? Rcpp::as<QueryRectangle>(entry["qrect"])
+                                                                     : request.qrect};
+            sources.push_back(std::move(source));
         }
-        std::string lastline = source.substr(start);
-        Log::info("src: %s", lastline.c_str());
-        auto result = R.parseEval(lastline);
-        Profiler::stop("running R script");
 
-        BinaryWriteBuffer response;
-        // types for keeping objects alive
-        std::unique_ptr<SpatioTemporalResult> spatio_temporal_result;
-        std::string string_result;
-        switch (expected_result) {
-            case RSERVER_TYPE_RASTER: {
-                auto raster = Rcpp::as<std::unique_ptr<GenericRaster>>(result);
-                response.write<char>(-RSERVER_TYPE_RASTER);
-                response.write<GenericRaster &>(*raster, true);
-                spatio_temporal_result = std::move(raster);
+        Rcpp::List results = query_sources(channel, sources, feature_representation());
+        if (!Rf_isNull(list.names()))
+            results.names() = list.names();
+        return results;
+    };
+    R["mapping.loadSources"] = Rcpp::InternalFunction(bound_sources);
+
+    R["mapping.qrect"] = request.qrect;
+
+    auto result = scripts.evaluate(request.source);
+
+    // all prefetched replies have to be read before the result can be sent
+    {
+        PhaseScope phase(timer, RequestPhase::SOURCES);
+        if (prefetcher)
+            prefetcher->finish();
+        settle_tiles(channel);
+    }
+
+    PhaseScope conversion(timer, RequestPhase::CONVERSION);
+    BinaryWriteBuffer response;
+    bool streamed = false;
+    // types for keeping objects alive
+    std::unique_ptr<SpatioTemporalResult> spatio_temporal_result;
+    std::string string_result;
+    // a memory file is cheaper than chunks
+    const bool chunked = request.hasCapability(RServerCapabilities::CHUNKED_RESULTS) &&
+                         !stream.usesFileDescriptors();
+    // sends a feature collection chunk by chunk instead of as a single message
+    auto stream_features = [&](char type, auto &collection) {
+        send_result(stream, timer, true, [&] {
+            write_feature_stream(stream, type, collection, settings.chunk_size);
+        });
+        streamed = true;
+    };
+    switch (request.expected_result) {
+        case RSERVER_TYPE_RASTER: {
+            // a tile writer hands over the raster it assembled instead of converting a RasterLayer
+            std::unique_ptr<GenericRaster> raster;
+            if (Rf_inherits(result, "mapping.tileWriter")) {
+                auto id = static_cast<size_t>(Rcpp::as<int>(Rcpp::List(result)["id"]));
+                raster = tile_writers.at(id)->finish();
+            } else if (chunked) {
+                // the values are converted chunk by chunk while they are sent
+                auto layer = Rcpp::read_raster_layer(result);
+                send_result(stream, timer, true, [&] {
+                    write_raster_stream(stream, -RSERVER_TYPE_RASTER_STREAM, layer.dd, layer.stref, layer.width,
+                                        layer.height, settings.chunk_size,
+                                        [&layer, &timer](size_t offset, size_t count, char *pixels) {
+                                            PhaseScope phase(timer, RequestPhase::CONVERSION);
+                                            layer.convert(offset, count, pixels);
+                                        });
+                });
+                streamed = true;
                 break;
+            } else {
+                raster = Rcpp::as<std::unique_ptr<GenericRaster>>(result);
             }
 
-            case RSERVER_TYPE_POINTS: {
-                auto points = Rcpp::as<std::unique_ptr<PointCollection>>(result);
-                response.write<char>(-RSERVER_TYPE_POINTS);
-                response.write<PointCollection &>(*points, true);
-                spatio_temporal_result = std::move(points);
-            }
+            if (chunked) {
+                const auto pixels = static_cast<const char *>(raster->getData());
+                const auto pixel_size = static_cast<size_t>(raster->dd.getBPP());
+                send_result(stream, timer, true, [&] {
+                    write_raster_stream(stream, -RSERVER_TYPE_RASTER_STREAM, raster->dd, raster->stref,
+                                        raster->width, raster->height, settings.chunk_size,
+                                        [pixels, pixel_size](size_t offset, size_t count, char *out) {
+                                            memcpy(out, pixels + offset * pixel_size, count * pixel_size);
+                                        });
+                });
+                streamed = true;
                 break;
-
-            case RSERVER_TYPE_LINES: {
-                // TODO: implement
-                throw PlatformException("Requesting lines from R is not yet supported");
             }
+            response.write<char>(-RSERVER_TYPE_RASTER);
+            response.write<GenericRaster &>(*raster, true);
+            spatio_temporal_result = std::move(raster);
+            break;
+        }
 
-            case RSERVER_TYPE_POLYGONS: {
-                // TODO: implement
-                throw PlatformException("Requesting polygons from R is not yet supported");
+        case RSERVER_TYPE_POINTS: {
+            auto points = Rcpp::as<std::unique_ptr<PointCollection>>(result);
+            if (chunked) {
+                stream_features(RSERVER_TYPE_POINTS, *points);
+                break;
             }
+            response.write<char>(-RSERVER_TYPE_POINTS);
+            response.write<PointCollection &>(*points, true);
+            spatio_temporal_result = std::move(points);
+        }
+            break;
 
-            case RSERVER_TYPE_STRING: {
-                std::string output = rserver.callbacks->getConsoleOutput();
-                response.write<char>(-RSERVER_TYPE_STRING);
-                response.write<std::string &>(output, true);
-                string_result = std::move(output);
+        case RSERVER_TYPE_LINES: {
+            auto lines = Rcpp::as<std::unique_ptr<LineCollection>>(result);
+            if (chunked) {
+                stream_features(RSERVER_TYPE_LINES, *lines);
                 break;
             }
+            response.write<char>(-RSERVER_TYPE_LINES);
+            response.write<LineCollection &>(*lines, true);
+            spatio_temporal_result = std::move(lines);
+            break;
+        }
 
-            case RSERVER_TYPE_PLOT: {
-                R.parseEval("dev.off()");
-                auto filename = Rcpp::as<std::string>(R["rserver_plot_tempfile"]);
-                std::string output = read_file_as_string(filename);
-                std::remove(filename.c_str());
-                response.write<char>(-RSERVER_TYPE_PLOT);
-                response.write<std::string &>(output, true);
-                string_result = std::move(output);
+        case RSERVER_TYPE_POLYGONS: {
+            auto polygons = Rcpp::as<std::unique_ptr<PolygonCollection>>(result);
+            if (chunked) {
+                stream_features(RSERVER_TYPE_POLYGONS, *polygons);
                 break;
             }
+            response.write<char>(-RSERVER_TYPE_POLYGONS);
+            response.write<PolygonCollection &>(*polygons, true);
+            spatio_temporal_result = std::move(polygons);
+            break;
+        }
 
-            default:
-                throw PlatformException("Unknown result type requested");
+        case RSERVER_TYPE_STRING: {
+            std::string output = callbacks.getConsoleOutput();
+            response.write<char>(-RSERVER_TYPE_STRING);
+            response.write<std::string &>(output, true);
+            string_result = std::move(output);
+            break;
         }
 
-        is_sending = true;
-        stream.write(response);
-        is_sending = false;
+        case RSERVER_TYPE_PLOT: {
+            TraceSpan span("rendering plot");
+            response.write<char>(-RSERVER_TYPE_PLOT);
+            plot->write(response);
+            break;
+        }
+
+        default:
+            throw PlatformException("Unknown result type requested");
+    }
+
+    if (!streamed)
+        send_result(stream, timer, false, [&] { stream.writeLarge(response); });
+
+    if (cache != nullptr)
+        cache->logStats();
+}
+
+/**
+ * Runs the script of a request and sends the result to the client, or an error message if anything fails before the
+ * result is being sent
+ * @param R the R environment
+ * @param callbacks the console callbacks of the R environment
+ * @param stream the connection to the client
+ * @param request the parsed request header
+ * @param settings the server configuration
+ * @param cache the source cache shared by all children or `nullptr`
+ * @param scripts the parsed scripts
+ * @param timer measures the phases of the request
+ * @return false if the request failed and the error was sent to the client
+ */
+bool process_request(RInside &R, RInsideCallbacks &callbacks, ClientStream &stream, const RServerRequest &request,
+                     const RServerSettings &settings, SourceCache *cache, ScriptCache &scripts, RequestTimer &timer) {
+    Log::info("Here's our client!");
+
+    std::unique_ptr<SourcePrefetcher> prefetcher;
+    try {
+        run_request(R, callbacks, stream, request, settings, cache, scripts, timer, prefetcher);
+        return true;
     }
     catch (const NetworkException &e) {
         // do not do anything
@@ -403,15 +941,172 @@ auto RServerConnection::processDataForked(BinaryStream stream) -> void {
             throw;
         }
 
+        // the error is sent right away, the prefetcher still reads the outstanding replies when it is destroyed
         auto what = e.what();
         Log::warn("Exception: %s", what);
         std::string msg(what);
+        if (ResourceLimits::active() != nullptr)
+            msg = ResourceLimits::active()->explain(msg);
         BinaryWriteBuffer response;
         response.write<char>(-RSERVER_TYPE_ERROR);
         response.write<std::string &>(msg);
         stream.write(response);
+        return false;
+    }
+}
+
+/**
+ * Sets up the connection as negotiated in the header and runs the request.
+ *
+ * On a Unix domain socket, messages may carry memory files if the client supports it. Otherwise the codec
+ * negotiation is answered if the client asked for it, and the request runs through a compressing relay if both sides
+ * agreed on a codec. The request is recorded in the metrics and traced if it is sampled, even if it fails.
+ *
+ * @param fd the socket behind `stream`
+ * @param arrival when the header of the request arrived
+ */
+void serve_request(RInside &R, RInsideCallbacks &callbacks, BinaryStream &stream, int fd,
+                   const RServerRequest &request, const RServerSettings &settings, SourceCache *cache,
+                   ScriptCache &scripts, ServerMetrics &metrics, const RequestArrival &arrival) {
+    const auto now = std::chrono::steady_clock::now();
+    metrics.observeDispatch(std::chrono::duration<double>(now - arrival.parsed).count());
+
+    RequestTrace trace(std::string("request ") + ServerMetrics::getTypeName(request.expected_result),
+                       settings.trace_sample_rate, settings.trace_directory, settings.trace_format);
+    Log::info("Trace id: %s%s", trace.getId().c_str(), trace.isSampled() ? " (sampled)" : "");
+    trace.addSpan("reading header", arrival.received, arrival.parsed);
+    trace.addSpan("dispatch", arrival.parsed, now);
+
+    auto run = [&](ClientStream &client) {
+        RequestTimer timer(RequestPhase::EVALUATION);
+        bool succeeded = false;
+        try {
+            succeeded = process_request(R, callbacks, client, request, settings, cache, scripts, timer);
+        } catch (...) {
+            metrics.observeRequest(request.expected_result, timer, true);
+            metrics.addBytes(client.getBytesReceived(), client.getBytesSent());
+            throw;
+        }
+        metrics.observeRequest(request.expected_result, timer, !succeeded);
+        metrics.addBytes(client.getBytesReceived(), client.getBytesSent());
+    };
+
+    // memory files cannot pass the compressing relay, and compressing is pointless on the same host anyway
+    const bool fd_payloads = request.hasCapability(RServerCapabilities::FD_PAYLOADS) && is_unix_socket(fd);
+
+    uint8_t codec = RServerCodecs::NONE;
+    if (request.hasCapability(RServerCapabilities::COMPRESSION)) {
+        if (!fd_payloads && request.supportsCodec(settings.compression_codec))
+            codec = settings.compression_codec;
+        BinaryWriteBuffer response;
+        response.write<uint8_t>(codec);
+        stream.write(response);
+        Log::debug("compression: %s", MessageCodec::getName(codec));
+    }
+
+    // compressed errors cannot be written from a signal handler, those clients only see the connection close
+    if (ResourceLimits::active() != nullptr)
+        ResourceLimits::active()->setClient(codec == RServerCodecs::NONE ? fd : -1, &is_sending);
+
+    if (codec == RServerCodecs::NONE) {
+        if (fd_payloads)
+            Log::debug("passing large messages as memory files");
+        ClientStream client(stream, fd, fd_payloads, settings.socket_min_payload);
+        run(client);
         return;
     }
+
+    CompressingRelay relay(fd, MessageCodec(codec, settings.compression_level, settings.compression_min_size,
+                                            settings.compression_max_size));
+    {
+        int local_fd = relay.releaseLocalFd();
+        BinaryStream relayed(local_fd, local_fd);
+        ClientStream client(relayed, local_fd, false, 0);
+        run(client);
+    }
+    metrics.addCompression(relay.finish());
+    relay.logStats();
+}
+
+class RServerConnection : public NonblockingServer::Connection {
+    public:
+        RServerConnection(NonblockingServer &server, int fd, int id);
+
+        ~RServerConnection() override;
+
+    private:
+        void processData(std::unique_ptr<BinaryReadBuffer> buffer) override;
+
+        auto processDataForked(BinaryStream stream) -> void override;
+
+        auto processDataAsync(BinaryStream stream) -> void override;
+
+        int client_fd;
+        RServerRequest request;
+        RequestArrival arrival;
+};
+
+class RServer : public NonblockingServer {
+    public:
+        RServer(RInside *R, RInsideCallbacks *callbacks, const RServerSettings &settings, SourceCache *cache,
+                ServerMetrics *metrics, ResourceLimits *limits)
+                : NonblockingServer(), R(R), callbacks(callbacks), settings(settings), cache(cache), metrics(metrics),
+                  limits(limits), scripts(settings.script_cache_size, settings.script_cache_compile, metrics) {
+        }
+
+        ~RServer() override = default;
+
+    private:
+        std::unique_ptr<Connection> createConnection(int fd, int id) override;
+
+        RInside *R;
+        RInsideCallbacks *callbacks;
+        RServerSettings settings;
+        SourceCache *cache;
+        ServerMetrics *metrics;
+        ResourceLimits *limits;
+        ScriptCache scripts;
+
+        friend class RServerConnection;
+};
+
+
+RServerConnection::RServerConnection(NonblockingServer &server, int fd, int id)
+        : Connection(server, fd, id), client_fd(fd) {
+    Log::info("%d: connected", id);
+}
+
+RServerConnection::~RServerConnection() = default;
+
+void RServerConnection::processData(std::unique_ptr<BinaryReadBuffer> buffer) {
+    auto &rserver = (RServer &) server;
+    arrival.received = std::chrono::steady_clock::now();
+    request = RServerRequest(*buffer);
+    arrival.parsed = std::chrono::steady_clock::now();
+    if (request.isSession())
+        throw ArgumentException("Multiplexed sessions require rserver.mode = pooled");
+    request.log();
+
+    if (rserver.settings.mode == RServerMode::FORKED) {
+        // parse the script in the parent, so that later children inherit it
+        rserver.scripts.prepare(request.source);
+        forkAndProcess(request.timeout);
+    } else {
+        enqueueForAsyncProcessing();
+    }
+}
+
+auto RServerConnection::processDataAsync(BinaryStream stream) -> void {
+    processDataForked(std::move(stream));
+}
+
+
+auto RServerConnection::processDataForked(BinaryStream stream) -> void {
+    auto &rserver = (RServer &) server;
+    // threaded mode runs requests in the server itself, which must not be limited
+    ResourceLimits::Scope limited(rserver.settings.mode == RServerMode::FORKED ? rserver.limits : nullptr);
+    serve_request(*(rserver.R), *(rserver.callbacks), stream, client_fd, request, rserver.settings, rserver.cache,
+                  rserver.scripts, *rserver.metrics, arrival);
 }
 
 
@@ -423,9 +1118,9 @@ std::unique_ptr<NonblockingServer::Connection> RServer::createConnection(int fd,
 int main() {
     Configuration::loadFromDefaultPaths();
 
-    auto portnr = Configuration::get<int>("rserver.port");
+    auto settings = RServerSettings::fromConfiguration();
 
-    Log::logToStream(Configuration::get<std::string>("rserver.loglevel", "info"), &std::cerr);
+    Log::logToStream(settings.loglevel, &std::cerr);
 
     // Signal handlers
     int signals[] = {SIGHUP, SIGINT, 0};
@@ -446,8 +1141,7 @@ int main() {
 
     Log::info("...loading packages");
 
-    std::vector<std::string> packages = Configuration::getVector<std::string>("rserver.packages");
-    for (auto &package : packages) {
+    for (auto &package : settings.packages) {
         Log::debug("Loading package '%s'", package.c_str());
         std::string command = "library(\"" + package + "\")";
         try {
@@ -463,15 +1157,88 @@ int main() {
 
     Log::info("R is ready, starting server..");
 
-    RServer server(&R, Rcallbacks);
-    // server.listen(rserver_socket, 0777);
-    server.listen(portnr);
-#if RSERVER_FORKED_MODE
-    server.setWorkerThreads(0);
-    server.allowForking();
-#else
-    server.setWorkerThreads(1);
-#endif
+    // created before forking, so that all children share it
+    std::unique_ptr<SourceCache> cache;
+    if (settings.cache_size > 0)
+        cache = std::make_unique<SourceCache>(settings.cache_size * 1024 * 1024, settings.cache_spill_directory,
+                                              settings.cache_spill_size * 1024 * 1024);
+    ServerMetrics metrics;
+    if (settings.metrics_port > 0)
+        MetricsEndpoint::start(settings.metrics_port, metrics, cache.get());
+    ResourceLimits limits(settings.limit_address_space, settings.limit_memory, settings.limit_cpu_time,
+                          settings.limit_temp_files, settings.limit_cgroup, settings.mode != RServerMode::POOLED,
+                          &R_TempDir, &metrics);
+
+    if (settings.mode == RServerMode::POOLED) {
+        // workers serve many requests, so each one starts from the session as it is now, like a forked child would.
+        // Namespaces that a script loaded stay loaded, only what it attached is detached again.
+        Rcpp::List session = R.parseEval("list(search = search(), options = options(), rng = RNGkind(), "
+                                         "seed = get0('.Random.seed', envir = globalenv(), inherits = FALSE), "
+                                         "wd = getwd())");
+        Rcpp::Function reset_session = R.parseEval(
+                "function(session) {\n"
+                "    grDevices::graphics.off()\n"
+                "    rm(list = ls(globalenv(), all.names = TRUE), envir = globalenv())\n"
+                "    for (name in setdiff(search(), session$search))\n"
+                "        detach(name, character.only = TRUE)\n"
+                "    added <- setdiff(names(options()), names(session$options))\n"
+                "    options(c(session$options, stats::setNames(vector('list', length(added)), added)))\n"
+                "    do.call(RNGkind, as.list(session$rng))\n"
+                "    if (!is.null(session$seed))\n"
+                "        assign('.Random.seed', session$seed, envir = globalenv())\n"
+                "    setwd(session$wd)\n"
+                "    invisible(NULL)\n"
+                "}");
+
+        // every worker keeps its own copy across its requests
+        ScriptCache scripts(settings.script_cache_size, settings.script_cache_compile, &metrics);
+        RWorkerPool pool([&R, Rcallbacks, &settings, &cache, &scripts, &metrics, &limits, &session, &reset_session](
+                                 BinaryStream &stream, int fd, const RServerRequest &request,
+                                 const RequestArrival &arrival) {
+                             reset_session(session);
+                             Rcallbacks->resetConsoleOutput();
+                             ResourceLimits::Scope limited(&limits);
+
+                             serve_request(R, *Rcallbacks, stream, fd, request, settings, cache.get(), scripts,
+                                           metrics, arrival);
+                         },
+                         settings.pool_workers, settings.pool_max_requests, settings.pool_max_memory, &metrics);
+        if (!settings.socket.empty())
+            pool.listen(settings.socket, 0777);
+        pool.listen(settings.port);
+        pool.start();
+        return 0;
+    }
+
+    if (settings.mode == RServerMode::FORKED && settings.admission_max_concurrent > 0) {
+        // parse scripts in the parent, so that the children inherit them
+        ScriptCache scripts(settings.script_cache_size, settings.script_cache_compile, &metrics);
+        RForkingServer server([&R, Rcallbacks, &settings, &cache, &scripts, &metrics, &limits](
+                                      BinaryStream &stream, int fd, const RServerRequest &request,
+                                      const RequestArrival &arrival) {
+                                  ResourceLimits::Scope limited(&limits);
+                                  serve_request(R, *Rcallbacks, stream, fd, request, settings, cache.get(), scripts,
+                                                metrics, arrival);
+                              },
+                              [&scripts](const RServerRequest &request) { scripts.prepare(request.source); },
+                              settings.admission_max_concurrent, settings.admission_max_queue, &metrics);
+        if (!settings.socket.empty())
+            server.listen(settings.socket, 0777);
+        server.listen(settings.port);
+        server.start();
+        return 0;
+    }
+
+    RServer server(&R, Rcallbacks, settings, cache.get(), &metrics, &limits);
+    if (!settings.socket.empty())
+        server.listen(settings.socket, 0777);
+    server.listen(settings.port);
+    if (settings.mode == RServerMode::FORKED) {
+        server.setWorkerThreads(0);
+        server.allowForking();
+    } else {
+        server.setWorkerThreads(1);
+    }
     server.start();
 
     return 0;
@@ -0,0 +1,615 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "util/exceptions.h"
+#include "datatypes/raster.h"
+#include "datatypes/raster/raster_priv.h"
+#include "datatypes/pointcollection.h"
+#include "datatypes/linecollection.h"
+#include "datatypes/polygoncollection.h"
+
+#ifdef __clang__ // Prevent GCC from complaining about unknown pragmas.
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-parameter" // silence the warnings of the Rcpp headers
+#endif // __clang__
+
+#include <Rcpp.h>
+#include <RInside.h>
+
+#pragma clang diagnostic pop // ignored "-Wunused-parameter"
+
+#include "rcpp_wrapper.h"
+#include "feature_conversion.h"
+#include "raster_conversion.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Micro-benchmarks for the conversions between MAPPING and R, see "Benchmarks" in the README.
+ *
+ * Every case times one conversion of `rcpp_wrapper.h` in an embedded R session over a matrix of sizes and data types:
+ * `wrap` and `as` of rasters of every GDAL type with and without no data, of point collections with 0 to 50 numeric
+ * or textual attributes, of line and polygon collections, of query rectangles and `create_attribute_data_frame`.
+ * The kernel cases compare the typed conversion kernels with the former per element loops and need no R at all.
+ *
+ * Each case prints one row with the mean and minimal time of a repetition, the throughput in MAPPING bytes per
+ * second and per repetition the heap allocations, allocated bytes, R garbage collections and their time.
+ *
+ * Usage: r_server_bench [--sizes 256,2048] [--features 1000,100000] [--repetitions 5] [--filter raster_]
+ *                       [--format csv|jsonl]
+ */
+
+#ifdef __GLIBC__
+/*
+ * Counts the heap allocations of the whole process, including those of R, by interposing malloc.
+ * glibc exports its allocator under the `__libc_` names as well, which the counting functions forward to.
+ */
+static std::atomic<uint64_t> allocation_count(0);
+static std::atomic<uint64_t> allocation_bytes(0);
+
+extern "C" {
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t count, size_t size);
+    void *__libc_realloc(void *pointer, size_t size);
+
+    void *malloc(size_t size) noexcept {
+        allocation_count.fetch_add(1, std::memory_order_relaxed);
+        allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+        return __libc_malloc(size);
+    }
+
+    void *calloc(size_t count, size_t size) noexcept {
+        allocation_count.fetch_add(1, std::memory_order_relaxed);
+        allocation_bytes.fetch_add(count * size, std::memory_order_relaxed);
+        return __libc_calloc(count, size);
+    }
+
+    void *realloc(void *pointer, size_t size) noexcept {
+        allocation_count.fetch_add(1, std::memory_order_relaxed);
+        allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+        return __libc_realloc(pointer, size);
+    }
+}
+
+static auto get_allocation_count() -> uint64_t {
+    return allocation_count.load(std::memory_order_relaxed);
+}
+
+static auto get_allocation_bytes() -> uint64_t {
+    return allocation_bytes.load(std::memory_order_relaxed);
+}
+#else
+// allocations are only counted with glibc
+static auto get_allocation_count() -> uint64_t {
+    return 0;
+}
+
+static auto get_allocation_bytes() -> uint64_t {
+    return 0;
+}
+#endif
+
+/**
+ * Observes the garbage collector of the embedded R session.
+ *
+ * The time comes from `gc.time()`. R has no counter of its collections, so a sentinel environment with a finalizer
+ * is left unreachable; when a collection finalizes it, the finalizer counts and leaves the next sentinel. Finalizers
+ * only run when the conversion returns to R, so at most one collection per repetition is counted.
+ */
+class RGarbageCollections {
+    public:
+        explicit RGarbageCollections(RInside &R) : R(R) {
+            R.parseEvalQ("invisible(gc.time(TRUE))");
+            R.parseEvalQ("local({"
+                         "    counter <- new.env();"
+                         "    counter$count <- 0;"
+                         "    sentinel <- function() reg.finalizer(new.env(), function(e) {"
+                         "        counter$count <- counter$count + 1;"
+                         "        sentinel()"
+                         "    });"
+                         "    sentinel();"
+                         "    .bench_gc_counter <<- counter"
+                         "})");
+        }
+
+        auto getCount() -> uint64_t {
+            R_RunPendingFinalizers();
+            return static_cast<uint64_t>(Rcpp::as<double>(R.parseEval(".bench_gc_counter$count")));
+        }
+
+        auto getSeconds() -> double {
+            Rcpp::NumericVector times = R.parseEval("gc.time()");
+            return times[0];
+        }
+
+    private:
+        RInside &R;
+};
+
+/**
+ * Runs the cases and prints a row for each
+ */
+class BenchmarkRunner {
+    public:
+        enum class Format {
+            CSV,
+            JSON_LINES
+        };
+
+        /**
+         * @param gc the garbage collections of R or `nullptr` if only kernel cases run
+         * @param repetitions how often each case is timed, after one untimed warm-up run
+         * @param filter only cases whose name contains it run
+         * @param format
+         */
+        BenchmarkRunner(RGarbageCollections *gc, int repetitions, std::string filter, Format format)
+                : gc(gc), repetitions(repetitions), filter(std::move(filter)), format(format) {
+            if (format == Format::CSV)
+                printf("case,datatype,parameter,elements,bytes,repetitions,mean_ms,min_ms,mb_per_s,allocations,"
+                       "allocated_bytes,r_gc_count,r_gc_ms\n");
+        }
+
+        auto isSelected(const std::string &name) const -> bool {
+            return name.find(filter) != std::string::npos;
+        }
+
+        /**
+         * Times a case
+         * @param name the conversion, e.g. `raster_wrap`
+         * @param datatype the data type or kind of attributes
+         * @param parameter further settings of the case, e.g. `nodata` or `rings=16`
+         * @param elements the number of pixels, features or rectangles converted per repetition
+         * @param bytes the size of the data in MAPPING per repetition, for the throughput
+         * @param function the conversion
+         */
+        template<typename Function>
+        void run(const std::string &name, const std::string &datatype, const std::string &parameter, size_t elements,
+                 size_t bytes, Function function) {
+            if (!isSelected(name))
+                return;
+
+            function();
+
+            // asking R allocates, so the allocation counters are read last
+            const uint64_t gc_count_before = gc != nullptr ? gc->getCount() : 0;
+            const double gc_seconds_before = gc != nullptr ? gc->getSeconds() : 0;
+            const uint64_t allocations_before = get_allocation_count();
+            const uint64_t bytes_before = get_allocation_bytes();
+
+            double total_ms = 0;
+            double min_ms = INFINITY;
+            for (int i = 0; i < repetitions; i++) {
+                auto start = std::chrono::steady_clock::now();
+                function();
+                auto end = std::chrono::steady_clock::now();
+                const double ms = std::chrono::duration<double, std::milli>(end - start).count();
+                total_ms += ms;
+                min_ms = std::min(min_ms, ms);
+                // lets the finalizers of the collections during this repetition run
+                if (gc != nullptr)
+                    R_RunPendingFinalizers();
+            }
+
+            // the allocation counters are read before asking R again
+            const double allocations = static_cast<double>(get_allocation_count() - allocations_before) / repetitions;
+            const double allocated = static_cast<double>(get_allocation_bytes() - bytes_before) / repetitions;
+            const double gc_count = gc != nullptr ? static_cast<double>(gc->getCount() - gc_count_before) / repetitions
+                                                  : 0;
+            const double gc_ms = gc != nullptr ? (gc->getSeconds() - gc_seconds_before) * 1000 / repetitions : 0;
+
+            const double mean_ms = total_ms / repetitions;
+            const double mb_per_s = mean_ms > 0 ? bytes / 1e6 / (mean_ms / 1000) : 0;
+
+            if (format == Format::CSV) {
+                printf("%s,%s,%s,%zu,%zu,%d,%.3f,%.3f,%.1f,%.1f,%.0f,%.2f,%.3f\n", name.c_str(), datatype.c_str(),
+                       parameter.c_str(), elements, bytes, repetitions, mean_ms, min_ms, mb_per_s, allocations,
+                       allocated, gc_count, gc_ms);
+            } else {
+                printf("{\"case\":\"%s\",\"datatype\":\"%s\",\"parameter\":\"%s\",\"elements\":%zu,\"bytes\":%zu,"
+                       "\"repetitions\":%d,\"mean_ms\":%.3f,\"min_ms\":%.3f,\"mb_per_s\":%.1f,\"allocations\":%.1f,"
+                       "\"allocated_bytes\":%.0f,\"r_gc_count\":%.2f,\"r_gc_ms\":%.3f}\n", name.c_str(),
+                       datatype.c_str(), parameter.c_str(), elements, bytes, repetitions, mean_ms, min_ms, mb_per_s,
+                       allocations, allocated, gc_count, gc_ms);
+            }
+            fflush(stdout);
+        }
+
+    private:
+        RGarbageCollections *gc;
+        int repetitions;
+        std::string filter;
+        Format format;
+};
+
+template<typename T>
+static void fill_raster(GenericRaster &raster) {
+    auto &raster2d = dynamic_cast<Raster2D<T> &>(raster);
+    const double no_data = raster.dd.no_data;
+
+    // every tenth pixel is no data
+    for (uint32_t y = 0; y < raster.height; y++) {
+        for (uint32_t x = 0; x < raster.width; x++) {
+            double value = ((x + y) % 10 == 0) ? no_data : (x * 31 + y) % 100;
+            raster2d.set(x, y, static_cast<T>(value));
+        }
+    }
+}
+
+static std::unique_ptr<GenericRaster> create_raster(GDALDataType datatype, uint32_t width, uint32_t height,
+                                                    bool no_data) {
+    Unit unit = Unit::unknown();
+    unit.setMinMax(0, 100);
+    DataDescription dd(datatype, unit);
+    if (no_data)
+        dd.addNoData();
+    dd.verify();
+
+    SpatioTemporalReference stref(
+            SpatialReference(CrsId::from_srs_string("EPSG:4326"), 0, 0, width, height),
+            TemporalReference::unreferenced()
+    );
+    auto raster = GenericRaster::create(dd, stref, width, height, GenericRaster::Representation::CPU);
+
+    switch (datatype) {
+        case GDT_Byte: fill_raster<uint8_t>(*raster); break;
+        case GDT_Int16: fill_raster<int16_t>(*raster); break;
+        case GDT_UInt16: fill_raster<uint16_t>(*raster); break;
+        case GDT_Int32: fill_raster<int32_t>(*raster); break;
+        case GDT_UInt32: fill_raster<uint32_t>(*raster); break;
+        case GDT_Float32: fill_raster<float>(*raster); break;
+        case GDT_Float64: fill_raster<double>(*raster); break;
+        default: throw ArgumentException("create_raster(): unsupported data type");
+    }
+    return raster;
+}
+
+static void convert_per_pixel(const GenericRaster &raster, double *out) {
+    size_t pos = 0;
+    for (uint32_t y = 0; y < raster.height; y++) {
+        for (uint32_t x = 0; x < raster.width; x++) {
+            double val = raster.getAsDouble(x, y);
+            out[pos++] = raster.dd.is_no_data(val) ? NAN : val;
+        }
+    }
+}
+
+static void convert_coordinates_per_element(const std::vector<Coordinate> &coordinates, std::vector<double> &out) {
+    const size_t rows = coordinates.size();
+    for (size_t i = 0; i < rows; i++) {
+        // like Rcpp's matrix(i, j) accessor
+        out.at(i) = coordinates[i].x;
+        out.at(i + rows) = coordinates[i].y;
+    }
+}
+
+static auto create_stref() -> SpatioTemporalReference {
+    return SpatioTemporalReference(
+            SpatialReference(CrsId::from_srs_string("EPSG:4326"), -180, -90, 180, 90),
+            TemporalReference(TIMETYPE_UNIX, 0, 1)
+    );
+}
+
+/**
+ * Adds `count` attributes to every feature, numeric ones or textual ones of eight characters
+ */
+static void add_attributes(SimpleFeatureCollection &collection, size_t count, bool textual) {
+    const size_t features = collection.getFeatureCount();
+    for (size_t a = 0; a < count; a++) {
+        const std::string key = "attribute" + std::to_string(a);
+        if (textual) {
+            auto &attribute = collection.feature_attributes.addTextualAttribute(key, Unit::unknown());
+            attribute.reserve(features);
+            for (size_t i = 0; i < features; i++) {
+                char value[16];
+                snprintf(value, sizeof(value), "cat-%04zu", (i + a) % 1000);
+                attribute.set(i, value);
+            }
+        } else {
+            auto &attribute = collection.feature_attributes.addNumericAttribute(key, Unit::unknown());
+            attribute.reserve(features);
+            for (size_t i = 0; i < features; i++)
+                attribute.set(i, static_cast<double>(i + a));
+        }
+    }
+}
+
+/**
+ * @return the size of the coordinates and attributes in MAPPING
+ */
+static auto get_collection_bytes(const SimpleFeatureCollection &collection, size_t attributes) -> size_t {
+    // numeric attributes take a double, textual ones eight characters
+    return collection.coordinates.size() * sizeof(Coordinate) + collection.getFeatureCount() * attributes * 8;
+}
+
+static auto create_points(size_t features, size_t attributes, bool textual) -> std::unique_ptr<PointCollection> {
+    auto points = std::make_unique<PointCollection>(create_stref());
+    for (size_t i = 0; i < features; i++)
+        points->addSinglePointFeature(Coordinate(static_cast<double>(i % 360) - 180,
+                                                 static_cast<double>(i % 180) - 90));
+    add_attributes(*points, attributes, textual);
+    return points;
+}
+
+static auto create_lines(size_t features, size_t coordinates) -> std::unique_ptr<LineCollection> {
+    auto lines = std::make_unique<LineCollection>(create_stref());
+    for (size_t i = 0; i < features; i++) {
+        for (size_t c = 0; c < coordinates; c++)
+            lines->addCoordinate(static_cast<double>(c % 360) - 180, static_cast<double>(i % 180) - 90);
+        lines->finishLine();
+        lines->finishFeature();
+    }
+    return lines;
+}
+
+/**
+ * Creates polygons of one exterior ring with `rings - 1` holes, every ring is a closed square
+ */
+static auto create_polygons(size_t features, size_t rings) -> std::unique_ptr<PolygonCollection> {
+    auto polygons = std::make_unique<PolygonCollection>(create_stref());
+    for (size_t i = 0; i < features; i++) {
+        for (size_t r = 0; r < rings; r++) {
+            const double size = 10.0 / (r + 1);
+            polygons->addCoordinate(0, 0);
+            polygons->addCoordinate(size, 0);
+            polygons->addCoordinate(size, size);
+            polygons->addCoordinate(0, size);
+            polygons->addCoordinate(0, 0);
+            polygons->finishRing();
+        }
+        polygons->finishPolygon();
+        polygons->finishFeature();
+    }
+    return polygons;
+}
+
+/**
+ * @return a comma separated list of numbers
+ */
+static auto parse_list(const char *text) -> std::vector<size_t> {
+    std::vector<size_t> values;
+    const char *position = text;
+    while (*position != '\0') {
+        char *end;
+        values.push_back(static_cast<size_t>(strtoull(position, &end, 10)));
+        if (end == position)
+            throw ArgumentException(std::string("r_server_bench: not a list of numbers: ") + text);
+        position = *end == ',' ? end + 1 : end;
+    }
+    return values;
+}
+
+static void run_kernel_cases(BenchmarkRunner &runner,
+                             const std::vector<std::pair<GDALDataType, const char *>> &datatypes,
+                             const std::vector<size_t> &sizes) {
+    for (size_t size : sizes) {
+        const auto edge = static_cast<uint32_t>(size);
+        for (const auto &datatype : datatypes) {
+            if (!runner.isSelected("raster_to_double_per_pixel") && !runner.isSelected("raster_to_double_kernel"))
+                break;
+            auto raster = create_raster(datatype.first, edge, edge, true);
+            const size_t pixel_count = raster->getPixelCount();
+            const size_t bytes = pixel_count * static_cast<size_t>(raster->dd.getBPP());
+            std::vector<double> out(pixel_count);
+
+            runner.run("raster_to_double_per_pixel", datatype.second, "nodata", pixel_count, bytes, [&] {
+                convert_per_pixel(*raster, out.data());
+            });
+            runner.run("raster_to_double_kernel", datatype.second, "nodata", pixel_count, bytes, [&] {
+                convert_raster_to_double(*raster, 0, pixel_count, out.data());
+            });
+        }
+
+        if (!runner.isSelected("coordinates_to_matrix_per_element") &&
+            !runner.isSelected("coordinates_to_matrix_kernel"))
+            continue;
+        const size_t coordinate_count = static_cast<size_t>(edge) * edge;
+        std::vector<Coordinate> coordinates;
+        coordinates.reserve(coordinate_count);
+        for (size_t i = 0; i < coordinate_count; i++)
+            coordinates.emplace_back(static_cast<double>(i % edge), static_cast<double>(i / edge));
+        std::vector<double> matrix(2 * coordinate_count);
+        const size_t bytes = coordinate_count * sizeof(Coordinate);
+
+        runner.run("coordinates_to_matrix_per_element", "Float64", "", coordinate_count, bytes, [&] {
+            convert_coordinates_per_element(coordinates, matrix);
+        });
+        runner.run("coordinates_to_matrix_kernel", "Float64", "", coordinate_count, bytes, [&] {
+            deinterleave_coordinates(coordinates.data(), matrix.data(), matrix.data() + coordinate_count,
+                                     coordinate_count);
+        });
+    }
+}
+
+static void run_raster_cases(BenchmarkRunner &runner,
+                             const std::vector<std::pair<GDALDataType, const char *>> &datatypes,
+                             const std::vector<size_t> &sizes) {
+    if (!runner.isSelected("raster_wrap") && !runner.isSelected("raster_as"))
+        return;
+    for (size_t size : sizes) {
+        const auto edge = static_cast<uint32_t>(size);
+        for (const auto &datatype : datatypes) {
+            for (bool no_data : {false, true}) {
+                auto raster = create_raster(datatype.first, edge, edge, no_data);
+                const size_t pixel_count = raster->getPixelCount();
+                const size_t bytes = pixel_count * static_cast<size_t>(raster->dd.getBPP());
+                const char *parameter = no_data ? "nodata" : "";
+
+                runner.run("raster_wrap", datatype.second, parameter, pixel_count, bytes, [&] {
+                    Rcpp::RObject layer = Rcpp::wrap(*raster);
+                });
+
+                // the pixel type of the result follows the values of the layer, see `read_raster_layer`
+                Rcpp::RObject layer = Rcpp::wrap(*raster);
+                runner.run("raster_as", datatype.second, parameter, pixel_count, bytes, [&] {
+                    auto converted = Rcpp::as<std::unique_ptr<GenericRaster>>(layer);
+                });
+            }
+        }
+    }
+}
+
+static void run_feature_cases(BenchmarkRunner &runner, const std::vector<size_t> &feature_counts) {
+    const size_t attribute_counts[] = {0, 1, 10, 50};
+
+    for (size_t features : feature_counts) {
+        const std::string count = std::to_string(features);
+
+        if (runner.isSelected("points_wrap") || runner.isSelected("points_as") ||
+            runner.isSelected("attribute_data_frame")) {
+            for (size_t attributes : attribute_counts) {
+                for (bool textual : {false, true}) {
+                    // without attributes there is no difference between their kinds
+                    if (attributes == 0 && textual)
+                        continue;
+                    auto points = create_points(features, attributes, textual);
+                    const size_t bytes = get_collection_bytes(*points, attributes);
+                    const char *kind = textual ? "text" : "numeric";
+                    const std::string parameter = "attributes=" + std::to_string(attributes);
+
+                    runner.run("points_wrap", kind, parameter, features, bytes, [&] {
+                        Rcpp::RObject sp = Rcpp::wrap(*points);
+                    });
+                    Rcpp::RObject sp = Rcpp::wrap(*points);
+                    runner.run("points_as", kind, parameter, features, bytes, [&] {
+                        auto converted = Rcpp::as<std::unique_ptr<PointCollection>>(sp);
+                    });
+                    runner.run("attribute_data_frame", kind, parameter, features, bytes, [&] {
+                        Rcpp::DataFrame frame = Rcpp::create_attribute_data_frame(*points);
+                    });
+                }
+            }
+        }
+
+        if (runner.isSelected("lines_wrap") || runner.isSelected("lines_as")) {
+            const size_t coordinates = 16;
+            auto lines = create_lines(features, coordinates);
+            const size_t bytes = get_collection_bytes(*lines, 0);
+            const std::string parameter = "coordinates=" + std::to_string(coordinates);
+
+            runner.run("lines_wrap", "", parameter, features, bytes, [&] {
+                Rcpp::RObject sp = Rcpp::wrap(*lines);
+            });
+            Rcpp::RObject sp = Rcpp::wrap(*lines);
+            runner.run("lines_as", "", parameter, features, bytes, [&] {
+                auto converted = Rcpp::as<std::unique_ptr<LineCollection>>(sp);
+            });
+        }
+
+        if (runner.isSelected("polygons_wrap") || runner.isSelected("polygons_as")) {
+            for (size_t rings : {1, 16, 256}) {
+                // the same number of rings in total, spread over fewer polygons
+                const size_t polygon_count = std::max<size_t>(1, features / rings);
+                auto polygons = create_polygons(polygon_count, rings);
+                const size_t bytes = get_collection_bytes(*polygons, 0);
+                const std::string parameter = "rings=" + std::to_string(rings);
+
+                runner.run("polygons_wrap", "", parameter, polygon_count, bytes, [&] {
+                    Rcpp::RObject sp = Rcpp::wrap(*polygons);
+                });
+                Rcpp::RObject sp = Rcpp::wrap(*polygons);
+                runner.run("polygons_as", "", parameter, polygon_count, bytes, [&] {
+                    auto converted = Rcpp::as<std::unique_ptr<PolygonCollection>>(sp);
+                });
+            }
+        }
+    }
+}
+
+static void run_query_rectangle_cases(BenchmarkRunner &runner) {
+    // a single rectangle is too quick to time, so a repetition converts many
+    const size_t count = 10000;
+    QueryRectangle rect(
+            SpatialReference(CrsId::from_srs_string("EPSG:4326"), -180, -90, 180, 90),
+            TemporalReference(TIMETYPE_UNIX, 0, 1),
+            QueryResolution::pixels(1024, 512)
+    );
+    const size_t bytes = count * sizeof(QueryRectangle);
+
+    runner.run("qrect_wrap", "", "", count, bytes, [&] {
+        for (size_t i = 0; i < count; i++)
+            Rcpp::wrap(rect);
+    });
+    Rcpp::RObject list = Rcpp::wrap(rect);
+    runner.run("qrect_as", "", "", count, bytes, [&] {
+        for (size_t i = 0; i < count; i++)
+            Rcpp::as<QueryRectangle>(list);
+    });
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<size_t> sizes{256, 2048};
+    std::vector<size_t> feature_counts{1000, 100000};
+    int repetitions = 5;
+    std::string filter;
+    auto format = BenchmarkRunner::Format::CSV;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string option = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "r_server_bench: missing value for %s\n", option.c_str());
+            return 1;
+        }
+        const char *value = argv[++i];
+        if (option == "--sizes")
+            sizes = parse_list(value);
+        else if (option == "--features")
+            feature_counts = parse_list(value);
+        else if (option == "--repetitions")
+            repetitions = std::max(1, atoi(value));
+        else if (option == "--filter")
+            filter = value;
+        else if (option == "--format" && strcmp(value, "csv") == 0)
+            format = BenchmarkRunner::Format::CSV;
+        else if (option == "--format" && strcmp(value, "jsonl") == 0)
+            format = BenchmarkRunner::Format::JSON_LINES;
+        else {
+            fprintf(stderr, "r_server_bench: unknown option %s %s\n", option.c_str(), value);
+            return 1;
+        }
+    }
+
+    const std::vector<std::pair<GDALDataType, const char *>> datatypes{
+            {GDT_Byte,    "Byte"},
+            {GDT_Int16,   "Int16"},
+            {GDT_UInt16,  "UInt16"},
+            {GDT_Int32,   "Int32"},
+            {GDT_UInt32,  "UInt32"},
+            {GDT_Float32, "Float32"},
+            {GDT_Float64, "Float64"},
+    };
+
+    // the conversions create objects of these packages
+    RInside R;
+    R.parseEvalQ("suppressMessages({ library(\"sp\"); library(\"raster\") })");
+    RGarbageCollections gc(R);
+
+    BenchmarkRunner runner(&gc, repetitions, filter, format);
+    run_kernel_cases(runner, datatypes, sizes);
+    run_raster_cases(runner, datatypes, sizes);
+    run_feature_cases(runner, feature_counts);
+    run_query_rectangle_cases(runner);
+
+    return 0;
+}
@@ -0,0 +1,570 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "util/exceptions.h"
+#include "util/binarystream.h"
+#include "datatypes/raster.h"
+#include "datatypes/raster/raster_priv.h"
+#include "datatypes/pointcollection.h"
+#include "operators/processing/scripting/r_script.h"
+#include "operators/queryrectangle.h"
+
+#include "message_socket.h"
+#include "rserver_protocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Load generator for the server, see docs/loadgen.md.
+ *
+ * It plays the part of mapping-core: every request opens a connection, sends a request header as the r_script
+ * operator does and answers the raster and points requests of the script with synthetic sources, until the result
+ * or an error arrives. Requests are drawn from a weighted mix of scripts and run either at a fixed concurrency or
+ * at a fixed arrival rate. At the end it prints the throughput and a latency histogram per result type.
+ */
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * A script of the mix
+ */
+struct Scenario {
+    double weight;
+    char result_type;
+    int raster_sources;
+    int points_sources;
+    std::string script;
+};
+
+struct LoadSettings {
+    std::string host = "127.0.0.1";
+    int port = 10200;
+    std::string socket;
+
+    std::vector<Scenario> scenarios;
+
+    size_t concurrency = 4;
+    double rate = 0; // requests per second, 0 runs at a fixed concurrency
+    double duration = 10; // seconds
+    size_t requests = 0; // stop after this many requests instead, if not 0
+
+    uint32_t raster_width = 512;
+    uint32_t raster_height = 512;
+    GDALDataType raster_type = GDT_Float32;
+    size_t points = 10000;
+    size_t point_attributes = 1;
+
+    int timeout = 60;
+    size_t plot_width = 800;
+    size_t plot_height = 600;
+};
+
+static auto parse_result_type(const std::string &name) -> char {
+    if (name == "raster")
+        return RSERVER_TYPE_RASTER;
+    if (name == "points")
+        return RSERVER_TYPE_POINTS;
+    if (name == "lines")
+        return RSERVER_TYPE_LINES;
+    if (name == "polygons")
+        return RSERVER_TYPE_POLYGONS;
+    if (name == "string")
+        return RSERVER_TYPE_STRING;
+    if (name == "plot")
+        return RSERVER_TYPE_PLOT;
+    throw ArgumentException("Unknown result type: " + name);
+}
+
+static auto get_result_type_name(char type) -> const char * {
+    switch (type) {
+        case RSERVER_TYPE_RASTER:
+            return "raster";
+        case RSERVER_TYPE_POINTS:
+            return "points";
+        case RSERVER_TYPE_LINES:
+            return "lines";
+        case RSERVER_TYPE_POLYGONS:
+            return "polygons";
+        case RSERVER_TYPE_STRING:
+            return "string";
+        case RSERVER_TYPE_PLOT:
+            return "plot";
+        default:
+            return "unknown";
+    }
+}
+
+static auto parse_raster_type(const std::string &name) -> GDALDataType {
+    const std::pair<const char *, GDALDataType> types[] = {
+            {"Byte",    GDT_Byte},
+            {"Int16",   GDT_Int16},
+            {"UInt16",  GDT_UInt16},
+            {"Int32",   GDT_Int32},
+            {"UInt32",  GDT_UInt32},
+            {"Float32", GDT_Float32},
+            {"Float64", GDT_Float64},
+    };
+    for (const auto &type : types) {
+        if (name == type.first)
+            return type.second;
+    }
+    throw ArgumentException("Unknown raster type: " + name);
+}
+
+/**
+ * Reads a mix file: one scenario per line with the weight, result type, number of raster and points sources and the
+ * path of the script, relative to the mix file. Empty lines and lines starting with # are skipped.
+ */
+static auto read_mix(const std::string &path) -> std::vector<Scenario> {
+    std::ifstream file(path);
+    if (!file)
+        throw ArgumentException("Cannot open mix file " + path);
+    const auto slash = path.rfind('/');
+    const std::string directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+
+    std::vector<Scenario> scenarios;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string first;
+        if (!(fields >> first) || first[0] == '#')
+            continue;
+
+        Scenario scenario;
+        std::string type;
+        std::string script_path;
+        scenario.weight = std::atof(first.c_str());
+        if (!(fields >> type >> scenario.raster_sources >> scenario.points_sources >> script_path))
+            throw ArgumentException("Invalid line in mix file " + path + ": " + line);
+        scenario.result_type = parse_result_type(type);
+        if (script_path[0] != '/')
+            script_path = directory + script_path;
+
+        std::ifstream script(script_path);
+        if (!script)
+            throw ArgumentException("Cannot open script " + script_path);
+        std::stringstream source;
+        source << script.rdbuf();
+        scenario.script = source.str();
+        scenarios.push_back(std::move(scenario));
+    }
+    if (scenarios.empty())
+        throw ArgumentException("Mix file " + path + " contains no scripts");
+    return scenarios;
+}
+
+/**
+ * The mix without a mix file: a raster, a points and a string result
+ */
+static auto get_default_mix() -> std::vector<Scenario> {
+    return {
+            {1, RSERVER_TYPE_RASTER, 1, 0, "mapping.loadRaster(0, mapping.qrect) * 2"},
+            {1, RSERVER_TYPE_POINTS, 0, 1, "mapping.loadPoints(0, mapping.qrect)"},
+            {1, RSERVER_TYPE_STRING, 1, 1, "r <- mapping.loadRaster(0, mapping.qrect)\n"
+                                          "p <- mapping.loadPoints(0, mapping.qrect)\n"
+                                          "paste(length(r), length(p))"},
+    };
+}
+
+template<typename T>
+static void fill_pixels(void *data, size_t width, size_t height) {
+    auto pixels = static_cast<T *>(data);
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++)
+            pixels[y * width + x] = static_cast<T>((x * 31 + y) % 100);
+    }
+}
+
+/**
+ * Answers source requests with synthetic data.
+ * Every distinct reply is serialized once and then shared by all requests.
+ */
+class SyntheticSources {
+    public:
+        explicit SyntheticSources(const LoadSettings &settings) : settings(settings) {
+        }
+
+        /**
+         * @return the payload of the reply to a source request
+         */
+        auto getReply(char type, const QueryRectangle &rect) -> const std::string & {
+            char key[256];
+            snprintf(key, sizeof(key), "%d %f %f %f %f %u %u", type, rect.x1, rect.y1, rect.x2, rect.y2,
+                     rect.xres, rect.yres);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            auto entry = replies.find(key);
+            if (entry != replies.end())
+                return entry->second;
+
+            BinaryWriteBuffer buffer;
+            if (type == RSERVER_TYPE_RASTER) {
+                auto raster = createRaster(rect);
+                buffer.write<GenericRaster &>(*raster, true);
+                return replies.emplace(key, MessageSocket::serialize(buffer)).first->second;
+            }
+            if (type == RSERVER_TYPE_POINTS) {
+                auto points = createPoints(rect);
+                buffer.write<PointCollection &>(*points, true);
+                return replies.emplace(key, MessageSocket::serialize(buffer)).first->second;
+            }
+            throw ArgumentException(std::string("The load generator has no ") + get_result_type_name(type) +
+                                    " sources");
+        }
+
+    private:
+        auto createRaster(const QueryRectangle &rect) -> std::unique_ptr<GenericRaster> {
+            // tiles and other requests with a resolution get rasters of that size
+            uint32_t width = settings.raster_width;
+            uint32_t height = settings.raster_height;
+            if (rect.restype == QueryResolution::Type::PIXELS && rect.xres > 0 && rect.yres > 0) {
+                width = rect.xres;
+                height = rect.yres;
+            }
+
+            Unit unit = Unit::unknown();
+            unit.setMinMax(0, 100);
+            DataDescription dd(settings.raster_type, unit);
+            dd.verify();
+            auto raster = GenericRaster::create(dd, SpatioTemporalReference(rect, rect), width, height,
+                                                GenericRaster::Representation::CPU);
+            void *pixels = raster->getDataForWriting();
+            switch (settings.raster_type) {
+                case GDT_Byte: fill_pixels<uint8_t>(pixels, width, height); break;
+                case GDT_Int16: fill_pixels<int16_t>(pixels, width, height); break;
+                case GDT_UInt16: fill_pixels<uint16_t>(pixels, width, height); break;
+                case GDT_Int32: fill_pixels<int32_t>(pixels, width, height); break;
+                case GDT_UInt32: fill_pixels<uint32_t>(pixels, width, height); break;
+                case GDT_Float32: fill_pixels<float>(pixels, width, height); break;
+                case GDT_Float64: fill_pixels<double>(pixels, width, height); break;
+                default: throw ArgumentException("Unsupported raster type");
+            }
+            return raster;
+        }
+
+        auto createPoints(const QueryRectangle &rect) -> std::unique_ptr<PointCollection> {
+            auto points = std::make_unique<PointCollection>(SpatioTemporalReference(rect, rect));
+            std::mt19937 random(42);
+            std::uniform_real_distribution<double> x(rect.x1, rect.x2);
+            std::uniform_real_distribution<double> y(rect.y1, rect.y2);
+            for (size_t i = 0; i < settings.points; i++)
+                points->addSinglePointFeature(Coordinate(x(random), y(random)));
+
+            for (size_t a = 0; a < settings.point_attributes; a++) {
+                auto &attribute = points->feature_attributes.addNumericAttribute("value" + std::to_string(a),
+                                                                                 Unit::unknown());
+                attribute.reserve(settings.points);
+                for (size_t i = 0; i < settings.points; i++)
+                    attribute.set(i, static_cast<double>((i + a) % 100));
+            }
+            return points;
+        }
+
+        const LoadSettings &settings;
+        std::mutex mutex;
+        std::map<std::string, std::string> replies;
+};
+
+/**
+ * Latencies of the requests of one result type
+ */
+class LatencyRecorder {
+    public:
+        /// upper bounds of the histogram buckets in seconds, the last bucket is +Inf
+        static constexpr double BUCKETS[] = {0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5, 10, 20,
+                                             60};
+        static const size_t BUCKET_COUNT = sizeof(BUCKETS) / sizeof(BUCKETS[0]);
+
+        void record(double seconds, bool failed) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (failed)
+                errors++;
+            else
+                latencies.push_back(seconds);
+        }
+
+        void recordError(const std::string &message) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (first_error.empty())
+                first_error = message;
+        }
+
+        /**
+         * Prints the throughput, percentiles and histogram of the successful requests
+         * @param name the result type
+         * @param elapsed the duration of the whole run in seconds
+         */
+        void print(const char *name, double elapsed) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (latencies.empty() && errors == 0)
+                return;
+            std::sort(latencies.begin(), latencies.end());
+
+            double sum = 0;
+            for (double latency : latencies)
+                sum += latency;
+            const size_t count = latencies.size();
+            printf("%s: %zu requests, %zu errors, %.1f requests/s\n", name, count, errors, count / elapsed);
+            if (count > 0) {
+                printf("  latency ms: mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+                       sum / count * 1000, percentile(0.5) * 1000, percentile(0.9) * 1000, percentile(0.99) * 1000,
+                       percentile(0.999) * 1000, latencies.back() * 1000);
+
+                size_t begin = 0;
+                for (size_t bucket = 0; bucket <= BUCKET_COUNT; bucket++) {
+                    size_t end = bucket < BUCKET_COUNT
+                                 ? std::upper_bound(latencies.begin(), latencies.end(), BUCKETS[bucket]) -
+                                   latencies.begin()
+                                 : count;
+                    if (end > begin) {
+                        char bound[32] = "+Inf";
+                        if (bucket < BUCKET_COUNT)
+                            snprintf(bound, sizeof(bound), "%g", BUCKETS[bucket] * 1000);
+                        printf("  <= %6s ms %8zu %5.1f%%\n", bound, end - begin, 100.0 * (end - begin) / count);
+                    }
+                    begin = end;
+                }
+            }
+            if (!first_error.empty())
+                printf("  first error: %s\n", first_error.c_str());
+        }
+
+    private:
+        auto percentile(double p) const -> double {
+            const auto index = static_cast<size_t>(std::ceil(p * latencies.size()));
+            return latencies[std::min(latencies.size(), std::max<size_t>(index, 1)) - 1];
+        }
+
+        std::mutex mutex;
+        std::vector<double> latencies;
+        size_t errors = 0;
+        std::string first_error;
+};
+
+constexpr double LatencyRecorder::BUCKETS[];
+
+/**
+ * Runs a single request like the r_script operator
+ * @throws on errors of the server or the connection
+ */
+static void run_request(const LoadSettings &settings, const Scenario &scenario, SyntheticSources &sources) {
+    auto stream = settings.socket.empty() ? BinaryStream::connectTCP(settings.host.c_str(), settings.port, true)
+                                          : BinaryStream::connectUNIX(settings.socket.c_str());
+
+    QueryRectangle qrect(
+            SpatialReference(CrsId::from_srs_string("EPSG:4326"), -180, -90, 180, 90),
+            TemporalReference(TIMETYPE_UNIX, 0, 1),
+            QueryResolution::pixels(settings.raster_width, settings.raster_height)
+    );
+
+    BinaryWriteBuffer header;
+    header.write<int>(RSERVER_MAGIC_NUMBER);
+    header.write<char>(scenario.result_type);
+    header.write<const std::string &>(scenario.script);
+    header.write<int>(scenario.raster_sources);
+    header.write<int>(scenario.points_sources);
+    header.write<int>(0);
+    header.write<int>(0);
+    header.write<const QueryRectangle &>(qrect);
+    header.write<int>(settings.timeout);
+    if (scenario.result_type == RSERVER_TYPE_PLOT) {
+        header.write<size_t>(settings.plot_width);
+        header.write<size_t>(settings.plot_height);
+    }
+    stream.write(header);
+
+    while (true) {
+        BinaryReadBuffer message;
+        stream.read(message);
+        auto type = message.read<char>();
+
+        if (type == -scenario.result_type)
+            return;
+        if (type == -RSERVER_TYPE_ERROR) {
+            std::string error;
+            message.read(&error);
+            throw OperatorException("Server: " + error);
+        }
+        if (type != RSERVER_TYPE_RASTER && type != RSERVER_TYPE_POINTS && type != RSERVER_TYPE_LINES &&
+            type != RSERVER_TYPE_POLYGONS)
+            throw NetworkException("Server sent an unexpected message of type " + std::to_string(type));
+
+        message.read<int>(); // the source index, all sources are alike
+        QueryRectangle rect(message);
+        const std::string &payload = sources.getReply(type, rect);
+
+        BinaryWriteBuffer reply;
+        reply.write(payload.data(), payload.size(), true);
+        stream.write(reply);
+    }
+}
+
+static auto parse_size(const std::string &text, uint32_t &width, uint32_t &height) -> void {
+    if (sscanf(text.c_str(), "%ux%u", &width, &height) != 2 || width == 0 || height == 0)
+        throw ArgumentException("Invalid size, expected WIDTHxHEIGHT: " + text);
+}
+
+static void print_usage() {
+    fprintf(stderr, "Usage: r_server_loadgen [options]\n"
+                    "  --host HOST            server host (127.0.0.1)\n"
+                    "  --port PORT            server port (10200)\n"
+                    "  --socket PATH          connect to a Unix domain socket instead\n"
+                    "  --mix FILE             weighted scripts, see docs/loadgen.md (a built-in mix)\n"
+                    "  --concurrency N        requests in flight, the maximum with --rate (4)\n"
+                    "  --rate R               start R requests per second instead of a fixed concurrency\n"
+                    "  --duration SECONDS     how long to send requests (10)\n"
+                    "  --requests N           stop after N requests instead\n"
+                    "  --raster-size WxH      size of the query rectangle and source rasters (512x512)\n"
+                    "  --raster-type TYPE     pixel type of source rasters (Float32)\n"
+                    "  --points N             features of points sources (10000)\n"
+                    "  --point-attributes N   numeric attributes of points sources (1)\n"
+                    "  --timeout SECONDS      timeout sent with every request (60)\n"
+                    "  --plot-size WxH        size of plot results (800x600)\n");
+}
+
+int main(int argc, char *argv[]) {
+    LoadSettings settings;
+    std::string mix;
+    try {
+        for (int i = 1; i < argc; i++) {
+            const std::string option = argv[i];
+            if (option == "--help") {
+                print_usage();
+                return 0;
+            }
+            if (i + 1 >= argc)
+                throw ArgumentException("Missing value for " + option);
+            const std::string value = argv[++i];
+            if (option == "--host")
+                settings.host = value;
+            else if (option == "--port")
+                settings.port = std::stoi(value);
+            else if (option == "--socket")
+                settings.socket = value;
+            else if (option == "--mix")
+                mix = value;
+            else if (option == "--concurrency")
+                settings.concurrency = std::max<size_t>(1, std::stoul(value));
+            else if (option == "--rate")
+                settings.rate = std::stod(value);
+            else if (option == "--duration")
+                settings.duration = std::stod(value);
+            else if (option == "--requests")
+                settings.requests = std::stoul(value);
+            else if (option == "--raster-size")
+                parse_size(value, settings.raster_width, settings.raster_height);
+            else if (option == "--raster-type")
+                settings.raster_type = parse_raster_type(value);
+            else if (option == "--points")
+                settings.points = std::stoul(value);
+            else if (option == "--point-attributes")
+                settings.point_attributes = std::stoul(value);
+            else if (option == "--timeout")
+                settings.timeout = std::stoi(value);
+            else if (option == "--plot-size") {
+                uint32_t width, height;
+                parse_size(value, width, height);
+                settings.plot_width = width;
+                settings.plot_height = height;
+            } else
+                throw ArgumentException("Unknown option " + option);
+        }
+        settings.scenarios = mix.empty() ? get_default_mix() : read_mix(mix);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "r_server_loadgen: %s\n", e.what());
+        print_usage();
+        return 1;
+    }
+
+    std::vector<double> weights;
+    for (const auto &scenario : settings.scenarios)
+        weights.push_back(scenario.weight);
+
+    SyntheticSources sources(settings);
+    std::map<char, LatencyRecorder> recorders;
+    for (const auto &scenario : settings.scenarios)
+        recorders[scenario.result_type];
+
+    const auto start = Clock::now();
+    const auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(
+            settings.duration));
+    std::atomic<size_t> next_request(0);
+
+    /*
+     * With a rate, request i is due at start + i / rate and its latency counts from then, so requests that wait for
+     * a free thread because the server is slow are measured with their waiting time.
+     */
+    auto run_thread = [&](unsigned seed) {
+        std::mt19937 random(seed);
+        std::discrete_distribution<size_t> choose(weights.begin(), weights.end());
+        while (true) {
+            const size_t index = next_request++;
+            if (settings.requests > 0 && index >= settings.requests)
+                return;
+
+            auto due = Clock::now();
+            if (settings.rate > 0)
+                due = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(
+                        index / settings.rate));
+            if (settings.requests == 0 && due >= end)
+                return;
+            std::this_thread::sleep_until(due);
+
+            const Scenario &scenario = settings.scenarios[choose(random)];
+            LatencyRecorder &recorder = recorders.at(scenario.result_type);
+            bool failed = false;
+            try {
+                run_request(settings, scenario, sources);
+            } catch (const std::exception &e) {
+                failed = true;
+                recorder.recordError(e.what());
+            }
+            recorder.record(std::chrono::duration<double>(Clock::now() - due).count(), failed);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < settings.concurrency; i++)
+        threads.emplace_back(run_thread, static_cast<unsigned>(i + 1));
+    for (auto &thread : threads)
+        thread.join();
+    const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    if (settings.rate > 0)
+        printf("rate %.1f requests/s, at most %zu in flight, %.1f s\n", settings.rate, settings.concurrency, elapsed);
+    else
+        printf("concurrency %zu, %.1f s\n", settings.concurrency, elapsed);
+    for (auto &recorder : recorders)
+        recorder.second.print(get_result_type_name(recorder.first), elapsed);
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "operators/processing/scripting/r_script.h"
+
+#include <cstdint>
+
+/*
+ * Extensions of the protocol between the r_script operator and the server, see docs/protocol.md.
+ *
+ * A client that supports any of them starts its request with `RSERVER_MAGIC_NUMBER_V2` followed by a `uint32_t` of
+ * capability flags. Everything else stays as in the original protocol, and the server only uses an extension if
+ * the client announced it.
+ */
+
+const int RSERVER_MAGIC_NUMBER_V2 = 0x52534532; // "RSE2"
+
+/**
+ * Several source requests in a single message, answered by one message per source in any order
+ */
+const char RSERVER_TYPE_BATCH = 20;
+
+/**
+ * A raster request that is answered by a header message followed by chunks of pixels
+ */
+const char RSERVER_TYPE_RASTER_STREAM = 21;
+
+/**
+ * The answer to a request that was not run because the server is overloaded, an error with a retry hint
+ */
+const char RSERVER_TYPE_OVERLOADED = 22;
+
+/**
+ * A feature result that is sent as a header message followed by chunks of features
+ */
+const char RSERVER_TYPE_FEATURE_STREAM = 23;
+
+namespace RServerCapabilities {
+    const uint32_t NONE = 0;
+    /// the client understands `RSERVER_TYPE_BATCH`
+    const uint32_t BATCH = 1u << 0;
+    /// the request header ends with an identifier for every declared source
+    const uint32_t SOURCE_IDS = 1u << 1;
+    /// the header opens a session that carries many tagged requests
+    const uint32_t MULTIPLEX = 1u << 2;
+    /// the header of a plot request ends with the image format and its quality
+    const uint32_t PLOT_FORMAT = 1u << 3;
+    /// the client understands `RSERVER_TYPE_RASTER_STREAM`
+    const uint32_t STREAMED_RASTERS = 1u << 4;
+    /// the server may send a raster or feature result in chunks
+    const uint32_t CHUNKED_RESULTS = 1u << 5;
+    /// the header ends with the codecs the client supports, the server answers with the one it chose
+    const uint32_t COMPRESSION = 1u << 6;
+    /// on a Unix domain socket, messages may be passed as memory files
+    const uint32_t FD_PAYLOADS = 1u << 7;
+    /// the client understands `RSERVER_TYPE_OVERLOADED`
+    const uint32_t OVERLOADED = 1u << 8;
+
+    /// all extensions this server implements
+    const uint32_t SUPPORTED = BATCH | SOURCE_IDS | MULTIPLEX | PLOT_FORMAT | STREAMED_RASTERS | CHUNKED_RESULTS |
+                               COMPRESSION | FD_PAYLOADS | OVERLOADED;
+}
+
+/**
+ * Message compression codecs. The header announces them as a bit mask with bit `1 << codec` set for each.
+ */
+namespace RServerCodecs {
+    const uint8_t NONE = 0;
+    const uint8_t LZ4 = 1;
+    const uint8_t ZSTD = 2;
+}
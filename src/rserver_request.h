@@ -0,0 +1,241 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+#include "util/binarystream.h"
+#include "util/log.h"
+
+#include "operators/processing/scripting/r_script.h"
+#include "operators/queryrectangle.h"
+
+#include "rserver_protocol.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * The header of a script request as sent by the client.
+ *
+ * It is parsed by the process that accepted the connection and handed to whichever process runs the script,
+ * so it can be serialized again in exactly the format it was received in.
+ */
+class RServerRequest {
+    public:
+        RServerRequest() : capabilities(RServerCapabilities::NONE),
+                           expected_result(-1),
+                           rastersourcecount(-1),
+                           pointssourcecount(-1),
+                           linessourcecount(-1),
+                           polygonssourcecount(-1),
+                           qrect(SpatialReference::unreferenced(),
+                                 TemporalReference::unreferenced(),
+                                 QueryResolution::none()),
+                           timeout(0),
+                           plot_width(0),
+                           plot_height(0),
+                           plot_quality(-1),
+                           compression_codecs(0) {
+        }
+
+        /**
+         * Parse a request header from the client
+         * @param request the first message of a connection
+         */
+        explicit RServerRequest(BinaryReadBuffer &request) : RServerRequest() {
+            auto magic = request.read<int>();
+            if (magic == RSERVER_MAGIC_NUMBER_V2)
+                capabilities = request.read<uint32_t>() & RServerCapabilities::SUPPORTED;
+            else if (magic != RSERVER_MAGIC_NUMBER)
+                throw PlatformException("Client sent the wrong magic number");
+            if (isSession())
+                return; // the requests follow as tagged messages
+            expected_result = request.read<char>();
+            request.read(&source);
+            rastersourcecount = request.read<int>();
+            pointssourcecount = request.read<int>();
+            linessourcecount = request.read<int>();
+            polygonssourcecount = request.read<int>();
+            qrect = QueryRectangle(request);
+
+            timeout = request.read<int>();
+
+            if (expected_result == RSERVER_TYPE_PLOT) {
+                plot_width = request.read<size_t>();
+                plot_height = request.read<size_t>();
+                if (hasCapability(RServerCapabilities::PLOT_FORMAT)) {
+                    request.read(&plot_format);
+                    plot_quality = request.read<int>();
+                }
+            }
+
+            if (hasCapability(RServerCapabilities::SOURCE_IDS)) {
+                const int source_count = rastersourcecount + pointssourcecount + linessourcecount +
+                                         polygonssourcecount;
+                source_ids.resize(static_cast<size_t>(std::max(source_count, 0)));
+                for (auto &source_id : source_ids)
+                    request.read(&source_id);
+            }
+
+            if (hasCapability(RServerCapabilities::COMPRESSION))
+                compression_codecs = request.read<uint8_t>();
+        }
+
+        /**
+         * Reads the capabilities of a header that was received as bytes, without parsing the rest of it
+         * @param header the payload of the first message of a connection
+         * @return the capabilities this server implements, `NONE` for a header of the original protocol
+         */
+        static auto peekCapabilities(const std::string &header) -> uint32_t {
+            int magic = 0;
+            if (header.size() >= sizeof(magic))
+                memcpy(&magic, header.data(), sizeof(magic));
+            if (magic == RSERVER_MAGIC_NUMBER)
+                return RServerCapabilities::NONE;
+            uint32_t capabilities;
+            if (magic != RSERVER_MAGIC_NUMBER_V2 || header.size() < sizeof(magic) + sizeof(capabilities))
+                throw PlatformException("Client sent the wrong magic number");
+            memcpy(&capabilities, header.data() + sizeof(magic), sizeof(capabilities));
+            return capabilities & RServerCapabilities::SUPPORTED;
+        }
+
+        /**
+         * Withdraws capabilities from a header that was received as bytes, e.g. because they cannot be used on the
+         * connection the request is served on
+         */
+        static void removeCapabilities(std::string &header, uint32_t removed) {
+            if (peekCapabilities(header) == RServerCapabilities::NONE)
+                return;
+            uint32_t capabilities;
+            memcpy(&capabilities, &header[sizeof(int)], sizeof(capabilities));
+            capabilities &= ~removed;
+            memcpy(&header[sizeof(int)], &capabilities, sizeof(capabilities));
+        }
+
+        /**
+         * @return whether this header opens a multiplexed session instead of describing a request
+         */
+        bool isSession() const {
+            return hasCapability(RServerCapabilities::MULTIPLEX);
+        }
+
+        void log() const {
+            Log::info("Requested type: %d", expected_result);
+            Log::info("Requested counts: %d %d %d %d", rastersourcecount, pointssourcecount, linessourcecount,
+                      polygonssourcecount);
+            Log::info("rectangle is rect (%f,%f -> %f,%f)", qrect.x1, qrect.y1, qrect.x2, qrect.y2);
+            if (capabilities != RServerCapabilities::NONE)
+                Log::info("Client capabilities: %#x", capabilities);
+        }
+
+        /**
+         * Serialize the header in the same format the client sent it
+         * @param buffer
+         */
+        void serialize(BinaryWriteBuffer &buffer) const {
+            if (capabilities != RServerCapabilities::NONE) {
+                buffer.write<int>(RSERVER_MAGIC_NUMBER_V2);
+                buffer.write<uint32_t>(capabilities);
+            } else {
+                buffer.write<int>(RSERVER_MAGIC_NUMBER);
+            }
+            if (isSession())
+                return;
+            buffer.write<char>(expected_result);
+            buffer.write<const std::string &>(source);
+            buffer.write<int>(rastersourcecount);
+            buffer.write<int>(pointssourcecount);
+            buffer.write<int>(linessourcecount);
+            buffer.write<int>(polygonssourcecount);
+            buffer.write<const QueryRectangle &>(qrect);
+            buffer.write<int>(timeout);
+
+            if (expected_result == RSERVER_TYPE_PLOT) {
+                buffer.write<size_t>(plot_width);
+                buffer.write<size_t>(plot_height);
+                if (hasCapability(RServerCapabilities::PLOT_FORMAT)) {
+                    buffer.write<const std::string &>(plot_format);
+                    buffer.write<int>(plot_quality);
+                }
+            }
+
+            if (hasCapability(RServerCapabilities::SOURCE_IDS)) {
+                for (const auto &source_id : source_ids)
+                    buffer.write<const std::string &>(source_id);
+            }
+
+            if (hasCapability(RServerCapabilities::COMPRESSION))
+                buffer.write<uint8_t>(compression_codecs);
+        }
+
+        /**
+         * @return whether the client can decode messages compressed with a codec
+         */
+        bool supportsCodec(uint8_t codec) const {
+            return hasCapability(RServerCapabilities::COMPRESSION) && codec < 8 &&
+                   (compression_codecs & (1u << codec)) != 0;
+        }
+
+        bool hasCapability(uint32_t capability) const {
+            return (capabilities & capability) != 0;
+        }
+
+        /**
+         * @return the identifier the client assigned to a source or an empty string if it sent none
+         */
+        auto getSourceId(char type, int childidx) const -> std::string {
+            const int counts[] = {rastersourcecount, pointssourcecount, linessourcecount, polygonssourcecount};
+            const char types[] = {RSERVER_TYPE_RASTER, RSERVER_TYPE_POINTS, RSERVER_TYPE_LINES, RSERVER_TYPE_POLYGONS};
+
+            size_t index = 0;
+            for (size_t i = 0; i < 4; i++) {
+                if (types[i] == type) {
+                    if (childidx < 0 || childidx >= counts[i])
+                        return "";
+                    index += static_cast<size_t>(childidx);
+                    return index < source_ids.size() ? source_ids[index] : "";
+                }
+                index += static_cast<size_t>(std::max(counts[i], 0));
+            }
+            return "";
+        }
+
+        /// the extensions announced by the client that this server implements
+        uint32_t capabilities;
+        std::string source;
+        char expected_result;
+        int rastersourcecount;
+        int pointssourcecount;
+        int linessourcecount;
+        int polygonssourcecount;
+        QueryRectangle qrect;
+        int timeout;
+        /// one per declared source in the order rasters, points, lines, polygons
+        std::vector<std::string> source_ids;
+
+        size_t plot_width;
+        size_t plot_height;
+        /// empty and negative for the configured defaults
+        std::string plot_format;
+        int plot_quality;
+
+        /// bit `1 << codec` is set for every codec in `RServerCodecs` the client supports
+        uint8_t compression_codecs;
+};
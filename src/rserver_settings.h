@@ -0,0 +1,181 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/configuration.h"
+#include "util/exceptions.h"
+
+#include "message_codec.h"
+#include "request_trace.h"
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * How requests are executed
+ */
+enum class RServerMode {
+    FORKED, // a fresh child is forked for every request
+    POOLED, // pre-forked workers serve one request after another, connections may be multiplexed
+    THREADED // a single thread runs one request after another
+};
+
+/**
+ * The `rserver.*` configuration. It is read once at startup, so forked children and pool workers share it.
+ * See docs/configuration.md for the meaning of the keys.
+ */
+struct RServerSettings {
+    static auto fromConfiguration() -> RServerSettings {
+        RServerSettings settings;
+        settings.loglevel = Configuration::get<std::string>("rserver.loglevel", "info");
+        settings.packages = Configuration::getVector<std::string>("rserver.packages");
+
+        settings.port = Configuration::get<int>("rserver.port");
+        settings.socket = Configuration::get<std::string>("rserver.socket", "");
+        settings.socket_min_payload = getSize("rserver.socket_min_payload", 64 * 1024);
+
+        settings.pool_workers = getSize("rserver.pool.workers", 0);
+
+        // setting pool workers selected the pooled mode before there was a mode
+        auto mode = Configuration::get<std::string>("rserver.mode", settings.pool_workers > 0 ? "pooled" : "forked");
+        if (mode == "forked")
+            settings.mode = RServerMode::FORKED;
+        else if (mode == "pooled")
+            settings.mode = RServerMode::POOLED;
+        else if (mode == "threaded")
+            settings.mode = RServerMode::THREADED;
+        else
+            throw ArgumentException("Unknown rserver.mode: " + mode);
+
+        if (settings.mode == RServerMode::POOLED && settings.pool_workers == 0)
+            settings.pool_workers = std::max(1u, std::thread::hardware_concurrency());
+
+        settings.admission_max_concurrent = getSize("rserver.admission.max_concurrent", 0);
+        settings.admission_max_queue = getSize("rserver.admission.max_queue", 64);
+
+        settings.pool_max_requests = getSize("rserver.pool.max_requests", 100);
+        settings.pool_max_memory = getSize("rserver.pool.max_memory", 0);
+
+        settings.limit_address_space = getSize("rserver.limits.address_space", 0);
+        settings.limit_memory = getSize("rserver.limits.memory", 0);
+        settings.limit_cpu_time = getSize("rserver.limits.cpu_time", 0);
+        settings.limit_temp_files = getSize("rserver.limits.temp_files", 0);
+        settings.limit_cgroup = Configuration::get<std::string>("rserver.limits.cgroup", "");
+
+        settings.feature_representation = Configuration::get<std::string>("rserver.feature_representation", "sp");
+        settings.prefetch = Configuration::get<bool>("rserver.prefetch", false);
+        settings.tile_lookahead = getSize("rserver.tiles.lookahead", 2);
+
+        // a chunk without any pixels or coordinates would never finish a result
+        settings.chunk_size = getSize("rserver.chunk_size", 1024, 1) * 1024;
+
+        settings.compression_codec = MessageCodec::parse(
+                Configuration::get<std::string>("rserver.compression.codec", "none"));
+        if (!MessageCodec::isAvailable(settings.compression_codec))
+            throw ArgumentException(std::string("rserver.compression.codec: this build does not support ") +
+                                    MessageCodec::getName(settings.compression_codec));
+        settings.compression_level = Configuration::get<int>("rserver.compression.level", 1);
+        settings.compression_min_size = getSize("rserver.compression.min_size", 4096);
+        settings.compression_max_size = getSize("rserver.compression.max_size", 1024) * 1024 * 1024;
+
+        settings.plot_format = Configuration::get<std::string>("rserver.plot.format", "png");
+        settings.plot_quality = Configuration::get<int>("rserver.plot.quality", 75);
+
+        settings.script_cache_size = getSize("rserver.script_cache.size", 32);
+        settings.script_cache_compile = Configuration::get<bool>("rserver.script_cache.compile", false);
+        // a forked child compiles for itself only, so every request would compile its script again
+        if (settings.mode == RServerMode::FORKED)
+            settings.script_cache_compile = false;
+
+        settings.cache_size = getSize("rserver.cache.size", 0);
+        settings.cache_spill_directory = Configuration::get<std::string>("rserver.cache.spill_directory", "");
+        settings.cache_spill_size = getSize("rserver.cache.spill_size", 0);
+
+        settings.metrics_port = Configuration::get<int>("rserver.metrics.port", 0);
+
+        settings.trace_sample_rate = Configuration::get<double>("rserver.trace.sample_rate", 0.0);
+        settings.trace_directory = Configuration::get<std::string>("rserver.trace.directory", "/tmp");
+        settings.trace_format = RequestTrace::parseFormat(Configuration::get<std::string>("rserver.trace.format",
+                                                                                          "jsonl"));
+
+        return settings;
+    }
+
+    /**
+     * Reads a size or count, which the configuration only offers as `int`
+     * @param minimum the smallest valid value, not below 0
+     * @throws ArgumentException if the value is below `minimum`
+     */
+    static auto getSize(const std::string &key, int default_value, int minimum = 0) -> size_t {
+        const int value = Configuration::get<int>(key, default_value);
+        if (value < minimum)
+            throw ArgumentException(minimum == 0 ? key + " must not be negative"
+                                                 : key + " must be at least " + std::to_string(minimum));
+        return static_cast<size_t>(value);
+    }
+
+    std::string loglevel = "info";
+    std::vector<std::string> packages; // loaded once at startup, before any request
+
+    int port = 0;
+    std::string socket; // path of a Unix domain socket to listen on as well, empty for none
+    size_t socket_min_payload = 64 * 1024; // bytes
+    RServerMode mode = RServerMode::FORKED;
+
+    size_t admission_max_concurrent = 0; // 0 = a child for every request right away
+    size_t admission_max_queue = 64;
+
+    size_t pool_workers = 0;
+    size_t pool_max_requests = 100;
+    size_t pool_max_memory = 0;
+
+    size_t limit_address_space = 0; // MB, 0 = none
+    size_t limit_memory = 0; // MB, 0 = none
+    size_t limit_cpu_time = 0; // seconds, 0 = none
+    size_t limit_temp_files = 0; // MB, 0 = none
+    std::string limit_cgroup; // cgroup v2 directory for the memory limit, empty to use setrlimit()
+
+    std::string feature_representation = "sp";
+    bool prefetch = false;
+    size_t tile_lookahead = 2;
+
+    size_t chunk_size = 1024 * 1024; // bytes
+
+    uint8_t compression_codec = RServerCodecs::NONE;
+    int compression_level = 1;
+    size_t compression_min_size = 4096; // bytes
+    size_t compression_max_size = 1024 * 1024 * 1024; // bytes
+
+    std::string plot_format = "png";
+    int plot_quality = 75;
+
+    size_t script_cache_size = 32;
+    bool script_cache_compile = false;
+
+    size_t cache_size = 0;
+    std::string cache_spill_directory;
+    size_t cache_spill_size = 0;
+
+    int metrics_port = 0; // 0 = no metrics endpoint
+
+    double trace_sample_rate = 0; // fraction of requests to trace
+    std::string trace_directory = "/tmp";
+    RequestTrace::Format trace_format = RequestTrace::Format::JSON_LINES;
+};
@@ -0,0 +1,215 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <Rcpp.h>
+#include <R_ext/Parse.h>
+
+#include "util/exceptions.h"
+#include "util/log.h"
+
+#include "request_trace.h"
+#include "server_metrics.h"
+
+#include <string>
+#include <unordered_map>
+
+/**
+ * A cache of parsed and optionally byte-compiled scripts.
+ *
+ * In forked mode the parent parses the script of a request before it forks, so the child inherits the parsed
+ * expressions and only evaluates them; the lookup is counted once, by the parent. Byte-compiling is done by
+ * `evaluate` in the process that runs the script, so it only pays off where that process keeps its cache, i.e. in
+ * the threaded mode and in pool workers, which keep their own cache across requests. `RServerSettings` turns it off
+ * in forked mode.
+ * The least recently used script is dropped once the cache is full.
+ */
+class ScriptCache {
+    public:
+        struct Stats {
+            size_t entries;
+            uint64_t hits;
+            uint64_t misses;
+        };
+
+        /**
+         * @param capacity number of scripts to keep (0 = parse every script again)
+         * @param compile whether to byte-compile the expressions with the `compiler` package
+         * @param metrics receives the lookups and the size of the cache, or `nullptr`
+         */
+        ScriptCache(size_t capacity, bool compile, ServerMetrics *metrics)
+                : capacity(capacity), compile(compile), clock(0), hits(0), misses(0), metrics(metrics) {
+        }
+
+        /**
+         * Parse a script and add it to the cache without compiling it.
+         * Errors are left to `evaluate`, which reports them to the client.
+         */
+        void prepare(const std::string &source) {
+            prepared = source;
+            try {
+                lookup(source, false, true);
+            } catch (const std::exception &e) {
+                Log::debug("Could not prepare script: %s", e.what());
+            }
+        }
+
+        /**
+         * Evaluate all expressions of a script in the global environment, each one in its own trace span
+         * @return the value of the last expression
+         */
+        auto evaluate(const std::string &source) -> Rcpp::RObject {
+            // a script that was prepared in this process or the parent was counted then
+            const bool counted = source == prepared;
+            prepared.clear();
+            Rcpp::List expressions = lookup(source, true, !counted);
+            logStats();
+
+            TraceSpan span("running R script");
+            span.arg("expressions", expressions.size());
+            Rcpp::RObject result;
+            Rcpp::Environment global = Rcpp::Environment::global_env();
+            for (R_xlen_t i = 0; i < expressions.size(); i++) {
+                TraceSpan expression("evaluating R expression");
+                expression.arg("index", i);
+                result = Rcpp::Rcpp_eval(VECTOR_ELT(expressions, i), global);
+            }
+            return result;
+        }
+
+        auto getStats() const -> Stats {
+            return Stats{entries.size(), hits, misses};
+        }
+
+        void logStats() const {
+            const uint64_t lookups = hits + misses;
+            Log::info("Script cache: %zu scripts, %.1f%% hit rate", entries.size(),
+                      lookups > 0 ? 100.0 * hits / lookups : 0.0);
+        }
+
+    private:
+        struct Entry {
+            Rcpp::List expressions;
+            bool compiled;
+            uint64_t last_use;
+        };
+
+        /**
+         * @param compiled whether the expressions are needed byte-compiled, if compiling is enabled
+         * @param count whether to count the lookup as a hit or miss
+         */
+        auto lookup(const std::string &source, bool compiled, bool count) -> Rcpp::List {
+            const bool needs_compile = compiled && compile;
+            auto entry = entries.find(source);
+            if (entry != entries.end()) {
+                if (count)
+                    countLookup(true);
+                entry->second.last_use = ++clock;
+            } else {
+                if (count)
+                    countLookup(false);
+                Rcpp::List expressions = parse(source);
+                if (capacity == 0)
+                    return needs_compile ? compileExpressions(expressions) : expressions;
+
+                if (entries.size() >= capacity) {
+                    auto oldest = entries.begin();
+                    for (auto it = entries.begin(); it != entries.end(); ++it) {
+                        if (it->second.last_use < oldest->second.last_use)
+                            oldest = it;
+                    }
+                    entries.erase(oldest);
+                }
+                entry = entries.emplace(source, Entry{expressions, false, ++clock}).first;
+                if (metrics != nullptr)
+                    metrics->setScriptCacheEntries(entries.size());
+            }
+
+            if (needs_compile && !entry->second.compiled) {
+                entry->second.expressions = compileExpressions(entry->second.expressions);
+                entry->second.compiled = true;
+            }
+            return entry->second.expressions;
+        }
+
+        /**
+         * @return a list of the top level expressions
+         */
+        auto parse(const std::string &source) -> Rcpp::List {
+            TraceSpan span("parsing R script");
+
+            Log::debug("src: %s", source.c_str());
+            ParseStatus status;
+            Rcpp::Shield<SEXP> text(Rf_mkString(source.c_str()));
+            Rcpp::Shield<SEXP> parsed(R_ParseVector(text, -1, &status, R_NilValue));
+            if (status != PARSE_OK)
+                throw OperatorException("R script could not be parsed: " + getParseError(source));
+
+            const R_xlen_t count = Rf_xlength(parsed);
+            Rcpp::List expressions(count);
+            for (R_xlen_t i = 0; i < count; i++)
+                expressions[i] = VECTOR_ELT(parsed, i);
+            return expressions;
+        }
+
+        /**
+         * Parses a script that `R_ParseVector` rejected again with R's `parse`, whose error names the line, the
+         * column and the unexpected token
+         */
+        static auto getParseError(const std::string &source) -> std::string {
+            try {
+                Rcpp::Function parse_text("parse");
+                parse_text(Rcpp::Named("text") = source, Rcpp::Named("keep.source") = false);
+            } catch (const std::exception &e) {
+                return e.what();
+            }
+            return "unknown error";
+        }
+
+        void countLookup(bool hit) {
+            if (hit)
+                hits++;
+            else
+                misses++;
+            if (metrics != nullptr)
+                metrics->addScriptCacheLookup(hit);
+        }
+
+        /**
+         * @return a new list of the expressions, byte-compiled with the `compiler` package
+         */
+        auto compileExpressions(const Rcpp::List &parsed) -> Rcpp::List {
+            TraceSpan span("compiling R script");
+
+            Rcpp::Environment compiler = Rcpp::Environment::namespace_env("compiler");
+            Rcpp::Function compile_expression = compiler["compile"];
+            Rcpp::List expressions(parsed.size());
+            for (R_xlen_t i = 0; i < parsed.size(); i++)
+                expressions[i] = compile_expression(parsed[i]);
+            return expressions;
+        }
+
+        size_t capacity;
+        bool compile;
+        uint64_t clock;
+        uint64_t hits;
+        uint64_t misses;
+        ServerMetrics *metrics;
+        std::string prepared; // the script `prepare` was last called for, until it is evaluated
+        std::unordered_map<std::string, Entry> entries;
+};
@@ -0,0 +1,597 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+#include "util/log.h"
+
+#include "message_codec.h"
+#include "rserver_protocol.h"
+#include "source_cache.h"
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+/**
+ * The phases a request spends its time in. Each phase is measured exclusively, e.g. the time R waits for a source
+ * counts as `SOURCES` and not as `EVALUATION`.
+ */
+enum class RequestPhase {
+    DISPATCH, // from the arrival of the header until a process runs the request, including the fork in forked mode
+    SOURCES, // requesting sources from the client and waiting for them, or reading them from the cache
+    EVALUATION, // running the script, without the time spent in the other phases on its behalf
+    CONVERSION, // converting sources to R objects and the result back
+    SENDING, // sending the result
+    COUNT
+};
+
+/**
+ * The resources a request may be limited in, see `ResourceLimits`
+ */
+enum class ResourceLimit {
+    ADDRESS_SPACE, // virtual memory
+    MEMORY, // resident memory, or the data segment where cgroups are not available
+    CPU_TIME,
+    TEMP_FILES, // the size of the temporary directory of the request
+    COUNT
+};
+
+/**
+ * Measures how long a request spends in each phase.
+ *
+ * The timer is always in exactly one phase. `PhaseScope` switches to another phase and back, so nested scopes charge
+ * their time only to the innermost phase.
+ */
+class RequestTimer {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        /**
+         * @param phase the phase the request starts in
+         */
+        explicit RequestTimer(RequestPhase phase) : phase(phase), start(Clock::now()), switched(start), seconds{} {
+        }
+
+        /**
+         * Charges the time since the last switch to the current phase and switches to another one
+         * @return the previous phase
+         */
+        auto enter(RequestPhase next) -> RequestPhase {
+            const auto now = Clock::now();
+            seconds[static_cast<size_t>(phase)] += std::chrono::duration<double>(now - switched).count();
+            switched = now;
+            RequestPhase previous = phase;
+            phase = next;
+            return previous;
+        }
+
+        /**
+         * @return the seconds spent in a phase so far
+         */
+        auto getSeconds(RequestPhase of) const -> double {
+            double total = seconds[static_cast<size_t>(of)];
+            if (of == phase)
+                total += std::chrono::duration<double>(Clock::now() - switched).count();
+            return total;
+        }
+
+        /**
+         * @return the seconds since the timer was created
+         */
+        auto getTotalSeconds() const -> double {
+            return std::chrono::duration<double>(Clock::now() - start).count();
+        }
+
+    private:
+        RequestPhase phase;
+        Clock::time_point start;
+        Clock::time_point switched;
+        double seconds[static_cast<size_t>(RequestPhase::COUNT)];
+};
+
+/**
+ * Charges the time of a scope to a phase
+ */
+class PhaseScope {
+    public:
+        PhaseScope(RequestTimer &timer, RequestPhase phase) : timer(timer), previous(timer.enter(phase)) {
+        }
+
+        ~PhaseScope() {
+            timer.enter(previous);
+        }
+
+        PhaseScope(const PhaseScope &) = delete;
+        PhaseScope &operator=(const PhaseScope &) = delete;
+
+    private:
+        RequestTimer &timer;
+        RequestPhase previous;
+};
+
+/**
+ * Counters and latency histograms of all requests, shared by all processes forked from the server.
+ *
+ * Like the source cache, the parent creates them in a shared memory file before it forks, so forked children and pool
+ * workers add to the same values. They are plain atomics, so recording never blocks and a child that is killed
+ * cannot leave anything locked. `format()` renders them in the Prometheus text exposition format, which
+ * `MetricsEndpoint` serves over HTTP.
+ */
+class ServerMetrics {
+    public:
+        /// upper bounds of the histogram buckets in seconds, the last bucket is +Inf
+        static constexpr double BUCKETS[] = {0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60};
+        static const size_t BUCKET_COUNT = sizeof(BUCKETS) / sizeof(BUCKETS[0]);
+
+        ServerMetrics() {
+            fd = memfd_create("rserver-metrics", 0);
+            if (fd < 0)
+                throw PlatformException(std::string("memfd_create() failed: ") + strerror(errno));
+            if (ftruncate(fd, static_cast<off_t>(sizeof(Shared))) != 0)
+                throw PlatformException(std::string("ftruncate() failed: ") + strerror(errno));
+
+            void *memory = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (memory == MAP_FAILED)
+                throw PlatformException(std::string("mmap() failed: ") + strerror(errno));
+            shared = new(memory) Shared();
+        }
+
+        ~ServerMetrics() {
+            munmap(shared, sizeof(Shared));
+            ::close(fd);
+        }
+
+        ServerMetrics(const ServerMetrics &) = delete;
+        ServerMetrics &operator=(const ServerMetrics &) = delete;
+
+        void observeDispatch(double seconds) {
+            observe(shared->phases[static_cast<size_t>(RequestPhase::DISPATCH)], seconds);
+        }
+
+        /**
+         * Records a finished request
+         * @param type the expected result type of the request
+         * @param timer the phases of the request, except for the dispatch
+         * @param failed whether the request ended with an error
+         */
+        void observeRequest(char type, const RequestTimer &timer, bool failed) {
+            add(shared->requests[getTypeIndex(type)], 1);
+            if (failed)
+                add(shared->errors, 1);
+            for (size_t phase = static_cast<size_t>(RequestPhase::SOURCES);
+                 phase < static_cast<size_t>(RequestPhase::COUNT); phase++)
+                observe(shared->phases[phase], timer.getSeconds(static_cast<RequestPhase>(phase)));
+            observe(shared->requests_duration, timer.getTotalSeconds());
+        }
+
+        /**
+         * @param received bytes of messages from the client
+         * @param sent bytes of messages to the client
+         */
+        void addBytes(uint64_t received, uint64_t sent) {
+            add(shared->received_bytes, received);
+            add(shared->sent_bytes, sent);
+        }
+
+        void addCompression(const MessageCodec::Stats &stats) {
+            add(shared->compression_messages, stats.messages);
+            add(shared->compression_compressed_messages, stats.compressed_messages);
+            add(shared->compression_raw_bytes, stats.raw_bytes);
+            add(shared->compression_compressed_bytes, stats.compressed_bytes);
+            add(shared->compression_time_us, stats.compress_time_us + stats.decompress_time_us);
+        }
+
+        void addScriptCacheLookup(bool hit) {
+            add(hit ? shared->script_cache_hits : shared->script_cache_misses, 1);
+        }
+
+        /**
+         * Publishes the number of cached scripts of the process that looked up a script last
+         */
+        void setScriptCacheEntries(size_t entries) {
+            shared->script_cache_entries.store(entries, std::memory_order_relaxed);
+        }
+
+        /**
+         * Publishes the state of the worker pool, which only the parent knows
+         */
+        void setPoolStats(size_t workers, size_t idle_workers, size_t queue_depth, size_t recycled_workers,
+                          size_t sessions) {
+            shared->pool_workers.store(workers, std::memory_order_relaxed);
+            shared->pool_idle_workers.store(idle_workers, std::memory_order_relaxed);
+            shared->pool_queue_depth.store(queue_depth, std::memory_order_relaxed);
+            shared->pool_recycled_workers.store(recycled_workers, std::memory_order_relaxed);
+            shared->pool_sessions.store(sessions, std::memory_order_relaxed);
+            shared->pooled.store(true, std::memory_order_relaxed);
+        }
+
+        /**
+         * Publishes the state of the admission control in forked mode, which only the parent knows
+         * @param rejected requests rejected so far because the queue was full
+         * @param expired requests given up so far because they could not finish before their timeout
+         */
+        void setAdmissionStats(size_t running, size_t queued, size_t rejected, size_t expired) {
+            shared->admission_running.store(running, std::memory_order_relaxed);
+            shared->admission_queued.store(queued, std::memory_order_relaxed);
+            shared->admission_rejected.store(rejected, std::memory_order_relaxed);
+            shared->admission_expired.store(expired, std::memory_order_relaxed);
+            shared->admission.store(true, std::memory_order_relaxed);
+        }
+
+        /**
+         * Counts a request that hit a resource limit. Safe to call from a signal handler.
+         */
+        void addLimitBreach(ResourceLimit limit) {
+            add(shared->limit_breaches[static_cast<size_t>(limit)], 1);
+        }
+
+        /**
+         * @return the label of a resource limit, e.g. cpu_time
+         */
+        static auto getLimitName(ResourceLimit limit) -> const char * {
+            return LIMIT_NAMES[static_cast<size_t>(limit)];
+        }
+
+        /**
+         * @return the label of an expected result type, e.g. raster
+         */
+        static auto getTypeName(char type) -> const char * {
+            return TYPE_NAMES[getTypeIndex(type)];
+        }
+
+        /**
+         * @param cache the shared source cache or `nullptr`
+         * @return all metrics in the Prometheus text exposition format
+         */
+        auto format(SourceCache *cache) const -> std::string {
+            std::string out;
+            writeHeader(out, "rserver_requests_total", "counter", "Finished requests by expected result type.");
+            for (size_t i = 0; i < TYPE_COUNT; i++)
+                writeValue(out, "rserver_requests_total", std::string("type=\"") + TYPE_NAMES[i] + "\"",
+                           load(shared->requests[i]));
+            writeHeader(out, "rserver_request_errors_total", "counter", "Requests that ended with an error.");
+            writeValue(out, "rserver_request_errors_total", "", load(shared->errors));
+
+            writeHeader(out, "rserver_request_duration_seconds", "histogram",
+                        "Time from the start of a request until its result is sent.");
+            writeHistogram(out, "rserver_request_duration_seconds", "", shared->requests_duration);
+            writeHeader(out, "rserver_phase_duration_seconds", "histogram",
+                        "Time a request spends in each phase, see docs/metrics.md.");
+            for (size_t phase = 0; phase < static_cast<size_t>(RequestPhase::COUNT); phase++)
+                writeHistogram(out, "rserver_phase_duration_seconds",
+                               std::string("phase=\"") + PHASE_NAMES[phase] + "\"", shared->phases[phase]);
+
+            writeHeader(out, "rserver_received_bytes_total", "counter", "Bytes of messages from clients.");
+            writeValue(out, "rserver_received_bytes_total", "", load(shared->received_bytes));
+            writeHeader(out, "rserver_sent_bytes_total", "counter", "Bytes of messages to clients.");
+            writeValue(out, "rserver_sent_bytes_total", "", load(shared->sent_bytes));
+
+            writeHeader(out, "rserver_compression_messages_total", "counter",
+                        "Messages sent on compressed connections.");
+            writeValue(out, "rserver_compression_messages_total", "", load(shared->compression_messages));
+            writeHeader(out, "rserver_compression_compressed_messages_total", "counter",
+                        "Messages sent compressed on compressed connections.");
+            writeValue(out, "rserver_compression_compressed_messages_total", "",
+                       load(shared->compression_compressed_messages));
+            writeHeader(out, "rserver_compression_raw_bytes_total", "counter",
+                        "Bytes of compressed connections before compression.");
+            writeValue(out, "rserver_compression_raw_bytes_total", "", load(shared->compression_raw_bytes));
+            writeHeader(out, "rserver_compression_compressed_bytes_total", "counter",
+                        "Bytes of compressed connections as sent.");
+            writeValue(out, "rserver_compression_compressed_bytes_total", "",
+                       load(shared->compression_compressed_bytes));
+            writeHeader(out, "rserver_compression_seconds_total", "counter",
+                        "Time spent compressing and decompressing messages.");
+            writeValue(out, "rserver_compression_seconds_total", "", load(shared->compression_time_us) / 1e6);
+
+            writeHeader(out, "rserver_script_cache_lookups_total", "counter", "Script cache lookups by result.");
+            writeValue(out, "rserver_script_cache_lookups_total", "result=\"hit\"", load(shared->script_cache_hits));
+            writeValue(out, "rserver_script_cache_lookups_total", "result=\"miss\"",
+                       load(shared->script_cache_misses));
+            writeHeader(out, "rserver_script_cache_entries", "gauge", "Cached scripts.");
+            writeValue(out, "rserver_script_cache_entries", "", load(shared->script_cache_entries));
+
+            if (shared->pooled.load(std::memory_order_relaxed)) {
+                writeHeader(out, "rserver_pool_workers", "gauge", "Workers of the pool.");
+                writeValue(out, "rserver_pool_workers", "", load(shared->pool_workers));
+                writeHeader(out, "rserver_pool_idle_workers", "gauge", "Workers waiting for a request.");
+                writeValue(out, "rserver_pool_idle_workers", "", load(shared->pool_idle_workers));
+                writeHeader(out, "rserver_pool_queue_depth", "gauge", "Requests waiting for a worker.");
+                writeValue(out, "rserver_pool_queue_depth", "", load(shared->pool_queue_depth));
+                writeHeader(out, "rserver_pool_recycled_workers_total", "counter", "Workers that were replaced.");
+                writeValue(out, "rserver_pool_recycled_workers_total", "", load(shared->pool_recycled_workers));
+                writeHeader(out, "rserver_pool_sessions", "gauge", "Open multiplexed sessions.");
+                writeValue(out, "rserver_pool_sessions", "", load(shared->pool_sessions));
+            }
+
+            writeHeader(out, "rserver_limit_breaches_total", "counter",
+                        "Requests that hit a resource limit, by limit.");
+            for (size_t limit = 0; limit < static_cast<size_t>(ResourceLimit::COUNT); limit++)
+                writeValue(out, "rserver_limit_breaches_total", std::string("limit=\"") + LIMIT_NAMES[limit] + "\"",
+                           load(shared->limit_breaches[limit]));
+
+            if (shared->admission.load(std::memory_order_relaxed)) {
+                writeHeader(out, "rserver_admission_running", "gauge", "Requests running in forked children.");
+                writeValue(out, "rserver_admission_running", "", load(shared->admission_running));
+                writeHeader(out, "rserver_admission_queue_depth", "gauge", "Requests waiting for a free slot.");
+                writeValue(out, "rserver_admission_queue_depth", "", load(shared->admission_queued));
+                writeHeader(out, "rserver_admission_rejected_total", "counter",
+                            "Requests answered with an error instead of running, by reason.");
+                writeValue(out, "rserver_admission_rejected_total", "reason=\"queue_full\"",
+                           load(shared->admission_rejected));
+                writeValue(out, "rserver_admission_rejected_total", "reason=\"deadline\"",
+                           load(shared->admission_expired));
+            }
+
+            if (cache != nullptr) {
+                auto stats = cache->getStats();
+                writeHeader(out, "rserver_source_cache_lookups_total", "counter", "Source cache lookups by result.");
+                writeValue(out, "rserver_source_cache_lookups_total", "result=\"hit\"", stats.hits);
+                writeValue(out, "rserver_source_cache_lookups_total", "result=\"disk_hit\"", stats.disk_hits);
+                writeValue(out, "rserver_source_cache_lookups_total", "result=\"miss\"", stats.misses);
+                writeHeader(out, "rserver_source_cache_evictions_total", "counter",
+                            "Entries evicted from memory, including spilled ones.");
+                writeValue(out, "rserver_source_cache_evictions_total", "", stats.evictions);
+                writeHeader(out, "rserver_source_cache_entries", "gauge", "Cached sources.");
+                writeValue(out, "rserver_source_cache_entries", "", stats.entries);
+                writeHeader(out, "rserver_source_cache_bytes", "gauge", "Bytes of cached sources by location.");
+                writeValue(out, "rserver_source_cache_bytes", "location=\"memory\"", stats.used_bytes);
+                writeValue(out, "rserver_source_cache_bytes", "location=\"disk\"", stats.spilled_bytes);
+            }
+            return out;
+        }
+
+    private:
+        static const size_t TYPE_COUNT = 7;
+        static constexpr const char *TYPE_NAMES[TYPE_COUNT] = {"raster", "points", "lines", "polygons", "string",
+                                                               "plot", "other"};
+        static constexpr const char *PHASE_NAMES[static_cast<size_t>(RequestPhase::COUNT)] = {
+                "dispatch", "sources", "evaluation", "conversion", "sending"};
+        static constexpr const char *LIMIT_NAMES[static_cast<size_t>(ResourceLimit::COUNT)] = {
+                "address_space", "memory", "cpu_time", "temp_files"};
+
+        struct Histogram {
+            std::atomic<uint64_t> buckets[BUCKET_COUNT + 1]; // not cumulative, the last one is +Inf
+            std::atomic<uint64_t> sum_us;
+        };
+
+        /**
+         * Lives in the shared memory, zeroed by `ftruncate()`
+         */
+        struct Shared {
+            std::atomic<uint64_t> requests[TYPE_COUNT];
+            std::atomic<uint64_t> errors;
+            Histogram requests_duration;
+            Histogram phases[static_cast<size_t>(RequestPhase::COUNT)];
+            std::atomic<uint64_t> received_bytes;
+            std::atomic<uint64_t> sent_bytes;
+            std::atomic<uint64_t> compression_messages;
+            std::atomic<uint64_t> compression_compressed_messages;
+            std::atomic<uint64_t> compression_raw_bytes;
+            std::atomic<uint64_t> compression_compressed_bytes;
+            std::atomic<uint64_t> compression_time_us;
+            std::atomic<uint64_t> script_cache_hits;
+            std::atomic<uint64_t> script_cache_misses;
+            std::atomic<uint64_t> script_cache_entries;
+            std::atomic<bool> pooled;
+            std::atomic<uint64_t> pool_workers;
+            std::atomic<uint64_t> pool_idle_workers;
+            std::atomic<uint64_t> pool_queue_depth;
+            std::atomic<uint64_t> pool_recycled_workers;
+            std::atomic<uint64_t> pool_sessions;
+            std::atomic<bool> admission;
+            std::atomic<uint64_t> admission_running;
+            std::atomic<uint64_t> admission_queued;
+            std::atomic<uint64_t> admission_rejected;
+            std::atomic<uint64_t> admission_expired;
+            std::atomic<uint64_t> limit_breaches[static_cast<size_t>(ResourceLimit::COUNT)];
+        };
+
+        static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the metrics need lock-free atomics to be shared by processes");
+
+        static auto getTypeIndex(char type) -> size_t {
+            switch (type) {
+                case RSERVER_TYPE_RASTER:
+                    return 0;
+                case RSERVER_TYPE_POINTS:
+                    return 1;
+                case RSERVER_TYPE_LINES:
+                    return 2;
+                case RSERVER_TYPE_POLYGONS:
+                    return 3;
+                case RSERVER_TYPE_STRING:
+                    return 4;
+                case RSERVER_TYPE_PLOT:
+                    return 5;
+                default:
+                    return TYPE_COUNT - 1;
+            }
+        }
+
+        static void add(std::atomic<uint64_t> &value, uint64_t amount) {
+            value.fetch_add(amount, std::memory_order_relaxed);
+        }
+
+        static auto load(const std::atomic<uint64_t> &value) -> uint64_t {
+            return value.load(std::memory_order_relaxed);
+        }
+
+        static void observe(Histogram &histogram, double seconds) {
+            size_t bucket = 0;
+            while (bucket < BUCKET_COUNT && seconds > BUCKETS[bucket])
+                bucket++;
+            add(histogram.buckets[bucket], 1);
+            add(histogram.sum_us, static_cast<uint64_t>(std::max(0.0, seconds) * 1e6));
+        }
+
+        static void writeHeader(std::string &out, const char *name, const char *type, const char *help) {
+            out += std::string("# HELP ") + name + " " + help + "\n";
+            out += std::string("# TYPE ") + name + " " + type + "\n";
+        }
+
+        template<typename T>
+        static void writeValue(std::string &out, const std::string &name, const std::string &labels, T value) {
+            out += name;
+            if (!labels.empty())
+                out += "{" + labels + "}";
+            out += " " + formatNumber(static_cast<double>(value)) + "\n";
+        }
+
+        static void writeHistogram(std::string &out, const std::string &name, const std::string &labels,
+                                   const Histogram &histogram) {
+            const std::string prefix = labels.empty() ? "" : labels + ",";
+            uint64_t count = 0;
+            for (size_t bucket = 0; bucket <= BUCKET_COUNT; bucket++) {
+                count += load(histogram.buckets[bucket]);
+                const std::string bound = bucket < BUCKET_COUNT ? formatNumber(BUCKETS[bucket]) : "+Inf";
+                writeValue(out, name + "_bucket", prefix + "le=\"" + bound + "\"", count);
+            }
+            writeValue(out, name + "_sum", labels, load(histogram.sum_us) / 1e6);
+            writeValue(out, name + "_count", labels, count);
+        }
+
+        static auto formatNumber(double value) -> std::string {
+            char number[32];
+            snprintf(number, sizeof(number), "%.12g", value);
+            return number;
+        }
+
+        int fd;
+        Shared *shared;
+};
+
+constexpr double ServerMetrics::BUCKETS[];
+constexpr const char *ServerMetrics::TYPE_NAMES[];
+constexpr const char *ServerMetrics::PHASE_NAMES[];
+constexpr const char *ServerMetrics::LIMIT_NAMES[];
+
+
+/**
+ * Serves `ServerMetrics` over HTTP for Prometheus.
+ *
+ * The endpoint runs in its own process, forked before the server starts, so scraping neither competes with R for the
+ * parent nor adds a thread to a process that forks. It answers `GET /metrics` and exits with the server.
+ */
+class MetricsEndpoint {
+    public:
+        /**
+         * Forks the endpoint process
+         * @param port the TCP port to listen on
+         * @param metrics
+         * @param cache the shared source cache or `nullptr`
+         */
+        static void start(int port, const ServerMetrics &metrics, SourceCache *cache) {
+            int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (listen_fd < 0)
+                throw PlatformException(std::string("socket() failed: ") + strerror(errno));
+            int yes = 1;
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+            struct sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_ANY);
+            address.sin_port = htons(static_cast<uint16_t>(port));
+            if (bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+                ::listen(listen_fd, 16) != 0) {
+                ::close(listen_fd);
+                throw PlatformException(std::string("Cannot listen for metrics: ") + strerror(errno));
+            }
+
+            const pid_t parent = getpid();
+            pid_t pid = fork();
+            if (pid < 0)
+                throw PlatformException(std::string("fork() failed: ") + strerror(errno));
+            if (pid > 0) {
+                ::close(listen_fd);
+                Log::info("Serving metrics on port %d", port);
+                return;
+            }
+
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (getppid() != parent)
+                exit(0);
+            signal(SIGHUP, SIG_DFL);
+            signal(SIGINT, SIG_DFL);
+            serve(listen_fd, metrics, cache);
+        }
+
+    private:
+        [[noreturn]] static void serve(int listen_fd, const ServerMetrics &metrics, SourceCache *cache) {
+            while (true) {
+                int fd = accept(listen_fd, nullptr, nullptr);
+                if (fd < 0)
+                    continue;
+                struct timeval timeout{5, 0};
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                try {
+                    answer(fd, metrics, cache);
+                } catch (const std::exception &e) {
+                    Log::warn("Metrics request failed: %s", e.what());
+                }
+                ::close(fd);
+            }
+        }
+
+        static void answer(int fd, const ServerMetrics &metrics, SourceCache *cache) {
+            // only the request line matters, the rest of the header is ignored
+            std::string request;
+            char chunk[1024];
+            while (request.find("\r\n") == std::string::npos && request.size() < 8192) {
+                ssize_t r = ::read(fd, chunk, sizeof(chunk));
+                if (r <= 0)
+                    return;
+                request.append(chunk, static_cast<size_t>(r));
+            }
+
+            std::string status = "200 OK";
+            std::string body;
+            if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 14, "GET /metrics?") == 0)
+                body = metrics.format(cache);
+            else {
+                status = "404 Not Found";
+                body = "Not found, try /metrics\n";
+            }
+
+            std::string response = "HTTP/1.0 " + status + "\r\n"
+                                   "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                                   "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                                   "Connection: close\r\n\r\n" + body;
+            size_t offset = 0;
+            while (offset < response.size()) {
+                ssize_t w = send(fd, response.data() + offset, response.size() - offset, MSG_NOSIGNAL);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0)
+                    return;
+                offset += static_cast<size_t>(w);
+            }
+        }
+};
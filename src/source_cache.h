@@ -0,0 +1,771 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+#include "util/binarystream.h"
+#include "util/log.h"
+
+#include "operators/queryrectangle.h"
+
+#include "client_stream.h"
+
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * A cache for source replies that is shared by all processes forked from the server.
+ *
+ * The parent creates the cache in a shared memory file before it forks, so every child and pool worker sees the same
+ * entries and they outlive the process that inserted them. Entries are keyed by the source identifier the client
+ * sends along with the request and the query rectangle. They hold the reply exactly as it arrived from the client,
+ * which `ClientStream::readInto` writes straight into a slot reserved with `reserve()`. A hit is read through a
+ * `BinaryStream` from the shared memory, just like a reply from the client, only without the round trip and the
+ * upstream computation.
+ *
+ * The lock is only held to look up, reserve and release entries, never while an entry is copied. A slot is invisible
+ * to other processes until it is committed, and entries that are being read are pinned, so they are not evicted.
+ * Entries of processes that died while holding them are reclaimed when space is needed.
+ *
+ * The memory is bounded by a byte budget and the least recently used entries are evicted. If a spill directory is
+ * configured, evicted entries are moved there, with their own byte budget, instead of being dropped. Spill files of
+ * servers that are no longer running are removed on startup.
+ *
+ * Reads use a file offset of their own per process, so they have to happen on the thread that runs the request.
+ */
+class SourceCache {
+    private:
+        struct Entry;
+
+    public:
+        struct Stats {
+            uint64_t hits;
+            uint64_t disk_hits;
+            uint64_t misses;
+            uint64_t evictions;
+            uint64_t spills;
+            size_t entries;
+            size_t used_bytes;
+            size_t spilled_bytes;
+        };
+
+        /**
+         * A slot of the shared memory for one reply. Other processes do not see it until it is committed, a slot
+         * that is not committed is released on destruction.
+         */
+        class Slot {
+            public:
+                Slot() : cache(nullptr), entry(nullptr) {
+                }
+
+                Slot(Slot &&other) noexcept : cache(other.cache), entry(other.entry) {
+                    other.cache = nullptr;
+                    other.entry = nullptr;
+                }
+
+                Slot &operator=(Slot &&other) noexcept {
+                    if (this != &other) {
+                        release();
+                        cache = other.cache;
+                        entry = other.entry;
+                        other.cache = nullptr;
+                        other.entry = nullptr;
+                    }
+                    return *this;
+                }
+
+                ~Slot() {
+                    release();
+                }
+
+                Slot(const Slot &) = delete;
+                Slot &operator=(const Slot &) = delete;
+
+                explicit operator bool() const {
+                    return entry != nullptr;
+                }
+
+                /**
+                 * @return where the payload of the reply goes
+                 */
+                auto getPayload() const -> char * {
+                    return cache->data + entry->offset + entry->key_size + sizeof(size_t);
+                }
+
+                /**
+                 * Parses the reply, including its tag
+                 */
+                void read(BinaryReadBuffer &buffer) const {
+                    cache->readFrame(sizeof(Header) + entry->offset + entry->key_size, buffer);
+                }
+
+                /**
+                 * Makes the reply visible to all processes
+                 */
+                void commit() {
+                    SourceCache::Lock lock(*cache);
+                    entry->location = Location::MEMORY;
+                    entry->last_use = ++cache->header->clock;
+                    cache = nullptr;
+                    entry = nullptr;
+                }
+
+            private:
+                Slot(SourceCache *cache, Entry *entry) : cache(cache), entry(entry) {
+                }
+
+                void release() {
+                    if (entry == nullptr)
+                        return;
+                    SourceCache::Lock lock(*cache);
+                    cache->header->used_bytes -= entry->size;
+                    entry->location = Location::FREE;
+                    cache = nullptr;
+                    entry = nullptr;
+                }
+
+                SourceCache *cache;
+                Entry *entry;
+
+                friend class SourceCache;
+        };
+
+        /**
+         * @param capacity bytes of shared memory for entries
+         * @param spill_directory directory for evicted entries, empty to drop them
+         * @param spill_capacity bytes on disk for evicted entries
+         */
+        SourceCache(size_t capacity, std::string spill_directory, size_t spill_capacity)
+                : capacity(capacity), spill_directory(std::move(spill_directory)), spill_capacity(spill_capacity),
+                  reader_fd(-1), reader_pid(0) {
+            fd = memfd_create("rserver-source-cache", 0);
+            if (fd < 0)
+                throw PlatformException(std::string("memfd_create() failed: ") + strerror(errno));
+
+            const size_t size = sizeof(Header) + capacity;
+            if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+                throw PlatformException(std::string("ftruncate() failed: ") + strerror(errno));
+
+            void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (memory == MAP_FAILED)
+                throw PlatformException(std::string("mmap() failed: ") + strerror(errno));
+
+            header = new(memory) Header();
+            data = static_cast<char *>(memory) + sizeof(Header);
+            header->owner = getpid();
+
+            pthread_mutexattr_t attributes;
+            pthread_mutexattr_init(&attributes);
+            pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+            // a child that is killed by its timeout must not leave the cache locked
+            pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+            pthread_mutex_init(&header->mutex, &attributes);
+            pthread_mutexattr_destroy(&attributes);
+
+            if (!this->spill_directory.empty())
+                removeStaleSpillFiles();
+
+            Log::info("Source cache with %zu MB memory and %zu MB spill space", capacity / (1024 * 1024),
+                      this->spill_directory.empty() ? 0 : spill_capacity / (1024 * 1024));
+        }
+
+        ~SourceCache() {
+            // children share the spilled entries, only the server removes them
+            if (getpid() == header->owner) {
+                for (auto &entry : header->entries) {
+                    if (entry.location == Location::DISK || entry.location == Location::SPILLING)
+                        unlink(getSpillFilename(entry).c_str());
+                }
+            }
+            if (reader_fd >= 0 && reader_pid == getpid())
+                ::close(reader_fd);
+            munmap(header, sizeof(Header) + capacity);
+            ::close(fd);
+        }
+
+        SourceCache(const SourceCache &) = delete;
+        SourceCache &operator=(const SourceCache &) = delete;
+
+        /**
+         * @return the cache key of a source, or an empty string if the source has no identifier
+         */
+        static auto makeKey(const std::string &source_id, char type, const QueryRectangle &rect) -> std::string {
+            if (source_id.empty())
+                return "";
+
+            char rectangle[512];
+            snprintf(rectangle, sizeof(rectangle), "|%d|%s|%.17g,%.17g,%.17g,%.17g|%d|%.17g,%.17g|%d|%u,%u", type,
+                     rect.crsId.to_string().c_str(), rect.x1, rect.y1, rect.x2, rect.y2,
+                     static_cast<int>(rect.timetype), rect.t1, rect.t2, static_cast<int>(rect.restype), rect.xres,
+                     rect.yres);
+            return source_id + rectangle;
+        }
+
+        auto contains(const std::string &key) -> bool {
+            Lock lock(*this);
+            return findEntry(key, false) != nullptr;
+        }
+
+        /**
+         * Read a cached reply
+         * @param key
+         * @param buffer is filled with the reply on a hit, without its tag
+         * @return whether the key was found
+         */
+        auto get(const std::string &key, BinaryReadBuffer &buffer) -> bool {
+            size_t frame_offset;
+            size_t tag_size;
+            int file = -1;
+            size_t pin;
+            {
+                Lock lock(*this);
+                Entry *entry = findEntry(key, false);
+                if (entry != nullptr && entry->location == Location::MEMORY && !addPin(*entry, pin))
+                    entry = nullptr;
+                if (entry != nullptr && entry->location == Location::DISK) {
+                    // the file stays readable even if the entry is removed in the meantime
+                    file = open(getSpillFilename(*entry).c_str(), O_RDONLY | O_CLOEXEC);
+                    if (file < 0)
+                        entry = nullptr;
+                }
+                if (entry == nullptr) {
+                    header->misses++;
+                    return false;
+                }
+                if (file >= 0)
+                    header->disk_hits++;
+                else
+                    header->hits++;
+                entry->last_use = ++header->clock;
+                frame_offset = sizeof(Header) + entry->offset + entry->key_size;
+                tag_size = entry->tag_size;
+            }
+
+            if (file < 0) {
+                try {
+                    readFrame(frame_offset, buffer);
+                } catch (...) {
+                    removePin(pin);
+                    throw;
+                }
+                removePin(pin);
+            } else if (!readSpillFile(file, key, buffer)) {
+                return false;
+            }
+
+            if (tag_size > 0) {
+                char tag[sizeof(uint64_t)];
+                buffer.read(tag, tag_size);
+            }
+            return true;
+        }
+
+        /**
+         * Reserves a slot for a reply unless the key is cached or being written already, evicting entries as needed
+         * @param key
+         * @param payload_size the size of the reply without its `size_t` header
+         * @param tag_size bytes at the start of the payload that are skipped on a hit, e.g. the index of a batch reply
+         * @return the slot, or an empty one if the reply is not cached
+         */
+        auto reserve(const std::string &key, size_t payload_size, size_t tag_size = 0) -> Slot {
+            const size_t size = key.size() + sizeof(size_t) + payload_size;
+            if (size > capacity || tag_size > sizeof(uint64_t))
+                return Slot();
+
+            Lock lock(*this);
+            while (true) {
+                Entry *existing = findEntry(key, true);
+                if (existing != nullptr && existing->location == Location::WRITING && !isAlive(existing->writer)) {
+                    header->used_bytes -= existing->size;
+                    existing->location = Location::FREE;
+                } else if (existing != nullptr) {
+                    return Slot();
+                }
+
+                size_t offset;
+                if (findFreeSpace(size, offset)) {
+                    Entry *entry = allocateEntry();
+                    if (entry == nullptr)
+                        return Slot();
+                    entry->location = Location::WRITING;
+                    entry->writer = getpid();
+                    entry->hash = hash(key);
+                    entry->last_use = ++header->clock;
+                    entry->offset = offset;
+                    entry->key_size = key.size();
+                    entry->tag_size = tag_size;
+                    entry->size = size;
+                    header->used_bytes += size;
+                    memcpy(data + offset, key.data(), key.size());
+                    memcpy(data + offset + key.size(), &payload_size, sizeof(size_t));
+                    return Slot(this, entry);
+                }
+
+                if (!evictFromMemory(lock))
+                    return Slot();
+            }
+        }
+
+        /**
+         * Insert a reply that was not received as a whole, e.g. a streamed raster, unless the key is already cached
+         * @param key
+         * @param buffer the reply in the same format the client sends it
+         */
+        void put(const std::string &key, BinaryWriteBuffer &buffer) {
+            Slot slot = reserve(key, buffer.getSize());
+            if (!slot)
+                return;
+            // the stream writes the size and the payload straight into the slot
+            int stream_fd = dup(getReader());
+            lseek(stream_fd, static_cast<off_t>(sizeof(Header) + slot.entry->offset + key.size()), SEEK_SET);
+            {
+                BinaryStream stream(stream_fd, stream_fd);
+                stream.write(buffer);
+            }
+            slot.commit();
+        }
+
+        auto getStats() -> Stats {
+            Lock lock(*this);
+            size_t entries = 0;
+            for (auto &entry : header->entries) {
+                if (entry.location == Location::MEMORY || entry.location == Location::DISK)
+                    entries++;
+            }
+            return Stats{header->hits, header->disk_hits, header->misses, header->evictions, header->spills, entries,
+                         header->used_bytes, header->spilled_bytes};
+        }
+
+        void logStats() {
+            auto stats = getStats();
+            const uint64_t lookups = stats.hits + stats.disk_hits + stats.misses;
+            Log::info("Source cache: %llu hits, %llu disk hits, %llu misses (%.1f%% hit rate), %zu entries, %zu MB",
+                      static_cast<unsigned long long>(stats.hits), static_cast<unsigned long long>(stats.disk_hits),
+                      static_cast<unsigned long long>(stats.misses),
+                      lookups > 0 ? 100.0 * (stats.hits + stats.disk_hits) / lookups : 0.0, stats.entries,
+                      stats.used_bytes / (1024 * 1024));
+        }
+
+    private:
+        static const size_t MAX_ENTRIES = 4096;
+        static const size_t MAX_PINS = 256;
+
+        enum class Location : uint8_t {
+            FREE,
+            WRITING, // reserved by `writer` and being filled
+            MEMORY,
+            SPILLING, // being written to disk by `writer`, still in memory
+            DISK
+        };
+
+        struct Entry {
+            Location location;
+            pid_t writer;
+            uint64_t hash;
+            uint64_t last_use;
+            size_t offset; // in the shared memory
+            uint64_t file_id; // of the spill file
+            size_t key_size;
+            size_t tag_size;
+            size_t size; // key, size and payload of the message
+        };
+
+        /**
+         * An entry in memory that a process is reading
+         */
+        struct Pin {
+            pid_t pid; // 0 = unused
+            size_t entry;
+        };
+
+        struct Header {
+            pthread_mutex_t mutex;
+            pid_t owner;
+            uint64_t clock;
+            uint64_t next_file_id;
+            size_t used_bytes;
+            size_t spilled_bytes;
+            uint64_t hits;
+            uint64_t disk_hits;
+            uint64_t misses;
+            uint64_t evictions;
+            uint64_t spills;
+            Entry entries[MAX_ENTRIES];
+            Pin pins[MAX_PINS];
+        };
+
+        class Lock {
+            public:
+                explicit Lock(SourceCache &cache) : mutex(&cache.header->mutex) {
+                    lock();
+                }
+
+                ~Lock() {
+                    pthread_mutex_unlock(mutex);
+                }
+
+                void lock() {
+                    if (pthread_mutex_lock(mutex) == EOWNERDEAD)
+                        pthread_mutex_consistent(mutex);
+                }
+
+                void unlock() {
+                    pthread_mutex_unlock(mutex);
+                }
+
+            private:
+                pthread_mutex_t *mutex;
+        };
+
+        static auto hash(const std::string &key) -> uint64_t {
+            // FNV-1a
+            uint64_t value = 14695981039346656037ull;
+            for (char c : key) {
+                value ^= static_cast<uint8_t>(c);
+                value *= 1099511628211ull;
+            }
+            return value;
+        }
+
+        static auto isAlive(pid_t pid) -> bool {
+            return kill(pid, 0) == 0 || errno != ESRCH;
+        }
+
+        static auto isInMemory(const Entry &entry) -> bool {
+            return entry.location == Location::WRITING || entry.location == Location::MEMORY ||
+                   entry.location == Location::SPILLING;
+        }
+
+        /**
+         * @param pending whether to find entries that are being written, too
+         * @return the entry for a key. Keys on disk are only compared by their hash, `readSpillFile` checks them.
+         */
+        auto findEntry(const std::string &key, bool pending) -> Entry * {
+            const uint64_t key_hash = hash(key);
+            for (auto &entry : header->entries) {
+                if (entry.location == Location::FREE || entry.hash != key_hash || entry.key_size != key.size())
+                    continue;
+                if (!pending && entry.location != Location::MEMORY && entry.location != Location::DISK)
+                    continue;
+                if (isInMemory(entry) && memcmp(data + entry.offset, key.data(), key.size()) != 0)
+                    continue;
+                return &entry;
+            }
+            return nullptr;
+        }
+
+        /**
+         * @return a free slot of the entry table, evicting the least recently used entry if there is none
+         */
+        auto allocateEntry() -> Entry * {
+            Entry *oldest = nullptr;
+            for (auto &entry : header->entries) {
+                if (entry.location == Location::FREE)
+                    return &entry;
+                if ((entry.location == Location::DISK || (entry.location == Location::MEMORY && !isPinned(entry))) &&
+                    (oldest == nullptr || entry.last_use < oldest->last_use))
+                    oldest = &entry;
+            }
+            if (oldest != nullptr)
+                removeEntry(*oldest);
+            return oldest;
+        }
+
+        /**
+         * First fit search between the entries in memory
+         */
+        auto findFreeSpace(size_t size, size_t &offset) -> bool {
+            std::vector<const Entry *> used;
+            for (auto &entry : header->entries) {
+                if (isInMemory(entry))
+                    used.push_back(&entry);
+            }
+            std::sort(used.begin(), used.end(), [](const Entry *a, const Entry *b) { return a->offset < b->offset; });
+
+            size_t position = 0;
+            for (auto entry : used) {
+                if (entry->offset - position >= size) {
+                    offset = position;
+                    return true;
+                }
+                position = entry->offset + entry->size;
+            }
+            if (capacity - position >= size) {
+                offset = position;
+                return true;
+            }
+            return false;
+        }
+
+        auto isPinned(const Entry &entry) -> bool {
+            const auto index = static_cast<size_t>(&entry - header->entries);
+            bool pinned = false;
+            for (auto &pin : header->pins) {
+                if (pin.pid == 0 || pin.entry != index)
+                    continue;
+                if (isAlive(pin.pid))
+                    pinned = true;
+                else
+                    pin.pid = 0;
+            }
+            return pinned;
+        }
+
+        auto addPin(const Entry &entry, size_t &pin) -> bool {
+            for (pin = 0; pin < MAX_PINS; pin++) {
+                if (header->pins[pin].pid == 0) {
+                    header->pins[pin] = Pin{getpid(), static_cast<size_t>(&entry - header->entries)};
+                    return true;
+                }
+            }
+            Log::debug("SourceCache: too many concurrent reads");
+            return false;
+        }
+
+        void removePin(size_t pin) {
+            Lock lock(*this);
+            header->pins[pin].pid = 0;
+        }
+
+        /**
+         * Frees the slots of processes that died while writing them
+         */
+        void reclaimAbandoned() {
+            for (auto &entry : header->entries) {
+                if (entry.location == Location::WRITING && !isAlive(entry.writer)) {
+                    header->used_bytes -= entry.size;
+                    entry.location = Location::FREE;
+                } else if (entry.location == Location::SPILLING && !isAlive(entry.writer)) {
+                    unlink(getSpillFilename(entry).c_str());
+                    header->spilled_bytes -= entry.size;
+                    entry.location = Location::MEMORY;
+                }
+            }
+        }
+
+        /**
+         * Moves the least recently used entry in memory that is not being read to disk, or drops it.
+         * The lock is released while the entry is written to disk.
+         * @return false if no entry could be evicted
+         */
+        auto evictFromMemory(Lock &lock) -> bool {
+            reclaimAbandoned();
+            Entry *oldest = nullptr;
+            for (auto &entry : header->entries) {
+                if (entry.location == Location::MEMORY && (oldest == nullptr || entry.last_use < oldest->last_use) &&
+                    !isPinned(entry))
+                    oldest = &entry;
+            }
+            if (oldest == nullptr)
+                return false;
+
+            header->evictions++;
+            if (spill_directory.empty() || oldest->size > spill_capacity || !reserveSpillSpace(*oldest)) {
+                header->used_bytes -= oldest->size;
+                oldest->location = Location::FREE;
+                return true;
+            }
+
+            Entry &entry = *oldest;
+            entry.location = Location::SPILLING;
+            entry.writer = getpid();
+            entry.file_id = header->next_file_id++;
+            lock.unlock();
+            const bool spilled = writeSpillFile(entry);
+            lock.lock();
+
+            header->used_bytes -= entry.size;
+            if (spilled) {
+                entry.location = Location::DISK;
+                header->spills++;
+            } else {
+                header->spilled_bytes -= entry.size;
+                entry.location = Location::FREE;
+            }
+            return true;
+        }
+
+        /**
+         * Removes the least recently used entries on disk until an entry fits and accounts for it
+         */
+        auto reserveSpillSpace(const Entry &entry) -> bool {
+            while (header->spilled_bytes + entry.size > spill_capacity) {
+                Entry *oldest = nullptr;
+                for (auto &other : header->entries) {
+                    if (other.location == Location::DISK && (oldest == nullptr || other.last_use < oldest->last_use))
+                        oldest = &other;
+                }
+                if (oldest == nullptr)
+                    return false;
+                removeEntry(*oldest);
+            }
+            header->spilled_bytes += entry.size;
+            return true;
+        }
+
+        auto writeSpillFile(const Entry &entry) -> bool {
+            const std::string filename = getSpillFilename(entry);
+            int file = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (file < 0) {
+                Log::warn("SourceCache: cannot create %s: %s", filename.c_str(), strerror(errno));
+                return false;
+            }
+            size_t written = 0;
+            while (written < entry.size) {
+                ssize_t w = ::write(file, data + entry.offset + written, entry.size - written);
+                if (w <= 0)
+                    break;
+                written += static_cast<size_t>(w);
+            }
+            ::close(file);
+            if (written != entry.size) {
+                unlink(filename.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Reads an entry from its spill file and closes it
+         * @return false if the file belongs to another key
+         */
+        auto readSpillFile(int file, const std::string &key, BinaryReadBuffer &buffer) -> bool {
+            std::string stored(key.size(), '\0');
+            if (pread(file, &stored[0], key.size(), 0) != static_cast<ssize_t>(key.size()) || stored != key) {
+                ::close(file);
+                return false;
+            }
+            lseek(file, static_cast<off_t>(key.size()), SEEK_SET);
+            BinaryStream stream(file, file);
+            stream.read(buffer);
+            return true;
+        }
+
+        void removeEntry(Entry &entry) {
+            if (entry.location == Location::MEMORY) {
+                header->used_bytes -= entry.size;
+                header->evictions++;
+            } else if (entry.location == Location::DISK) {
+                unlink(getSpillFilename(entry).c_str());
+                header->spilled_bytes -= entry.size;
+            }
+            entry.location = Location::FREE;
+        }
+
+        /**
+         * Removes the spill files of servers that are not running anymore
+         */
+        void removeStaleSpillFiles() {
+            DIR *directory = opendir(spill_directory.c_str());
+            if (directory == nullptr)
+                return;
+            size_t removed = 0;
+            while (struct dirent *file = readdir(directory)) {
+                int pid;
+                unsigned long long id;
+                if (sscanf(file->d_name, "rserver-cache-%d-%llu.bin", &pid, &id) != 2)
+                    continue;
+                // a server that reuses the pid of an earlier one, e.g. in a container, has not spilled anything yet
+                if (pid != getpid() && isAlive(pid))
+                    continue;
+                if (unlink((spill_directory + "/" + file->d_name).c_str()) == 0)
+                    removed++;
+            }
+            closedir(directory);
+            if (removed > 0)
+                Log::info("Removed %zu stale source cache files from %s", removed, spill_directory.c_str());
+        }
+
+        auto getSpillFilename(const Entry &entry) const -> std::string {
+            return spill_directory + "/rserver-cache-" + std::to_string(header->owner) + "-" +
+                   std::to_string(entry.file_id) + ".bin";
+        }
+
+        /**
+         * @return a descriptor of the shared memory with a file offset of its own, forked processes share the offset
+         *         of inherited descriptors
+         */
+        auto getReader() -> int {
+            if (reader_pid != getpid()) {
+                if (reader_fd >= 0)
+                    ::close(reader_fd);
+                reader_fd = open(("/proc/self/fd/" + std::to_string(fd)).c_str(), O_RDWR | O_CLOEXEC);
+                if (reader_fd < 0)
+                    throw PlatformException(std::string("SourceCache: cannot open shared memory: ") +
+                                            strerror(errno));
+                reader_pid = getpid();
+            }
+            return reader_fd;
+        }
+
+        /**
+         * Parses the message that starts at an offset of the shared memory file
+         */
+        void readFrame(size_t offset, BinaryReadBuffer &buffer) {
+            int stream_fd = dup(getReader());
+            lseek(stream_fd, static_cast<off_t>(offset), SEEK_SET);
+            BinaryStream stream(stream_fd, stream_fd);
+            stream.read(buffer);
+        }
+
+        size_t capacity;
+        std::string spill_directory;
+        size_t spill_capacity;
+        int fd;
+        Header *header;
+        char *data;
+        int reader_fd;
+        pid_t reader_pid;
+};
+
+/**
+ * Reads the reply for a source from the client, straight into a slot of the cache if it gets one
+ * @param cache the source cache or `nullptr` if none of the possible replies can be cached
+ * @param tag_size bytes at the start of the payload that identify the source, e.g. the index of a batch reply
+ * @param key_of returns the cache key of the source for a tag, or an empty string if it is not cached
+ * @param reply receives the reply if it does not go into the cache
+ * @return the filled slot, which still has to be read and committed, or an empty one
+ */
+SourceCache::Slot receive_source_reply(ClientStream &stream, SourceCache *cache, size_t tag_size,
+                                       const std::function<std::string(const char *)> &key_of,
+                                       BinaryReadBuffer &reply) {
+    SourceCache::Slot slot;
+    if (cache == nullptr) {
+        stream.read(reply);
+        return slot;
+    }
+    stream.readInto(tag_size, [&](size_t size, const char *tag) -> char * {
+        const std::string key = key_of(tag);
+        if (!key.empty())
+            slot = cache->reserve(key, size, tag_size);
+        return slot ? slot.getPayload() : nullptr;
+    }, reply);
+    return slot;
+}
@@ -0,0 +1,248 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+#include "util/binarystream.h"
+#include "util/log.h"
+
+#include "client_stream.h"
+#include "rserver_protocol.h"
+#include "rserver_request.h"
+#include "source_cache.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Compares two query rectangles field by field
+ */
+bool is_same_query_rectangle(const QueryRectangle &a, const QueryRectangle &b) {
+    return a.crsId == b.crsId && a.x1 == b.x1 && a.y1 == b.y1 && a.x2 == b.x2 && a.y2 == b.y2 &&
+           a.timetype == b.timetype && a.t1 == b.t1 && a.t2 == b.t2 &&
+           a.restype == b.restype && a.xres == b.xres && a.yres == b.yres;
+}
+
+/**
+ * Requests all sources declared in the request header for the query rectangle before the script runs.
+ *
+ * The requests are sent right away (as one batch if the client supports it) and a background thread buffers the
+ * replies while R opens the plot device, binds its functions and parses the script. A loader call for a prefetched
+ * source then only waits for its reply instead of a full round trip.
+ *
+ * Sources that are in the shared cache are not prefetched. Replies for sources with a cache key are read straight into
+ * the cache and committed once they are taken, or when the prefetcher is destroyed.
+ * The stream belongs to the prefetcher until `finish()` returns, other requests have to call it first.
+ */
+class SourcePrefetcher {
+    public:
+        /**
+         * @param stream the connection to the client
+         * @param request the request header with the declared sources
+         * @param cache the shared source cache or `nullptr`
+         * @param sending set while the requests are written, so that a failure does not interleave an error reply
+         */
+        SourcePrefetcher(ClientStream &stream, const RServerRequest &request, SourceCache *cache,
+                         std::atomic<bool> &sending)
+                : stream(stream), cache(cache), batch(false), cacheable(false), finished(false) {
+            const std::pair<char, int> counts[] = {
+                    {RSERVER_TYPE_RASTER,   request.rastersourcecount},
+                    {RSERVER_TYPE_POINTS,   request.pointssourcecount},
+                    {RSERVER_TYPE_LINES,    request.linessourcecount},
+                    {RSERVER_TYPE_POLYGONS, request.polygonssourcecount},
+            };
+            for (const auto &count : counts) {
+                for (int childidx = 0; childidx < count.second; childidx++) {
+                    std::string key;
+                    if (cache != nullptr) {
+                        key = SourceCache::makeKey(request.getSourceId(count.first, childidx), count.first,
+                                                   request.qrect);
+                        if (!key.empty() && cache->contains(key))
+                            continue;
+                    }
+                    if (!key.empty())
+                        cacheable = true;
+                    sources.push_back(Source{count.first, childidx, request.qrect, key, nullptr, SourceCache::Slot(),
+                                             false, false});
+                }
+            }
+
+            if (sources.empty()) {
+                finished = true;
+                return;
+            }
+
+            batch = request.hasCapability(RServerCapabilities::BATCH);
+            sending = true;
+            BinaryWriteBuffer message;
+            if (batch) {
+                message.write<const char &>(RSERVER_TYPE_BATCH);
+                message.write<uint32_t>(static_cast<uint32_t>(sources.size()));
+                for (const auto &source : sources) {
+                    message.write<const char &>(source.type);
+                    message.write<const int &>(source.childidx);
+                    message.write<const QueryRectangle &>(source.rect);
+                }
+                stream.write(message);
+            } else {
+                // the client answers one request after another, so they can all be sent ahead
+                for (const auto &source : sources) {
+                    BinaryWriteBuffer single;
+                    single.write<const char &>(source.type);
+                    single.write<const int &>(source.childidx);
+                    single.write<const QueryRectangle &>(source.rect);
+                    stream.write(single);
+                }
+            }
+            sending = false;
+            Log::debug("prefetching %zu sources", sources.size());
+
+            reader = std::thread(&SourcePrefetcher::readReplies, this);
+        }
+
+        ~SourcePrefetcher() {
+            if (reader.joinable())
+                reader.join();
+            // replies that the script did not load are complete all the same
+            for (auto &source : sources) {
+                if (source.slot)
+                    source.slot.commit();
+            }
+        }
+
+        SourcePrefetcher(const SourcePrefetcher &) = delete;
+        SourcePrefetcher &operator=(const SourcePrefetcher &) = delete;
+
+        /**
+         * @return whether the source was prefetched and has not been taken yet
+         */
+        auto contains(char type, int childidx, const QueryRectangle &rect) -> bool {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto &source : sources) {
+                if (source.type == type && source.childidx == childidx && !source.taken &&
+                    is_same_query_rectangle(source.rect, rect))
+                    return true;
+            }
+            return false;
+        }
+
+        /**
+         * Removes the reply for a source, waiting for it if it has not arrived yet
+         * @return the reply or `nullptr` if the source was not prefetched or has already been taken
+         */
+        auto take(char type, int childidx, const QueryRectangle &rect) -> std::unique_ptr<BinaryReadBuffer> {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (auto &source : sources) {
+                if (source.type != type || source.childidx != childidx || source.taken ||
+                    !is_same_query_rectangle(source.rect, rect))
+                    continue;
+
+                arrived.wait(lock, [&] { return source.arrived || finished; });
+                if (error)
+                    std::rethrow_exception(error);
+                source.taken = true;
+                if (!source.slot)
+                    return std::move(source.reply);
+
+                auto reply = std::make_unique<BinaryReadBuffer>();
+                source.slot.read(*reply);
+                if (batch)
+                    reply->read<uint32_t>();
+                source.slot.commit();
+                return reply;
+            }
+            return nullptr;
+        }
+
+        /**
+         * Waits until all replies are buffered, so that the stream can be used for other requests
+         */
+        void finish() {
+            if (reader.joinable())
+                reader.join();
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+    private:
+        struct Source {
+            char type;
+            int childidx;
+            QueryRectangle rect;
+            std::string key; // the cache key or an empty string
+            std::unique_ptr<BinaryReadBuffer> reply;
+            SourceCache::Slot slot; // holds the reply instead if it goes into the cache
+            bool arrived;
+            bool taken;
+        };
+
+        void readReplies() {
+            try {
+                for (size_t i = 0; i < sources.size(); i++) {
+                    // replies to a batch are tagged with their position, single requests are answered in order
+                    uint32_t tag = 0;
+                    auto key_of = [&](const char *bytes) -> std::string {
+                        if (!batch)
+                            return sources[i].key;
+                        memcpy(&tag, bytes, sizeof(tag));
+                        return tag < sources.size() ? sources[tag].key : "";
+                    };
+                    auto reply = std::make_unique<BinaryReadBuffer>();
+                    auto slot = receive_source_reply(stream, cacheable ? cache : nullptr,
+                                                     batch ? sizeof(uint32_t) : 0, key_of, *reply);
+
+                    size_t index = i;
+                    if (batch) {
+                        index = slot ? tag : reply->read<uint32_t>();
+                        if (index >= sources.size() || sources[index].arrived)
+                            throw NetworkException("Client sent an unexpected reply to a batch");
+                    }
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    sources[index].reply = std::move(reply);
+                    sources[index].slot = std::move(slot);
+                    sources[index].arrived = true;
+                    arrived.notify_all();
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            finished = true;
+            arrived.notify_all();
+        }
+
+        ClientStream &stream;
+        SourceCache *cache;
+        bool batch;
+        bool cacheable; // whether any source has a cache key
+        std::vector<Source> sources;
+        std::thread reader;
+        std::mutex mutex;
+        std::condition_variable arrived;
+        bool finished;
+        std::exception_ptr error;
+};
@@ -0,0 +1,798 @@
+/*
+ * This file is part of mapping-r-server (https://github.com/umr-dbs/mapping-r-server).
+ * Copyright (c) 2018 Database Research Group of the University of Marburg.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "util/exceptions.h"
+#include "util/binarystream.h"
+#include "util/log.h"
+
+#include "header_reader.h"
+#include "listen_socket.h"
+#include "message_socket.h"
+#include "request_trace.h"
+#include "rserver_protocol.h"
+#include "rserver_request.h"
+#include "server_metrics.h"
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * A pool of pre-forked R worker processes.
+ *
+ * The parent accepts connections, receives and parses the request header without blocking and hands the client
+ * socket to an idle worker over a local socket pair. The workers are forked from the fully initialized parent and
+ * serve one request after another, so a request no longer pays for `fork()` and the copy-on-write faults of a fresh
+ * child.
+ * A worker is recycled after a number of requests or when its resident memory exceeds a threshold. If a worker cannot
+ * be replaced, the pool runs with fewer workers and tries again every second.
+ *
+ * A client may also open a multiplexed session that carries many tagged requests (see docs/protocol.md). The parent
+ * then hands one end of a socket pair to the worker instead of the client socket and relays the messages between
+ * them, so the requests of a session run on all workers at once and are answered in any order. The parent stops
+ * reading from either side while more than `RELAY_HIGH_WATER_MARK` bytes wait to be written to the other.
+ *
+ * The parent does not parse request headers beyond the capabilities, it passes them to the worker as received.
+ */
+class RWorkerPool {
+    public:
+        /// `fd` is the socket behind `stream`
+        using RequestHandler = std::function<void(BinaryStream &stream, int fd, const RServerRequest &request,
+                                                  const RequestArrival &arrival)>;
+
+        struct Stats {
+            size_t workers;
+            size_t idle_workers;
+            size_t queue_depth;
+            size_t recycled_workers;
+            size_t sessions;
+        };
+
+        /**
+         * @param handler runs a single request inside a worker
+         * @param size number of workers
+         * @param max_requests_per_worker recycle a worker after this many requests (0 = never)
+         * @param max_worker_memory_mb recycle a worker if its private memory exceeds this (0 = never)
+         * @param metrics receives the state of the pool
+         */
+        RWorkerPool(RequestHandler handler, size_t size, size_t max_requests_per_worker, size_t max_worker_memory_mb,
+                    ServerMetrics *metrics)
+                : handler(std::move(handler)),
+                  max_requests_per_worker(max_requests_per_worker),
+                  max_worker_memory(max_worker_memory_mb * 1024 * 1024),
+                  workers(size, Worker{-1, -1, false}),
+                  headers(std::chrono::seconds(5)),
+                  recycled_workers(0),
+                  next_session_id(0),
+                  metrics(metrics) {
+        }
+
+        ~RWorkerPool() {
+            for (auto &worker : workers) {
+                if (worker.control_fd >= 0)
+                    ::close(worker.control_fd);
+            }
+            for (auto &connection : queue)
+                ::close(connection.fd);
+            for (int listen_fd : listen_fds)
+                ::close(listen_fd);
+        }
+
+        void listen(int portnr) {
+            listen_fds.push_back(listen_on_port(portnr));
+        }
+
+        /**
+         * Listen on a Unix domain socket as well, replacing a stale socket file
+         * @param path
+         * @param permissions of the socket file
+         */
+        void listen(const std::string &path, int permissions) {
+            listen_fds.push_back(listen_on_unix_socket(path, permissions));
+        }
+
+        /**
+         * Spawns the workers and runs the dispatch loop. Does not return.
+         */
+        void start() {
+            if (listen_fds.empty())
+                throw PlatformException("RWorkerPool::start(): call listen() first");
+
+            spawnMissingWorkers();
+            Log::info("Worker pool with %zu workers is ready", workers.size());
+
+            std::vector<struct pollfd> fds;
+            std::vector<uint64_t> session_ids;
+            std::vector<std::pair<uint64_t, uint32_t>> relay_ids;
+            while (true) {
+                fds.clear();
+                for (int listen_fd : listen_fds)
+                    fds.push_back(pollfd{listen_fd, POLLIN, 0});
+                for (auto &worker : workers)
+                    fds.push_back(pollfd{worker.control_fd, POLLIN, 0});
+
+                session_ids.clear();
+                relay_ids.clear();
+                for (auto &session : sessions) {
+                    auto &socket = *session.second.socket;
+                    fds.push_back(pollfd{socket.getFd(), pollEvents(socket, relaysAcceptInput(session.second)), 0});
+                    session_ids.push_back(session.first);
+                }
+                for (auto &session : sessions) {
+                    const bool receiving = session.second.socket->getQueuedBytes() < RELAY_HIGH_WATER_MARK;
+                    for (auto &relay : session.second.relays) {
+                        auto &socket = *relay.second.socket;
+                        fds.push_back(pollfd{socket.getFd(), pollEvents(socket, receiving), 0});
+                        relay_ids.emplace_back(session.first, relay.first);
+                    }
+                }
+                const size_t header_position = fds.size();
+                headers.addPollFds(fds);
+
+                int timeout = headers.getPollTimeout();
+                if (hasMissingWorkers())
+                    timeout = timeout < 0 ? 1000 : std::min(timeout, 1000);
+                if (poll(fds.data(), fds.size(), timeout) < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    throw PlatformException(std::string("poll() failed: ") + strerror(errno));
+                }
+
+                const size_t listeners = listen_fds.size();
+                for (size_t i = 0; i < workers.size(); i++) {
+                    if (fds[listeners + i].revents != 0)
+                        handleWorkerEvent(workers[i]);
+                }
+
+                size_t position = listeners + workers.size();
+                for (auto session_id : session_ids) {
+                    const short revents = fds[position++].revents;
+                    if (revents != 0)
+                        handleSessionEvent(session_id, revents);
+                }
+                for (auto &relay_id : relay_ids) {
+                    const short revents = fds[position++].revents;
+                    if (revents != 0)
+                        handleRelayEvent(relay_id.first, relay_id.second, revents);
+                }
+
+                for (auto &header : headers.receive(&fds[header_position]))
+                    handleHeader(header);
+
+                for (size_t i = 0; i < listeners; i++) {
+                    if (fds[i].revents & POLLIN)
+                        acceptConnection(listen_fds[i]);
+                }
+
+                spawnMissingWorkers();
+                dispatch();
+
+                auto stats = getStats();
+                metrics->setPoolStats(stats.workers, stats.idle_workers, stats.queue_depth, stats.recycled_workers,
+                                      stats.sessions);
+            }
+        }
+
+        auto getStats() const -> Stats {
+            size_t idle = 0;
+            for (auto &worker : workers) {
+                if (!worker.busy && worker.control_fd >= 0)
+                    idle++;
+            }
+            return Stats{workers.size(), idle, queue.size(), recycled_workers, sessions.size()};
+        }
+
+    private:
+        struct Worker {
+            pid_t pid;
+            int control_fd;
+            bool busy;
+        };
+
+        struct PendingConnection {
+            int fd;
+            /// the header as the client sent it
+            std::string header;
+            RequestArrival arrival;
+            /// the session and tag of a multiplexed request, `NO_SESSION` for a client connection
+            uint64_t session_id;
+            uint32_t tag;
+        };
+
+        /**
+         * The parent's end of the socket pair of a multiplexed request, and what the worker answered on it so far
+         */
+        struct Relay {
+            std::unique_ptr<MessageSocket> socket;
+            /// whether the client asked for compression and the worker has not sent the chosen codec yet
+            bool codec_pending;
+            /// whether the worker prefixes every message with a codec
+            bool encoded;
+            /// whether the result or an error message was relayed, which ends the request
+            bool answered;
+        };
+
+        /**
+         * A multiplexed client connection and the socket pairs of its running requests by tag
+         */
+        struct Session {
+            std::unique_ptr<MessageSocket> socket;
+            std::map<uint32_t, Relay> relays;
+        };
+
+        auto hasMissingWorkers() const -> bool {
+            for (auto &worker : workers) {
+                if (worker.control_fd < 0)
+                    return true;
+            }
+            return false;
+        }
+
+        /**
+         * Spawns the workers that exited, unless the last attempt failed less than a second ago
+         */
+        void spawnMissingWorkers() {
+            const auto now = std::chrono::steady_clock::now();
+            if (now < next_spawn_attempt)
+                return;
+            for (auto &worker : workers) {
+                if (worker.control_fd >= 0)
+                    continue;
+                try {
+                    spawnWorker(worker);
+                } catch (const std::exception &e) {
+                    Log::warn("Could not spawn an R worker, retrying in a second: %s", e.what());
+                    next_spawn_attempt = now + std::chrono::seconds(1);
+                    return;
+                }
+            }
+        }
+
+        void spawnWorker(Worker &worker) {
+            int sockets[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+                throw PlatformException(std::string("socketpair() failed: ") + strerror(errno));
+
+            pid_t pid = fork();
+            if (pid < 0) {
+                ::close(sockets[0]);
+                ::close(sockets[1]);
+                throw PlatformException(std::string("fork() failed: ") + strerror(errno));
+            }
+
+            if (pid == 0) {
+                ::close(sockets[0]);
+                for (int listen_fd : listen_fds)
+                    ::close(listen_fd);
+                for (auto &other : workers) {
+                    if (other.control_fd >= 0)
+                        ::close(other.control_fd);
+                }
+                for (auto &connection : queue)
+                    ::close(connection.fd);
+                sessions.clear();
+                headers.closeAll();
+                runWorker(sockets[1]);
+            }
+
+            ::close(sockets[1]);
+            worker.pid = pid;
+            worker.control_fd = sockets[0];
+            worker.busy = false;
+            Log::debug("Spawned R worker %d", pid);
+        }
+
+        [[noreturn]] void runWorker(int control_fd) {
+            int control_stream_fd = dup(control_fd);
+            BinaryStream control(control_stream_fd, control_stream_fd);
+
+            size_t requests = 0;
+            while (true) {
+                int client_fd = receiveFileDescriptor(control_fd);
+                if (client_fd < 0)
+                    exit(0); // the parent is gone
+
+                BinaryReadBuffer buffer;
+                control.read(buffer);
+
+                {
+                    BinaryStream stream(client_fd, client_fd);
+                    RServerRequest request;
+                    RequestArrival arrival{};
+                    bool parsed = false;
+                    try {
+                        request = RServerRequest(buffer);
+                        arrival = RequestArrival{readTimePoint(buffer), readTimePoint(buffer)};
+                        parsed = true;
+                    } catch (const std::exception &e) {
+                        Log::warn("Could not read request header: %s", e.what());
+                        sendError(stream, e.what());
+                    }
+
+                    if (parsed) {
+                        request.log();
+                        if (request.timeout > 0)
+                            alarm(static_cast<unsigned int>(request.timeout));
+                        try {
+                            handler(stream, client_fd, request, arrival);
+                        } catch (const std::exception &e) {
+                            Log::warn("Worker %d: request failed: %s", getpid(), e.what());
+                        }
+                        alarm(0);
+                    }
+                }
+
+                requests++;
+                if (max_requests_per_worker > 0 && requests >= max_requests_per_worker) {
+                    Log::info("Worker %d served %zu requests, recycling", getpid(), requests);
+                    exit(0);
+                }
+                if (max_worker_memory > 0) {
+                    size_t memory = getResidentMemory();
+                    if (memory > max_worker_memory) {
+                        Log::info("Worker %d uses %zu MB, recycling", getpid(), memory / (1024 * 1024));
+                        exit(0);
+                    }
+                }
+
+                char ready = 'R';
+                if (::write(control_fd, &ready, 1) != 1)
+                    exit(0);
+            }
+        }
+
+        void acceptConnection(int listen_fd) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0) {
+                Log::warn("accept() failed: %s", strerror(errno));
+                return;
+            }
+            headers.add(fd);
+        }
+
+        void handleHeader(HeaderReader::Header &header) {
+            try {
+                const uint32_t capabilities = RServerRequest::peekCapabilities(header.payload);
+                if (capabilities & RServerCapabilities::MULTIPLEX) {
+                    openSession(header.fd, capabilities);
+                    return;
+                }
+
+                const RequestArrival arrival{header.received, std::chrono::steady_clock::now()};
+                queue.push_back(PendingConnection{header.fd, std::move(header.payload), arrival, NO_SESSION, 0});
+            } catch (const std::exception &e) {
+                Log::warn("Could not read request header: %s", e.what());
+                ::close(header.fd);
+            }
+        }
+
+        void dispatch() {
+            // requests of sessions that closed while they waited have nobody to answer to
+            for (auto connection = queue.begin(); connection != queue.end();) {
+                if (isAbandoned(*connection)) {
+                    ::close(connection->fd);
+                    connection = queue.erase(connection);
+                } else {
+                    ++connection;
+                }
+            }
+
+            for (auto &worker : workers) {
+                if (queue.empty())
+                    break;
+                if (worker.busy || worker.control_fd < 0)
+                    continue;
+
+                auto connection = std::move(queue.front());
+                queue.pop_front();
+
+                bool handed = false;
+                try {
+                    sendFileDescriptor(worker.control_fd, connection.fd);
+                    handed = true;
+                    sendHeader(worker.control_fd, connection);
+                    worker.busy = true;
+                    ::close(connection.fd);
+                    continue;
+                } catch (const std::exception &e) {
+                    Log::warn("Could not hand request to worker %d: %s", worker.pid, e.what());
+                }
+
+                // the control socket is broken, the worker is not used until handleWorkerEvent() reaps it
+                worker.busy = true;
+                if (!handed) {
+                    // the worker never saw the connection, so the next idle worker can take it
+                    queue.push_front(std::move(connection));
+                    continue;
+                }
+                BinaryStream stream(connection.fd, connection.fd);
+                sendError(stream, "The request could not be handed to a worker");
+                ::close(connection.fd);
+            }
+
+            if (!queue.empty())
+                logStats();
+        }
+
+        auto isAbandoned(const PendingConnection &connection) const -> bool {
+            if (connection.session_id == NO_SESSION)
+                return false;
+            auto session = sessions.find(connection.session_id);
+            return session == sessions.end() || session->second.relays.count(connection.tag) == 0;
+        }
+
+        void handleWorkerEvent(Worker &worker) {
+            char state;
+            if (::read(worker.control_fd, &state, 1) == 1) {
+                worker.busy = false;
+                return;
+            }
+
+            // the worker exited, either because it was recycled or because it crashed or timed out
+            ::close(worker.control_fd);
+            worker.control_fd = -1;
+            int status;
+            waitpid(worker.pid, &status, 0);
+            if (WIFSIGNALED(status))
+                Log::warn("R worker %d was killed by signal %d", worker.pid, WTERMSIG(status));
+            worker.pid = -1;
+            worker.busy = false;
+            recycled_workers++;
+            // replaced by spawnMissingWorkers(), which retries if that fails
+        }
+
+        void openSession(int fd, uint32_t capabilities) {
+            // acknowledge the session, so that the client knows it may send tagged requests
+            BinaryWriteBuffer acknowledgement;
+            acknowledgement.write<int>(RSERVER_MAGIC_NUMBER_V2);
+            // messages are relayed as bytes, so they cannot carry memory files
+            acknowledgement.write<uint32_t>(capabilities & ~RServerCapabilities::FD_PAYLOADS);
+
+            auto socket = std::make_unique<MessageSocket>(fd);
+            socket->send(MessageSocket::serialize(acknowledgement));
+            socket->flush();
+
+            const uint64_t session_id = next_session_id++;
+            sessions[session_id] = Session{std::move(socket), {}};
+            Log::info("Session %lu opened", static_cast<unsigned long>(session_id));
+        }
+
+        void handleSessionEvent(uint64_t session_id, short revents) {
+            auto session = sessions.find(session_id);
+            if (session == sessions.end())
+                return;
+
+            bool open = true;
+            if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                std::vector<std::string> messages;
+                open = session->second.socket->receive(messages);
+                for (auto &message : messages) {
+                    if (!handleSessionMessage(session_id, session->second, std::move(message))) {
+                        open = false;
+                        break;
+                    }
+                }
+            }
+            if (open)
+                open = flushSession(session->second);
+
+            if (!open) {
+                // the workers of unfinished requests see their socket closed
+                Log::info("Session %lu closed", static_cast<unsigned long>(session_id));
+                sessions.erase(session);
+            }
+        }
+
+        /**
+         * @return false if the message is malformed and the session has to be closed
+         */
+        auto handleSessionMessage(uint64_t session_id, Session &session, std::string message) -> bool {
+            uint32_t tag;
+            if (message.size() < sizeof(tag))
+                return false;
+            memcpy(&tag, message.data(), sizeof(tag));
+
+            auto relay = session.relays.find(tag);
+            if (relay != session.relays.end()) {
+                relay->second.socket->send(std::move(message), sizeof(tag));
+                relay->second.socket->flush();
+                return true;
+            }
+
+            // a new tag starts a request
+            try {
+                const auto received = std::chrono::steady_clock::now();
+                std::string header = message.substr(sizeof(tag));
+                if (RServerRequest::peekCapabilities(header) & RServerCapabilities::MULTIPLEX)
+                    throw ArgumentException("Sessions cannot be nested");
+                // the worker sees a Unix socket pair, but the messages are relayed as bytes
+                RServerRequest::removeCapabilities(header, RServerCapabilities::FD_PAYLOADS);
+
+                int sockets[2];
+                if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+                    throw PlatformException(std::string("socketpair() failed: ") + strerror(errno));
+                const bool compression = (RServerRequest::peekCapabilities(header) &
+                                           RServerCapabilities::COMPRESSION) != 0;
+                session.relays[tag] = Relay{std::make_unique<MessageSocket>(sockets[0]), compression, false, false};
+                queue.push_back(PendingConnection{sockets[1], std::move(header),
+                                                  RequestArrival{received, std::chrono::steady_clock::now()},
+                                                  session_id, tag});
+            } catch (const std::exception &e) {
+                Log::warn("Could not read request header: %s", e.what());
+                sendSessionError(session, tag, e.what(), "");
+            }
+            return true;
+        }
+
+        /**
+         * Sends a tagged error message
+         * @param codec the codec prefix if the request uses one, see `Relay`
+         */
+        static void sendSessionError(Session &session, uint32_t tag, std::string message, const std::string &codec) {
+            BinaryWriteBuffer error;
+            error.write<char>(-RSERVER_TYPE_ERROR);
+            error.write<std::string &>(message);
+            session.socket->send(MessageSocket::serialize(error), 0, encodeTag(tag) + codec);
+        }
+
+        /**
+         * Notes whether a message of the worker ends its request. Results and errors start with a negative type,
+         * requests for sources with a positive one.
+         * A compressed message counts as the result: the server only compresses messages of at least
+         * `rserver.compression.min_size`, and requests for sources are far smaller.
+         */
+        static void inspectWorkerMessage(Relay &relay, const std::string &message) {
+            if (relay.answered || message.empty())
+                return;
+            if (relay.codec_pending) {
+                relay.codec_pending = false;
+                // a header the worker could not parse is answered with an error and without a codec
+                if (message.size() == 1) {
+                    relay.encoded = message[0] != static_cast<char>(RServerCodecs::NONE);
+                    return;
+                }
+            }
+            size_t type = 0;
+            if (relay.encoded) {
+                if (message[0] != static_cast<char>(RServerCodecs::NONE)) {
+                    relay.answered = true;
+                    return;
+                }
+                type = 1;
+            }
+            if (message.size() > type && message[type] < 0)
+                relay.answered = true;
+        }
+
+        void handleRelayEvent(uint64_t session_id, uint32_t tag, short revents) {
+            auto session = sessions.find(session_id);
+            if (session == sessions.end())
+                return;
+            auto relay = session->second.relays.find(tag);
+            if (relay == session->second.relays.end())
+                return;
+
+            auto &socket = *relay->second.socket;
+            std::vector<std::string> messages;
+            bool open = true;
+            if (revents & (POLLIN | POLLHUP | POLLERR))
+                open = socket.receive(messages);
+            open = socket.flush() && open;
+            for (auto &message : messages) {
+                inspectWorkerMessage(relay->second, message);
+                session->second.socket->send(std::move(message), 0, encodeTag(tag));
+            }
+
+            // the worker closes its end when the request is done, or it was killed before it could answer
+            if (!open) {
+                if (!relay->second.answered) {
+                    Log::warn("Worker terminated before answering request %u of session %lu", tag,
+                              static_cast<unsigned long>(session_id));
+                    // a client that asked for compression expects the chosen codec first
+                    const std::string none(1, static_cast<char>(RServerCodecs::NONE));
+                    if (relay->second.codec_pending)
+                        session->second.socket->send(none, 0, encodeTag(tag));
+                    sendSessionError(session->second, tag, "worker terminated", relay->second.encoded ? none : "");
+                }
+                session->second.relays.erase(relay);
+            }
+
+            if (!flushSession(session->second))
+                sessions.erase(session);
+        }
+
+        static auto flushSession(Session &session) -> bool {
+            return session.socket->flush();
+        }
+
+        static auto encodeTag(uint32_t tag) -> std::string {
+            return std::string(reinterpret_cast<const char *>(&tag), sizeof(tag));
+        }
+
+        /**
+         * @return whether the session socket may be read, i.e. no request of the session has a backlog
+         */
+        static auto relaysAcceptInput(const Session &session) -> bool {
+            for (auto &relay : session.relays) {
+                if (relay.second.socket->getQueuedBytes() >= RELAY_HIGH_WATER_MARK)
+                    return false;
+            }
+            return true;
+        }
+
+        /**
+         * @param receiving whether to read from the socket, false while its messages could not be passed on
+         */
+        static auto pollEvents(const MessageSocket &socket, bool receiving) -> short {
+            return static_cast<short>((receiving ? POLLIN : 0) | (socket.wantsWrite() ? POLLOUT : 0));
+        }
+
+        /**
+         * Passes a header to a worker in the message that follows the client socket, together with its arrival
+         */
+        static void sendHeader(int control_fd, const PendingConnection &connection) {
+            const int64_t times[] = {getNanoseconds(connection.arrival.received),
+                                     getNanoseconds(connection.arrival.parsed)};
+            const size_t size = connection.header.size() + sizeof(times);
+            std::string message(reinterpret_cast<const char *>(&size), sizeof(size));
+            message += connection.header;
+            message.append(reinterpret_cast<const char *>(times), sizeof(times));
+
+            size_t offset = 0;
+            while (offset < message.size()) {
+                ssize_t w = ::write(control_fd, message.data() + offset, message.size() - offset);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0)
+                    throw NetworkException(std::string("write() failed: ") + strerror(errno));
+                offset += static_cast<size_t>(w);
+            }
+        }
+
+        /**
+         * Answers a request whose header cannot be parsed
+         */
+        static void sendError(BinaryStream &stream, std::string message) {
+            try {
+                BinaryWriteBuffer error;
+                error.write<char>(-RSERVER_TYPE_ERROR);
+                error.write<std::string &>(message);
+                stream.write(error);
+            } catch (const std::exception &e) {
+                Log::warn("Could not send error: %s", e.what());
+            }
+        }
+
+        void logStats() const {
+            auto stats = getStats();
+            Log::info("Worker pool: %zu workers, %zu idle, queue depth %zu, %zu recycled, %zu sessions", stats.workers,
+                      stats.idle_workers, stats.queue_depth, stats.recycled_workers, stats.sessions);
+        }
+
+        static void sendFileDescriptor(int socket, int fd) {
+            char data = 'F';
+            struct iovec iov{&data, 1};
+            char control[CMSG_SPACE(sizeof(int))] = {};
+
+            struct msghdr message{};
+            message.msg_iov = &iov;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+
+            struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(header), &fd, sizeof(int));
+
+            if (sendmsg(socket, &message, 0) != 1)
+                throw NetworkException(std::string("sendmsg() failed: ") + strerror(errno));
+        }
+
+        /**
+         * @return the received file descriptor or -1 if the socket was closed
+         */
+        static int receiveFileDescriptor(int socket) {
+            char data;
+            struct iovec iov{&data, 1};
+            char control[CMSG_SPACE(sizeof(int))] = {};
+
+            struct msghdr message{};
+            message.msg_iov = &iov;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+
+            if (recvmsg(socket, &message, 0) != 1)
+                return -1;
+
+            struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+            if (header == nullptr || header->cmsg_type != SCM_RIGHTS)
+                return -1;
+
+            int fd;
+            memcpy(&fd, CMSG_DATA(header), sizeof(int));
+            return fd;
+        }
+
+        /**
+         * Time points of the monotonic clock are the same in all processes, so they can be passed to workers
+         */
+        static auto getNanoseconds(std::chrono::steady_clock::time_point time) -> int64_t {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+        }
+
+        static auto readTimePoint(BinaryReadBuffer &buffer) -> std::chrono::steady_clock::time_point {
+            return std::chrono::steady_clock::time_point(std::chrono::duration_cast<
+                    std::chrono::steady_clock::duration>(std::chrono::nanoseconds(buffer.read<int64_t>())));
+        }
+
+        /**
+         * @return the bytes of memory that the worker does not share with the parent. The resident set also counts
+         *  the copy-on-write pages inherited from the parent, which every worker would exceed right after it forked.
+         *  Falls back to the resident set on kernels without `smaps_rollup`.
+         */
+        static size_t getResidentMemory() {
+            std::ifstream rollup("/proc/self/smaps_rollup");
+            std::string key;
+            size_t kilobytes;
+            while (rollup >> key) {
+                if (key == "Private_Dirty:" && rollup >> kilobytes)
+                    return kilobytes * 1024;
+                rollup.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            }
+
+            std::ifstream statm("/proc/self/statm");
+            size_t size = 0, resident = 0;
+            statm >> size >> resident;
+            return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        }
+
+        /// bytes queued for one side of a session, above which the other side is not read anymore
+        static const size_t RELAY_HIGH_WATER_MARK = 4 * 1024 * 1024;
+        /// the session of a request that came on its own connection
+        static const uint64_t NO_SESSION = std::numeric_limits<uint64_t>::max();
+
+        RequestHandler handler;
+        size_t max_requests_per_worker;
+        size_t max_worker_memory;
+        std::vector<int> listen_fds;
+        std::vector<Worker> workers;
+        std::deque<PendingConnection> queue;
+        HeaderReader headers;
+        std::chrono::steady_clock::time_point next_spawn_attempt;
+        size_t recycled_workers;
+        std::map<uint64_t, Session> sessions;
+        uint64_t next_session_id;
+        ServerMetrics *metrics;
+};